@@ -0,0 +1,196 @@
+#include "cache.h"
+#include "betterassert.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+/*
+ * Storage cache
+ *
+ * Accesses to the FS state are delayed, to emulate it being in secondary
+ * storage. The cache tracks which inodes and blocks (and bitmaps) an
+ * in-memory cache of that storage would hold, so that only accesses to units
+ * not in the cache are delayed.
+ *
+ * Units are replaced following the CLOCK algorithm: each slot has a
+ * referenced bit, set on every hit; on a miss, the hand sweeps the slots,
+ * clearing the bits that are set, and replaces the first unit that was not
+ * referenced since the previous sweep.
+ *
+ * Units are numbered densely (the two bitmaps, then the inodes, then the
+ * blocks), so a table indexed by unit holds the slot of every cached unit,
+ * and hits take no lock (only replacements do).
+ */
+
+#define CACHE_EMPTY (SIZE_MAX)
+
+typedef struct {
+    size_t cs_unit; // CACHE_EMPTY if the slot is free
+    bool cs_referenced;
+} cache_slot_t;
+
+static struct {
+    size_t capacity; // 0 if disabled (every access is a miss)
+    size_t inode_count;
+    size_t unit_count;
+
+    cache_slot_t *slots;
+    size_t *slot_of; // slot of each unit, CACHE_EMPTY if not cached
+
+    pthread_mutex_t lock; // protects replacements and the hand
+    size_t hand;
+
+    uint64_t hits;
+    uint64_t misses;
+} cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/**
+ * Initialize the cache.
+ *
+ * Input:
+ *   - capacity: number of units (inodes, blocks or bitmaps) cached; 0
+ *     disables the cache
+ *   - inode_count: number of inodes in the FS
+ *   - block_count: number of data blocks in the FS
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int cache_init(size_t capacity, size_t inode_count, size_t block_count) {
+    cache.inode_count = inode_count;
+    cache.unit_count = 2 + inode_count + block_count;
+    cache.capacity =
+        capacity < cache.unit_count ? capacity : cache.unit_count;
+    cache.hand = 0;
+    cache.hits = 0;
+    cache.misses = 0;
+
+    if (cache.capacity == 0) {
+        return 0;
+    }
+
+    cache.slots = malloc(cache.capacity * sizeof(cache_slot_t));
+    cache.slot_of = malloc(cache.unit_count * sizeof(size_t));
+    if (cache.slots == NULL || cache.slot_of == NULL) {
+        cache_destroy();
+        return -1;
+    }
+
+    for (size_t i = 0; i < cache.capacity; i++) {
+        cache.slots[i].cs_unit = CACHE_EMPTY;
+        cache.slots[i].cs_referenced = false;
+    }
+    for (size_t i = 0; i < cache.unit_count; i++) {
+        cache.slot_of[i] = CACHE_EMPTY;
+    }
+
+    return 0;
+}
+
+/**
+ * Free the cache.
+ */
+void cache_destroy(void) {
+    free(cache.slots);
+    free(cache.slot_of);
+    cache.slots = NULL;
+    cache.slot_of = NULL;
+    cache.capacity = 0;
+}
+
+/**
+ * Find the slot to replace, advancing the hand (with the lock held).
+ */
+static size_t clock_victim(void) {
+    // terminates within two sweeps, as the first clears every bit
+    while (true) {
+        size_t slot = cache.hand;
+        cache.hand = (cache.hand + 1) % cache.capacity;
+
+        cache_slot_t *s = &cache.slots[slot];
+        if (s->cs_unit == CACHE_EMPTY ||
+            !__atomic_exchange_n(&s->cs_referenced, false, __ATOMIC_RELAXED)) {
+            return slot;
+        }
+    }
+}
+
+/**
+ * Record an access to a unit, bringing it into the cache if needed.
+ *
+ * Input:
+ *   - kind: kind of the unit
+ *   - number: number of the unit (for inodes and blocks, ignored otherwise)
+ *
+ * Returns true if the unit was cached (a hit), false if it was not (a miss,
+ * whose storage access delay is up to the caller).
+ */
+bool cache_access(cache_kind_t kind, size_t number) {
+    if (cache.capacity == 0) {
+        __atomic_add_fetch(&cache.misses, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    size_t unit;
+    switch (kind) {
+    case CACHE_INODE_BITMAP:
+        unit = 0;
+        break;
+    case CACHE_BLOCK_BITMAP:
+        unit = 1;
+        break;
+    case CACHE_INODE:
+        unit = 2 + number;
+        break;
+    case CACHE_BLOCK:
+        unit = 2 + cache.inode_count + number;
+        break;
+    default:
+        PANIC("cache_access: unknown unit kind");
+    }
+    ALWAYS_ASSERT(unit < cache.unit_count, "cache_access: invalid unit");
+
+    size_t slot = __atomic_load_n(&cache.slot_of[unit], __ATOMIC_ACQUIRE);
+    if (slot != CACHE_EMPTY) {
+        cache_slot_t *s = &cache.slots[slot];
+        __atomic_store_n(&s->cs_referenced, true, __ATOMIC_RELAXED);
+
+        // the slot may have been replaced since it was looked up
+        if (__atomic_load_n(&s->cs_unit, __ATOMIC_RELAXED) == unit) {
+            __atomic_add_fetch(&cache.hits, 1, __ATOMIC_RELAXED);
+            return true;
+        }
+    }
+
+    ALWAYS_ASSERT(pthread_mutex_lock(&cache.lock) == 0,
+                  "cache_access: failed to lock cache");
+
+    // another access may have brought the unit in meanwhile
+    bool hit = __atomic_load_n(&cache.slot_of[unit], __ATOMIC_RELAXED) !=
+               CACHE_EMPTY;
+    if (!hit) {
+        slot = clock_victim();
+        cache_slot_t *s = &cache.slots[slot];
+        if (s->cs_unit != CACHE_EMPTY) {
+            __atomic_store_n(&cache.slot_of[s->cs_unit], CACHE_EMPTY,
+                             __ATOMIC_RELAXED);
+        }
+
+        __atomic_store_n(&s->cs_unit, unit, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->cs_referenced, true, __ATOMIC_RELAXED);
+        __atomic_store_n(&cache.slot_of[unit], slot, __ATOMIC_RELEASE);
+    }
+
+    ALWAYS_ASSERT(pthread_mutex_unlock(&cache.lock) == 0,
+                  "cache_access: failed to unlock cache");
+
+    __atomic_add_fetch(hit ? &cache.hits : &cache.misses, 1, __ATOMIC_RELAXED);
+    return hit;
+}
+
+/**
+ * Obtain the number of hits and misses since the cache was initialized.
+ */
+void cache_stats(uint64_t *hits, uint64_t *misses) {
+    *hits = __atomic_load_n(&cache.hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&cache.misses, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,24 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Kinds of storage units kept in the cache.
+ */
+typedef enum {
+    CACHE_INODE_BITMAP,
+    CACHE_BLOCK_BITMAP,
+    CACHE_INODE, // numbered by inumber
+    CACHE_BLOCK, // numbered by block number
+} cache_kind_t;
+
+int cache_init(size_t capacity, size_t inode_count, size_t block_count);
+void cache_destroy(void);
+
+bool cache_access(cache_kind_t kind, size_t number);
+void cache_stats(uint64_t *hits, uint64_t *misses);
+
+#endif // CACHE_H
@@ -6,6 +6,13 @@
 
 #define MAX_FILE_NAME (40)
 
+// Number of direct block pointers in an inode (followed by one single and one
+// double indirect block pointer)
+#define INODE_DIRECT_BLOCKS (10)
+
 #define DELAY (5000)
 
+// Size the write-ahead log may reach before the image is checkpointed
+#define WAL_CHECKPOINT_SIZE (4 * 1024 * 1024)
+
 #endif // CONFIG_H
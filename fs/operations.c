@@ -1,7 +1,9 @@
 #include "operations.h"
+#include "cache.h"
 #include "config.h"
 #include "state.h"
-#include <errno.h>
+#include "wal.h"
+#include <limits.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -10,7 +12,15 @@
 
 #include "betterassert.h"
 
-pthread_mutex_t g_library_mutex = PTHREAD_MUTEX_INITIALIZER;
+// whether changes are logged (only with an image)
+static bool logging;
+
+// Checkpoints (writing the image and emptying the log) wait for the logged
+// operations in progress, which hold the checkpoint lock for reading; the
+// gate keeps new ones from starting while a checkpoint waits
+static pthread_rwlock_t checkpoint_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t checkpoint_gate = PTHREAD_MUTEX_INITIALIZER;
+static bool checkpoint_wanted;
 
 tfs_params tfs_default_params()
 {
@@ -19,10 +29,320 @@ tfs_params tfs_default_params()
       .max_block_count = 1024,
       .max_open_files_count = 16,
       .block_size = 1024,
+      .image_path = NULL,
+      .wal_group_size = 64,
+      .wal_group_delay_us = 2000,
+      .cache_size = 256,
   };
   return params;
 }
 
+/**
+ * Write the FS to its image and empty the log.
+ *
+ * Input:
+ *   - force: whether to checkpoint even if the log is still small
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int checkpoint(bool force)
+{
+  pthread_mutex_lock(&checkpoint_gate);
+  __atomic_store_n(&checkpoint_wanted, true, __ATOMIC_RELAXED);
+  pthread_rwlock_wrlock(&checkpoint_lock);
+
+  // another operation may have checkpointed while this one waited
+  int ret = 0;
+  if (force || wal_size() >= WAL_CHECKPOINT_SIZE)
+  {
+    ret = state_checkpoint();
+
+    // the log must name the new image: changes logged after it under the old
+    // one would never be replayed
+    if (ret == 0)
+    {
+      ALWAYS_ASSERT(wal_reset(state_generation()) == 0,
+                    "checkpoint: failed to empty the log");
+    }
+  }
+
+  pthread_rwlock_unlock(&checkpoint_lock);
+  __atomic_store_n(&checkpoint_wanted, false, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&checkpoint_gate);
+  return ret;
+}
+
+/**
+ * Start an operation that changes the FS (to be called before taking any
+ * other lock).
+ *
+ * Returns whether the operation is logged.
+ */
+static bool begin_logged_op(void)
+{
+  if (!logging)
+  {
+    return false;
+  }
+
+  // let a waiting checkpoint go first
+  if (__atomic_load_n(&checkpoint_wanted, __ATOMIC_RELAXED))
+  {
+    pthread_mutex_lock(&checkpoint_gate);
+    pthread_mutex_unlock(&checkpoint_gate);
+  }
+
+  pthread_rwlock_rdlock(&checkpoint_lock);
+  return true;
+}
+
+/**
+ * Finish an operation started with begin_logged_op (once every other lock is
+ * released), checkpointing if the log grew large.
+ */
+static void end_logged_op(bool logged)
+{
+  if (!logged)
+  {
+    return;
+  }
+
+  pthread_rwlock_unlock(&checkpoint_lock);
+
+  if (wal_size() >= WAL_CHECKPOINT_SIZE && checkpoint(false) != 0)
+  {
+    WARN("failed to checkpoint the file system image");
+  }
+}
+
+/**
+ * Cursor over a set of buffers, copied to or from blocks one piece at a time.
+ */
+typedef struct
+{
+  struct iovec const *iov;
+  size_t offset; // within the current buffer
+} iov_cursor_t;
+
+/**
+ * Copies len bytes between a block and the buffers, advancing the cursor.
+ *
+ * Input:
+ *   - cursor: position in the buffers
+ *   - block: where to copy to (to_buffers == false) or from
+ *   - len: how many bytes to copy (no more than left in the buffers)
+ *   - to_buffers: whether to copy from the block to the buffers
+ */
+static void iov_copy(iov_cursor_t *cursor, void *block, size_t len,
+                     bool to_buffers)
+{
+  size_t copied = 0;
+  while (copied < len)
+  {
+    size_t chunk = cursor->iov->iov_len - cursor->offset;
+    if (chunk > len - copied)
+    {
+      chunk = len - copied;
+    }
+
+    void *buffer = (char *)cursor->iov->iov_base + cursor->offset;
+    if (to_buffers)
+    {
+      memcpy(buffer, block + copied, chunk);
+    }
+    else
+    {
+      memcpy(block + copied, buffer, chunk);
+    }
+    copied += chunk;
+
+    cursor->offset += chunk;
+    if (cursor->offset == cursor->iov->iov_len)
+    {
+      cursor->iov++;
+      cursor->offset = 0;
+    }
+  }
+}
+
+/**
+ * Writes to an inode, block by block, allocating blocks as the file grows
+ * (each block is filled from as many buffers as needed, so that it is only
+ * accessed once).
+ *
+ * Input:
+ *   - inode: the file's inode (locked for writing)
+ *   - offset: where to start writing
+ *   - iov: the buffers with the contents to write
+ *   - to_write: how many bytes of the buffers to write
+ *
+ * Returns the number of bytes written (lower than to_write if there is no
+ * space left).
+ */
+static size_t inode_write(inode_t *inode, size_t offset,
+                          struct iovec const *iov, size_t to_write)
+{
+  iov_cursor_t cursor = {.iov = iov, .offset = 0};
+  size_t block_size = state_block_size();
+  size_t written = 0;
+  while (written < to_write)
+  {
+    size_t position = offset + written;
+    size_t block_offset = position % block_size;
+    size_t chunk = block_size - block_offset;
+    if (chunk > to_write - written)
+    {
+      chunk = to_write - written;
+    }
+
+    int bnum = inode_block_alloc(inode, position / block_size);
+    if (bnum == -1)
+    {
+      break; // no space
+    }
+
+    void *block = data_block_get(bnum);
+    ALWAYS_ASSERT(block != NULL, "inode_write: data block deleted mid-write");
+
+    // Perform the actual write
+    iov_copy(&cursor, block + block_offset, chunk, false);
+    written += chunk;
+  }
+
+  if (offset + written > inode->i_size)
+  {
+    inode->i_size = offset + written;
+  }
+  if (written > 0)
+  {
+    inode->i_version++;
+  }
+
+  return written;
+}
+
+/**
+ * Reads from an inode, block by block, into a set of buffers.
+ *
+ * Input:
+ *   - inode: the file's inode (locked)
+ *   - offset: where to start reading (within the file size)
+ *   - iov: the buffers
+ *   - to_read: how many bytes to read (within the file size and the buffers)
+ */
+static void inode_read(inode_t const *inode, size_t offset,
+                       struct iovec const *iov, size_t to_read)
+{
+  iov_cursor_t cursor = {.iov = iov, .offset = 0};
+  size_t block_size = state_block_size();
+  size_t bytes_read = 0;
+  while (bytes_read < to_read)
+  {
+    size_t position = offset + bytes_read;
+    size_t block_offset = position % block_size;
+    size_t chunk = block_size - block_offset;
+    if (chunk > to_read - bytes_read)
+    {
+      chunk = to_read - bytes_read;
+    }
+
+    int bnum = inode_block_get(inode, position / block_size);
+    if (bnum == -1)
+    {
+      // hole left by a truncate through another handle
+      char zeros[chunk];
+      memset(zeros, 0, chunk);
+      iov_copy(&cursor, zeros, chunk, true);
+    }
+    else
+    {
+      void *block = data_block_get(bnum);
+      ALWAYS_ASSERT(block != NULL, "inode_read: data block deleted mid-read");
+
+      // Perform the actual read
+      iov_copy(&cursor, block + block_offset, chunk, true);
+    }
+    bytes_read += chunk;
+  }
+}
+
+/**
+ * Truncates an inode to a given size, freeing the blocks past it.
+ *
+ * Input:
+ *   - inode: the file's inode (locked for writing)
+ *   - size: the new size (no larger than the current one)
+ */
+static void inode_truncate(inode_t *inode, size_t size)
+{
+  size_t block_size = state_block_size();
+  inode_blocks_free(inode, (size + block_size - 1) / block_size);
+
+  // the rest of a partial last block must read as zeros if the file grows
+  // past it again
+  int bnum = size % block_size == 0 ? -1 : inode_block_get(inode, size / block_size);
+  if (bnum != -1)
+  {
+    memset((char *)data_block_get(bnum) + size % block_size, 0, block_size - size % block_size);
+  }
+
+  inode->i_size = size;
+  inode->i_version++;
+}
+
+/**
+ * Apply a change from the log (replayed in the order it was logged, so that
+ * inodes are allocated with the same numbers as when it was made).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int replay_change(wal_op_t op, int inumber, size_t offset,
+                         void const *payload, size_t len)
+{
+  inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
+
+  char name[MAX_FILE_NAME];
+  if (op == WAL_CREATE || op == WAL_UNLINK)
+  {
+    if (len == 0 || len >= MAX_FILE_NAME)
+    {
+      return -1;
+    }
+    memcpy(name, payload, len);
+    name[len] = '\0';
+  }
+
+  switch (op)
+  {
+  case WAL_CREATE:
+    if (inode_create(T_FILE) != inumber)
+    {
+      return -1;
+    }
+    return add_dir_entry(root_dir_inode, name, inumber);
+  case WAL_TRUNCATE:
+  {
+    inode_t *inode = inode_get(inumber);
+    if (offset > inode->i_size)
+    {
+      return -1;
+    }
+    inode_truncate(inode, offset);
+    return 0;
+  }
+  case WAL_WRITE:
+  {
+    struct iovec iov = {.iov_base = (void *)payload, .iov_len = len};
+    return inode_write(inode_get(inumber), offset, &iov, len) == len ? 0 : -1;
+  }
+  case WAL_UNLINK:
+    inode_delete(inumber);
+    return clear_dir_entry(root_dir_inode, name);
+  default:
+    return -1;
+  }
+}
+
 int tfs_init(tfs_params const *params_ptr)
 {
   tfs_params params;
@@ -40,11 +360,43 @@ int tfs_init(tfs_params const *params_ptr)
     return -1;
   }
 
-  // create root inode
-  int root = inode_create(T_DIRECTORY);
-  if (root != ROOT_DIR_INUM)
+  if (params.image_path != NULL)
   {
-    return -1;
+    char wal_path[PATH_MAX];
+    if (snprintf(wal_path, sizeof(wal_path), "%s.wal", params.image_path) >= (int)sizeof(wal_path) ||
+        wal_open(wal_path, params.wal_group_size, params.wal_group_delay_us) != 0)
+    {
+      return -1;
+    }
+  }
+
+  if (state_restored())
+  {
+    // a restored image already has its root inode, and the changes logged
+    // since it was written are replayed over it
+    if (wal_replay(state_generation(), replay_change) == -1)
+    {
+      return -1;
+    }
+  }
+  else
+  {
+    // create root inode
+    int root = inode_create(T_DIRECTORY);
+    if (root != ROOT_DIR_INUM)
+    {
+      return -1;
+    }
+  }
+
+  if (params.image_path != NULL)
+  {
+    // start logging from an up to date image
+    if (checkpoint(true) != 0)
+    {
+      return -1;
+    }
+    logging = true;
   }
 
   return 0;
@@ -52,6 +404,18 @@ int tfs_init(tfs_params const *params_ptr)
 
 int tfs_destroy()
 {
+  if (logging)
+  {
+    // the image gets every change, so the log is not needed anymore (if the
+    // checkpoint fails, the log is kept, durable, to be replayed)
+    if (checkpoint(true) != 0)
+    {
+      wal_sync();
+    }
+    wal_close();
+    logging = false;
+  }
+
   if (state_destroy() != 0)
   {
     return -1;
@@ -59,6 +423,15 @@ int tfs_destroy()
   return 0;
 }
 
+int tfs_sync(void)
+{
+  if (!logging)
+  {
+    return 0;
+  }
+  return wal_sync();
+}
+
 static bool valid_pathname(char const *name)
 {
   return name != NULL && strlen(name) > 1 && name[0] == '/';
@@ -90,22 +463,21 @@ static int tfs_lookup(char const *name, inode_t const *root_inode)
 
 int tfs_open(char const *name, tfs_file_mode_t mode)
 {
-  if (pthread_mutex_lock(&g_library_mutex) == -1)
-  {
-    WARN("failed to lock mutex: %s", strerror(errno));
-    return -1;
-  }
   // Checks if the path name is valid
   if (!valid_pathname(name))
   {
-    if (pthread_mutex_unlock(&g_library_mutex) == -1)
-    {
-      WARN("failed to unlock mutex: %s", strerror(errno));
-      return -1;
-    }
     return -1;
   }
 
+  bool logged = (mode & (TFS_O_CREAT | TFS_O_TRUNC)) && begin_logged_op();
+
+  // Creating a file changes the root directory, so it needs exclusive access;
+  // plain lookups can proceed in parallel
+  if (mode & TFS_O_CREAT)
+    inode_wrlock(ROOT_DIR_INUM);
+  else
+    inode_rdlock(ROOT_DIR_INUM);
+
   inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
   ALWAYS_ASSERT(root_dir_inode != NULL,
                 "tfs_open: root dir inode must exist");
@@ -119,13 +491,22 @@ int tfs_open(char const *name, tfs_file_mode_t mode)
     ALWAYS_ASSERT(inode != NULL,
                   "tfs_open: directory files must have an inode");
 
+    if (mode & TFS_O_TRUNC)
+      inode_wrlock(inum);
+    else
+      inode_rdlock(inum);
+
     // Truncate (if requested)
     if (mode & TFS_O_TRUNC)
     {
       if (inode->i_size > 0)
       {
-        data_block_free(inode->i_data_block);
-        inode->i_size = 0;
+        inode_truncate(inode, 0);
+
+        if (logged)
+        {
+          wal_log(WAL_TRUNCATE, inum, 0, NULL, 0);
+        }
       }
     }
     // Determine initial offset
@@ -137,6 +518,8 @@ int tfs_open(char const *name, tfs_file_mode_t mode)
     {
       offset = 0;
     }
+
+    inode_unlock(inum);
   }
   else if (mode & TFS_O_CREAT)
   {
@@ -145,11 +528,8 @@ int tfs_open(char const *name, tfs_file_mode_t mode)
     inum = inode_create(T_FILE);
     if (inum == -1)
     {
-      if (pthread_mutex_unlock(&g_library_mutex) == -1)
-      {
-        WARN("failed to unlock mutex: %s", strerror(errno));
-        return -1;
-      }
+      inode_unlock(ROOT_DIR_INUM);
+      end_logged_op(logged);
       return -1; // no space in inode table
     }
 
@@ -157,35 +537,33 @@ int tfs_open(char const *name, tfs_file_mode_t mode)
     if (add_dir_entry(root_dir_inode, name + 1, inum) == -1)
     {
       inode_delete(inum);
-      if (pthread_mutex_unlock(&g_library_mutex) == -1)
-      {
-        WARN("failed to unlock mutex: %s", strerror(errno));
-        return -1;
-      }
+      inode_unlock(ROOT_DIR_INUM);
+      end_logged_op(logged);
       return -1; // no space in directory
     }
 
+    // logged with the root directory locked, so that creations and deletions
+    // are logged in the order they allocate inodes
+    if (logged)
+    {
+      wal_log(WAL_CREATE, inum, 0, name + 1, strlen(name + 1));
+    }
+
     offset = 0;
   }
   else
   {
-    if (pthread_mutex_unlock(&g_library_mutex) == -1)
-    {
-      WARN("failed to unlock mutex: %s", strerror(errno));
-      return -1;
-    }
+    inode_unlock(ROOT_DIR_INUM);
+    end_logged_op(logged);
     return -1;
   }
 
+  inode_unlock(ROOT_DIR_INUM);
+  end_logged_op(logged);
+
   // Finally, add entry to the open file table and return the corresponding
   // handle
-  int ret = add_to_open_file_table(inum, offset);
-  if (pthread_mutex_unlock(&g_library_mutex) == -1)
-  {
-    WARN("failed to unlock mutex: %s", strerror(errno));
-    return -1;
-  }
-  return ret;
+  return add_to_open_file_table(inum, offset);
 
   // Note: for simplification, if file was created with TFS_O_CREAT and there
   // is an error adding an entry to the open file table, the file is not
@@ -194,199 +572,387 @@ int tfs_open(char const *name, tfs_file_mode_t mode)
 
 int tfs_close(int fhandle)
 {
-  if (pthread_mutex_lock(&g_library_mutex) == -1)
-  {
-    WARN("failed to lock mutex: %s", strerror(errno));
-    return -1;
-  }
-  open_file_entry_t *file = get_open_file_entry(fhandle);
+  open_file_entry_t *file = lock_open_file_entry(fhandle);
   if (file == NULL)
   {
-    if (pthread_mutex_unlock(&g_library_mutex) == -1)
-    {
-      WARN("failed to unlock mutex: %s", strerror(errno));
-      return -1;
-    }
     return -1; // invalid fd
   }
 
   remove_from_open_file_table(fhandle);
+  unlock_open_file_entry(file);
+
+  return 0;
+}
 
-  if (pthread_mutex_unlock(&g_library_mutex) == -1)
+/**
+ * Writes the contents of a set of buffers to a file, as a single write (under
+ * a single lock acquisition, and a single log record).
+ *
+ * Input:
+ *   - inumber: the file's inumber
+ *   - iov: the buffers
+ *   - iovcnt: number of buffers
+ *   - offset: where to start writing; with append, where the write started
+ *     (the end of the file) is stored in it
+ *   - append: whether to write at the end of the file
+ *   - logged: whether to log the write
+ *
+ * Returns the number of bytes written, or -1 in case of error.
+ */
+static ssize_t file_writev(int inumber, struct iovec const *iov, int iovcnt,
+                           size_t *offset, bool append, bool logged)
+{
+  inode_t *inode = inode_get(inumber);
+  ALWAYS_ASSERT(inode != NULL, "file_writev: inode of open file deleted");
+
+  inode_wrlock(inumber);
+
+  if (append)
   {
-    WARN("failed to unlock mutex: %s", strerror(errno));
-    return -1;
+    *offset = inode->i_size;
   }
-  return 0;
+
+  // Determine how many bytes to write
+  size_t to_write = 0;
+  for (int i = 0; i < iovcnt; i++)
+  {
+    to_write += iov[i].iov_len;
+  }
+
+  size_t max_file_size = state_max_file_size();
+  if (*offset >= max_file_size)
+  {
+    to_write = 0;
+  }
+  else if (to_write > max_file_size - *offset)
+  {
+    to_write = max_file_size - *offset;
+  }
+
+  size_t written = inode_write(inode, *offset, iov, to_write);
+
+  if (written == 0 && to_write > 0)
+  {
+    inode_unlock(inumber);
+    return -1; // no space
+  }
+
+  // logged with the inode locked, in the order of the writes to the file
+  if (logged && written > 0)
+  {
+    wal_logv(WAL_WRITE, inumber, *offset, iov, iovcnt, written);
+  }
+
+  inode_unlock(inumber);
+  return (ssize_t)written;
 }
 
-ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write)
+/**
+ * Reads from a file into a set of buffers.
+ *
+ * Input:
+ *   - inumber: the file's inumber
+ *   - iov: the buffers
+ *   - iovcnt: number of buffers
+ *   - offset: where to start reading
+ *
+ * Returns the number of bytes read (lower than the total length of the
+ * buffers if the end of the file was reached).
+ */
+static ssize_t file_readv(int inumber, struct iovec const *iov, int iovcnt,
+                          size_t offset)
 {
-  if (pthread_mutex_lock(&g_library_mutex) == -1)
+  inode_t const *inode = inode_get(inumber);
+  ALWAYS_ASSERT(inode != NULL, "file_readv: inode of open file deleted");
+
+  // Readers of the same file proceed in parallel
+  inode_rdlock(inumber);
+
+  // Determine how many bytes to read
+  size_t bytes_read = 0;
+  for (int i = 0; i < iovcnt; i++)
   {
-    WARN("failed to lock mutex: %s", strerror(errno));
-    return -1;
+    bytes_read += iov[i].iov_len;
+  }
+  if (offset >= inode->i_size)
+  {
+    bytes_read = 0;
+  }
+  else if (bytes_read > inode->i_size - offset)
+  {
+    bytes_read = inode->i_size - offset;
   }
-  open_file_entry_t *file = get_open_file_entry(fhandle);
+
+  inode_read(inode, offset, iov, bytes_read);
+
+  inode_unlock(inumber);
+  return (ssize_t)bytes_read;
+}
+
+/**
+ * Obtain the inumber of an open file (for operations that do not use the
+ * file offset, so that they do not hold the open file entry).
+ *
+ * Returns the inumber, or -1 if the file handle is not open.
+ */
+static int open_file_inumber(int fhandle)
+{
+  open_file_entry_t *file = lock_open_file_entry(fhandle);
   if (file == NULL)
   {
-    if (pthread_mutex_unlock(&g_library_mutex) == -1)
-    {
-      WARN("failed to unlock mutex: %s", strerror(errno));
-      return -1;
-    }
     return -1;
   }
 
-  //  From the open file table entry, we get the inode
-  inode_t *inode = inode_get(file->of_inumber);
-  ALWAYS_ASSERT(inode != NULL, "tfs_write: inode of open file deleted");
+  int inumber = file->of_inumber;
+  unlock_open_file_entry(file);
+  return inumber;
+}
 
-  // Determine how many bytes to write
-  size_t block_size = state_block_size();
-  if (to_write + file->of_offset > block_size)
+ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write)
+{
+  struct iovec iov = {.iov_base = (void *)buffer, .iov_len = to_write};
+  return tfs_writev(fhandle, &iov, 1);
+}
+
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt)
+{
+  bool logged = begin_logged_op();
+
+  open_file_entry_t *file = lock_open_file_entry(fhandle);
+  if (file == NULL)
   {
-    to_write = block_size - file->of_offset;
+    end_logged_op(logged);
+    return -1;
   }
 
-  if (to_write > 0)
+  size_t offset = file->of_offset;
+  ssize_t written =
+      file_writev(file->of_inumber, iov, iovcnt, &offset, false, logged);
+
+  // The offset associated with the file handle is incremented accordingly
+  if (written > 0)
   {
-    if (inode->i_size == 0)
-    {
-      // If empty file, allocate new block
-      int bnum = data_block_alloc();
-      if (bnum == -1)
-      {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1)
-        {
-          WARN("failed to unlock mutex: %s", strerror(errno));
-          return -1;
-        }
-        return -1; // no space
-      }
+    file->of_offset += (size_t)written;
+  }
 
-      inode->i_data_block = bnum;
-    }
+  unlock_open_file_entry(file);
+  end_logged_op(logged);
+  return written;
+}
 
-    void *block = data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(block != NULL, "tfs_write: data block deleted mid-write");
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, size_t offset)
+{
+  bool logged = begin_logged_op();
 
-    // Perform the actual write
-    memcpy(block + file->of_offset, buffer, to_write);
+  int inumber = open_file_inumber(fhandle);
+  struct iovec iov = {.iov_base = (void *)buffer, .iov_len = len};
+  ssize_t written =
+      inumber == -1 ? -1 : file_writev(inumber, &iov, 1, &offset, false, logged);
 
-    // The offset associated with the file handle is incremented accordingly
-    file->of_offset += to_write;
-    if (file->of_offset > inode->i_size)
-    {
-      inode->i_size = file->of_offset;
-    }
-  }
+  end_logged_op(logged);
+  return written;
+}
+
+ssize_t tfs_append(int fhandle, void const *buffer, size_t len, size_t *offset)
+{
+  struct iovec iov = {.iov_base = (void *)buffer, .iov_len = len};
+  return tfs_appendv(fhandle, &iov, 1, offset);
+}
+
+ssize_t tfs_appendv(int fhandle, struct iovec const *iov, int iovcnt,
+                    size_t *offset)
+{
+  bool logged = begin_logged_op();
+
+  int inumber = open_file_inumber(fhandle);
+  size_t start = 0;
+  ssize_t written =
+      inumber == -1 ? -1 : file_writev(inumber, iov, iovcnt, &start, true, logged);
 
-  if (pthread_mutex_unlock(&g_library_mutex) == -1)
+  if (written != -1 && offset != NULL)
   {
-    WARN("failed to unlock mutex: %s", strerror(errno));
-    return -1;
+    *offset = start;
   }
-  return (ssize_t)to_write;
+
+  end_logged_op(logged);
+  return written;
 }
 
-ssize_t tfs_read(int fhandle, void *buffer, size_t len)
+int tfs_truncate(int fhandle, size_t length)
 {
-  if (pthread_mutex_lock(&g_library_mutex) == -1)
+  bool logged = begin_logged_op();
+
+  int inumber = open_file_inumber(fhandle);
+  if (inumber == -1)
   {
-    WARN("failed to lock mutex: %s", strerror(errno));
+    end_logged_op(logged);
     return -1;
   }
-  open_file_entry_t *file = get_open_file_entry(fhandle);
-  if (file == NULL)
+
+  inode_t *inode = inode_get(inumber);
+  ALWAYS_ASSERT(inode != NULL, "tfs_truncate: inode of open file deleted");
+
+  inode_wrlock(inumber);
+
+  int ret = -1;
+  if (length <= inode->i_size)
   {
-    if (pthread_mutex_unlock(&g_library_mutex) == -1)
+    inode_truncate(inode, length);
+    ret = 0;
+
+    // the new length is logged in the offset
+    if (logged)
     {
-      WARN("failed to unlock mutex: %s", strerror(errno));
-      return -1;
+      wal_log(WAL_TRUNCATE, inumber, length, NULL, 0);
     }
-    return -1;
   }
 
-  // From the open file table entry, we get the inode
-  inode_t const *inode = inode_get(file->of_inumber);
-  ALWAYS_ASSERT(inode != NULL, "tfs_read: inode of open file deleted");
+  inode_unlock(inumber);
+  end_logged_op(logged);
+  return ret;
+}
 
-  // Determine how many bytes to read
-  size_t to_read = inode->i_size - file->of_offset;
-  if (to_read > len)
+ssize_t tfs_read(int fhandle, void *buffer, size_t len)
+{
+  struct iovec iov = {.iov_base = buffer, .iov_len = len};
+  return tfs_readv(fhandle, &iov, 1);
+}
+
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt)
+{
+  open_file_entry_t *file = lock_open_file_entry(fhandle);
+  if (file == NULL)
   {
-    to_read = len;
+    return -1;
   }
 
-  if (to_read > 0)
-  {
-    void *block = data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(block != NULL, "tfs_read: data block deleted mid-read");
+  ssize_t bytes_read = file_readv(file->of_inumber, iov, iovcnt, file->of_offset);
 
-    // Perform the actual read
-    memcpy(buffer, block + file->of_offset, to_read);
-    // The offset associated with the file handle is incremented accordingly
-    file->of_offset += to_read;
-  }
+  // The offset associated with the file handle is incremented accordingly
+  file->of_offset += (size_t)bytes_read;
+
+  unlock_open_file_entry(file);
+  return bytes_read;
+}
 
-  if (pthread_mutex_unlock(&g_library_mutex) == -1)
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset)
+{
+  int inumber = open_file_inumber(fhandle);
+  if (inumber == -1)
   {
-    WARN("failed to unlock mutex: %s", strerror(errno));
     return -1;
   }
-  return (ssize_t)to_read;
+
+  struct iovec iov = {.iov_base = buffer, .iov_len = len};
+  return file_readv(inumber, &iov, 1, offset);
 }
 
-int tfs_unlink(char const *target)
+int tfs_stat(char const *name, tfs_stat_t *stat)
 {
-  if (pthread_mutex_lock(&g_library_mutex) == -1)
+  inode_rdlock(ROOT_DIR_INUM);
+
+  inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
+  ALWAYS_ASSERT(root_dir_inode != NULL,
+                "tfs_stat: root dir inode must exist");
+  int inum = tfs_lookup(name, root_dir_inode);
+
+  if (inum == -1)
   {
-    WARN("failed to lock mutex: %s", strerror(errno));
+    inode_unlock(ROOT_DIR_INUM);
     return -1;
   }
+
+  // the metadata is in the inode, no data block is touched
+  inode_rdlock(inum);
+  inode_t const *inode = inode_get(inum);
+  ALWAYS_ASSERT(inode != NULL, "tfs_stat: directory files must have an inode");
+
+  stat->st_type =
+      inode->i_node_type == T_DIRECTORY ? TFS_T_DIRECTORY : TFS_T_FILE;
+  stat->st_size = inode->i_size;
+  stat->st_blocks = inode->i_block_count;
+  stat->st_nlink = 1;
+  stat->st_version = inode->i_version;
+
+  inode_unlock(inum);
+  inode_unlock(ROOT_DIR_INUM);
+  return 0;
+}
+
+bool tfs_exists(char const *name)
+{
+  inode_rdlock(ROOT_DIR_INUM);
+
+  inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
+  ALWAYS_ASSERT(root_dir_inode != NULL,
+                "tfs_exists: root dir inode must exist");
+  bool exists = tfs_lookup(name, root_dir_inode) != -1;
+
+  inode_unlock(ROOT_DIR_INUM);
+  return exists;
+}
+
+void tfs_cache_stats(tfs_cache_stats_t *stats)
+{
+  cache_stats(&stats->hits, &stats->misses);
+}
+
+int tfs_list(void (*callback)(char const *name, void *data), void *data)
+{
+  inode_rdlock(ROOT_DIR_INUM);
+
+  inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
+  ALWAYS_ASSERT(root_dir_inode != NULL,
+                "tfs_list: root dir inode must exist");
+
+  int ret = list_dir_entries(root_dir_inode, callback, data);
+
+  inode_unlock(ROOT_DIR_INUM);
+  return ret;
+}
+
+int tfs_unlink(char const *target)
+{
   // Checks if the path name is valid
   if (!valid_pathname(target))
   {
-    if (pthread_mutex_unlock(&g_library_mutex) == -1)
-    {
-      WARN("failed to unlock mutex: %s", strerror(errno));
-      return -1;
-    }
     return -1;
   }
 
+  bool logged = begin_logged_op();
+  inode_wrlock(ROOT_DIR_INUM);
+
   inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
   ALWAYS_ASSERT(root_dir_inode != NULL,
-                "tfs_open: root dir inode must exist");
+                "tfs_unlink: root dir inode must exist");
   int inum = tfs_lookup(target, root_dir_inode);
 
   if (inum == -1)
   {
-    if (pthread_mutex_unlock(&g_library_mutex) == -1)
-    {
-      WARN("failed to unlock mutex: %s", strerror(errno));
-      return -1;
-    }
+    inode_unlock(ROOT_DIR_INUM);
+    end_logged_op(logged);
     return -1;
   }
 
+  // wait for in-flight reads/writes of the file to finish
+  inode_wrlock(inum);
   inode_delete(inum);
+  inode_unlock(inum);
+
   if (clear_dir_entry(root_dir_inode, target + 1) == -1)
   {
-    if (pthread_mutex_unlock(&g_library_mutex) == -1)
-    {
-      WARN("failed to unlock mutex: %s", strerror(errno));
-      return -1;
-    }
+    inode_unlock(ROOT_DIR_INUM);
+    end_logged_op(logged);
     return -1;
   }
 
-  if (pthread_mutex_unlock(&g_library_mutex) == -1)
+  // logged with the root directory locked (see tfs_open)
+  if (logged)
   {
-    WARN("failed to unlock mutex: %s", strerror(errno));
-    return -1;
+    wal_log(WAL_UNLINK, inum, 0, target + 1, strlen(target + 1));
   }
 
+  inode_unlock(ROOT_DIR_INUM);
+  end_logged_op(logged);
   return 0;
 }
@@ -2,7 +2,10 @@
 #define OPERATIONS_H
 
 #include "config.h"
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /**
  * TécnicoFS parameters.
@@ -13,6 +16,20 @@ typedef struct {
     size_t max_open_files_count;
 
     size_t block_size;
+
+    // file (in the OS' file system) holding the FS image, mapped into memory
+    // and kept across runs; NULL to keep the FS in memory only
+    char const *image_path;
+
+    // with an image, changes are logged (to image_path with ".wal" appended)
+    // and made durable in groups: once wal_group_size changes are logged, or
+    // once the oldest change not durable yet waited wal_group_delay_us
+    size_t wal_group_size;
+    size_t wal_group_delay_us;
+
+    // number of inodes and blocks kept in an in-memory cache of the FS
+    // (accesses to them are not delayed as storage accesses); 0 disables it
+    size_t cache_size;
 } tfs_params;
 
 /**
@@ -22,6 +39,8 @@ tfs_params tfs_default_params();
 
 /**
  * Initialize tecnicofs, optionally with a given configuration.
+ * With an image path, the files in the image (if it exists) are kept, along
+ * with every change in its log.
  * Returns 0 if successful, -1 otherwise.
  */
 int tfs_init(tfs_params const *params);
@@ -113,6 +132,98 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/**
+ * Write the contents of several buffers to an open file, one after the other,
+ * starting at the current offset, as a single write.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - iov: the buffers
+ *   - iovcnt: number of buffers
+ *
+ * Returns the number of bytes that were written (can be lower than the total
+ * length of the buffers if the maximum file size is exceeded), or -1 in case
+ * of error.
+ */
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt);
+
+/**
+ * Read from an open file into several buffers, one after the other, starting
+ * at the current offset.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - iov: the buffers
+ *   - iovcnt: number of buffers
+ *
+ * Returns the number of bytes that were copied from the file to the buffers
+ * (can be lower than their total length if the file size was reached), or -1
+ * in case of error.
+ */
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt);
+
+/**
+ * Write to an open file at a given offset, without using (or changing) the
+ * file handle's offset, so that the handle can be shared.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - buffer: buffer containing the contents to write
+ *   - len: length of the buffer contents (in bytes)
+ *   - offset: where to write
+ *
+ * Returns the number of bytes that were written, or -1 in case of error.
+ */
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, size_t offset);
+
+/**
+ * Read from an open file at a given offset, without using (or changing) the
+ * file handle's offset, so that the handle can be shared.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - buffer: destination buffer
+ *   - len: length of the buffer
+ *   - offset: where to read from
+ *
+ * Returns the number of bytes that were copied from the file to the buffer, or
+ * -1 in case of error.
+ */
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset);
+
+/**
+ * Write to the end of an open file atomically (appends through any handle
+ * never interleave), without using (or changing) the file handle's offset.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - buffer: buffer containing the contents to write
+ *   - len: length of the buffer contents (in bytes)
+ *   - offset: where to store the offset the contents were written at (can be
+ *     NULL)
+ *
+ * Returns the number of bytes that were written, or -1 in case of error.
+ */
+ssize_t tfs_append(int fhandle, void const *buffer, size_t len, size_t *offset);
+
+/**
+ * Like tfs_append, with the contents of several buffers, one after the other.
+ */
+ssize_t tfs_appendv(int fhandle, struct iovec const *iov, int iovcnt,
+                    size_t *offset);
+
+/**
+ * Shrink an open file to a given length, as a single change (the bytes past
+ * it are dropped), without changing the file handle's offset.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - length: the new length (no larger than the file)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_truncate(int fhandle, size_t length);
+
 /**
  * Delete a link, or a file if the number of hard links reaches 0, that
  * exists in TécnicoFS.
@@ -124,6 +235,83 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len);
  */
 int tfs_unlink(char const *target);
 
+/**
+ * TécnicoFS file types.
+ */
+typedef enum {
+    TFS_T_FILE,
+    TFS_T_DIRECTORY,
+} tfs_file_type_t;
+
+/**
+ * TécnicoFS file metadata.
+ */
+typedef struct {
+    tfs_file_type_t st_type;
+    size_t st_size;      // in bytes
+    size_t st_blocks;    // blocks allocated (data and indirect)
+    size_t st_nlink;     // always 1, as links are not supported
+    uint64_t st_version; // incremented whenever the contents change
+} tfs_stat_t;
+
+/**
+ * Obtain the metadata of a file, without reading its contents.
+ *
+ * Input:
+ *   - name: absolute path name
+ *   - stat: where to store the metadata
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_stat(char const *name, tfs_stat_t *stat);
+
+/**
+ * Check whether a file exists, without opening it.
+ *
+ * Input:
+ *   - name: absolute path name
+ *
+ * Returns true if the file exists, false otherwise (or if the name is
+ * invalid).
+ */
+bool tfs_exists(char const *name);
+
+/**
+ * TécnicoFS storage cache counters (see tfs_params.cache_size).
+ */
+typedef struct {
+    uint64_t hits;   // accesses to cached inodes and blocks (not delayed)
+    uint64_t misses; // accesses delayed as storage accesses
+} tfs_cache_stats_t;
+
+/**
+ * Obtain the storage cache counters, since tecnicofs was initialized.
+ *
+ * Input:
+ *   - stats: where to store the counters
+ */
+void tfs_cache_stats(tfs_cache_stats_t *stats);
+
+/**
+ * Wait until every change made so far is durable (only with an image; the
+ * changes are made durable in groups otherwise).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_sync(void);
+
+/**
+ * List the files in TécnicoFS (as names, without the initial '/').
+ *
+ * Input:
+ *   - callback: called with the name of each file and data (while the root
+ *     directory is locked, so it must not call into TécnicoFS)
+ *   - data: passed to callback
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_list(void (*callback)(char const *name, void *data), void *data);
+
 /**
  * Copy the contents of a file that exists in the OS' file system tree
  * (outside TécnicoFS) to the TécnicoFS.
@@ -1,26 +1,86 @@
 #include "state.h"
 #include "betterassert.h"
+#include "cache.h"
 
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 /*
  * Persistent FS state
- * (in reality, it should be maintained in secondary memory;
- * for simplicity, this project maintains it in primary memory).
+ * (kept in primary memory, unless an image file is given in the parameters,
+ * in which case it is loaded from that file, mapped into memory privately,
+ * and written back to it at checkpoints).
  */
 static tfs_params fs_params;
 
+/**
+ * Image superblock: identifies the image and its geometry, which must match
+ * the parameters it is mounted with.
+ *
+ * Image layout (each region starting at an IMAGE_ALIGN boundary): superblock,
+ * inode table, inode bitmap words, block bitmap words, data blocks.
+ */
+typedef struct {
+    uint64_t sb_magic;
+    uint64_t sb_version;
+    uint64_t sb_generation; // checkpoint number
+    uint64_t sb_inode_count;
+    uint64_t sb_block_count;
+    uint64_t sb_block_size;
+} superblock_t;
+
+#define IMAGE_MAGIC (0x4547414d49534654ULL) // "TFSIMAGE"
+#define IMAGE_VERSION (3)
+#define IMAGE_ALIGN (4096)
+#define IMAGE_ALIGN_UP(n) (((n) + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN)
+
+static char *image; // NULL if the state is in primary memory
+static size_t image_size;
+static char *image_path;
+static superblock_t *superblock;
+static bool image_restored; // the image held a file system already
+
+/**
+ * Allocation bitmap: one bit per entry (set = taken), 64 entries per word.
+ *
+ * A second level keeps one bit per word, set when that word is full, so that
+ * finding a free entry is a couple of find-first-set operations instead of a
+ * scan over the whole map. The summary level and the hint are volatile and
+ * are rebuilt from the words when an image is mapped.
+ */
+typedef struct {
+    uint64_t *words;
+    size_t n_words;
+    bool owns_words; // false if the words live in the image
+
+    uint64_t *full_words; // summary: bit set if the word is full
+    size_t n_full_words;
+
+    size_t hint; // summary words before the hint are all full
+    size_t n_free;
+
+    pthread_mutex_t lock;
+} bitmap_t;
+
+#define BITMAP_WORD_BITS (64)
+#define BITMAP_WORDS(n_bits)                                                   \
+    (((n_bits) + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+
 // Inode table
 static inode_t *inode_table;
-static allocation_state_t *freeinode_ts;
+static bitmap_t inode_bitmap;
 
 // Data blocks
 static char *fs_data; // # blocks * block size
-static allocation_state_t *free_blocks;
+static bitmap_t block_bitmap;
 
 /*
  * Volatile FS state
@@ -28,12 +88,62 @@ static allocation_state_t *free_blocks;
 static open_file_entry_t *open_file_table;
 static allocation_state_t *free_open_file_entries;
 
+/**
+ * Directory index slot: maps the name of a directory entry to the position of
+ * that entry in the directory's blocks.
+ */
+typedef struct {
+    uint32_t ds_hash;
+    int ds_inumber; // -1 if the slot is empty
+    size_t ds_entry;
+    char ds_name[MAX_FILE_NAME];
+} dir_slot_t;
+
+/**
+ * Directory index: a hash table (open addressing, linear probing) over the
+ * names of a directory's entries, so that lookups never scan the directory
+ * blocks, plus a stack with the positions of the free entries.
+ *
+ * It is kept consistent with the on-block entries by add_dir_entry and
+ * clear_dir_entry, and protected by the directory inode's lock.
+ */
+typedef struct {
+    dir_slot_t *di_slots;
+    size_t di_capacity; // power of two
+    size_t di_count;
+
+    size_t *di_free_entries;
+    size_t di_free_count;
+} dir_index_t;
+
+#define DIR_INDEX_MIN_CAPACITY (64)
+
+static dir_index_t *dir_indexes; // one per inode, only used by directories
+
+static int dir_index_build(int inumber);
+
+/*
+ * Synchronization
+ *
+ * Each inode has its own reader/writer lock (the root directory is protected
+ * by the lock of ROOT_DIR_INUM). The allocation bitmaps and the open file
+ * table have dedicated mutexes, so that operations on different files never
+ * serialize on a single global lock.
+ *
+ * Lock ordering: open file entry -> directory inode -> file inode ->
+ * allocation maps. The open file table lock only serializes allocation of
+ * entries; an entry's state only changes while its own lock is held.
+ */
+static pthread_rwlock_t *inode_locks;
+static pthread_mutex_t open_file_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
 // Convenience macros
 #define INODE_TABLE_SIZE (fs_params.max_inode_count)
 #define DATA_BLOCKS (fs_params.max_block_count)
 #define MAX_OPEN_FILES (fs_params.max_open_files_count)
 #define BLOCK_SIZE (fs_params.block_size)
-#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
+#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t)) // per block
+#define BLOCK_POINTERS (BLOCK_SIZE / sizeof(int)) // per indirect block
 
 static inline bool valid_inumber(int inumber) {
     return inumber >= 0 && inumber < INODE_TABLE_SIZE;
@@ -49,6 +159,17 @@ static inline bool valid_file_handle(int file_handle) {
 
 size_t state_block_size(void) { return BLOCK_SIZE; }
 
+/**
+ * Maximum size of a file, as addressable by the inode block map.
+ *
+ * Note that the number of data blocks in the FS may be the actual limit.
+ */
+size_t state_max_file_size(void) {
+    return (INODE_DIRECT_BLOCKS + BLOCK_POINTERS +
+            BLOCK_POINTERS * BLOCK_POINTERS) *
+           BLOCK_SIZE;
+}
+
 /**
  * Do nothing, while preventing the compiler from performing any optimizations.
  *
@@ -80,6 +201,290 @@ static void insert_delay(void) {
     }
 }
 
+/**
+ * Access a unit of the persistent FS state, which is delayed unless the unit
+ * is in the cache.
+ *
+ * Input:
+ *   - kind: kind of the unit
+ *   - number: number of the unit (inumber or block number)
+ */
+static void storage_access(cache_kind_t kind, size_t number) {
+    if (!cache_access(kind, number)) {
+        insert_delay();
+    }
+}
+
+/**
+ * Initialize an allocation bitmap, either with every entry free or over
+ * existing words (from an image), rebuilding the summary from them.
+ *
+ * Input:
+ *   - bm: the bitmap
+ *   - n_bits: number of entries
+ *   - words: the words of the map, or NULL to allocate them (all free)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int bitmap_init(bitmap_t *bm, size_t n_bits, uint64_t *words) {
+    bm->n_words = BITMAP_WORDS(n_bits);
+    bm->n_full_words = BITMAP_WORDS(bm->n_words);
+    bm->owns_words = words == NULL;
+    bm->words = words != NULL ? words : calloc(bm->n_words, sizeof(uint64_t));
+    bm->full_words = calloc(bm->n_full_words, sizeof(uint64_t));
+    bm->hint = 0;
+    bm->n_free = 0;
+
+    if (!bm->words || !bm->full_words) {
+        return -1;
+    }
+
+    // entries past the end of the map are permanently taken
+    if (n_bits % BITMAP_WORD_BITS != 0) {
+        bm->words[bm->n_words - 1] |= ~0ULL << (n_bits % BITMAP_WORD_BITS);
+    }
+    if (bm->n_words % BITMAP_WORD_BITS != 0) {
+        bm->full_words[bm->n_full_words - 1] =
+            ~0ULL << (bm->n_words % BITMAP_WORD_BITS);
+    }
+
+    for (size_t w = 0; w < bm->n_words; w++) {
+        if (bm->words[w] == ~0ULL) {
+            bm->full_words[w / BITMAP_WORD_BITS] |= 1ULL
+                                                    << (w % BITMAP_WORD_BITS);
+        }
+        bm->n_free += BITMAP_WORD_BITS - (size_t)__builtin_popcountll(bm->words[w]);
+    }
+
+    return pthread_mutex_init(&bm->lock, NULL) == 0 ? 0 : -1;
+}
+
+/**
+ * Check whether an entry of an allocation bitmap is taken (without locking,
+ * for use before the FS is shared).
+ */
+static bool bitmap_test(bitmap_t const *bm, size_t i) {
+    return (bm->words[i / BITMAP_WORD_BITS] &
+            (1ULL << (i % BITMAP_WORD_BITS))) != 0;
+}
+
+/**
+ * Release the resources of an allocation bitmap.
+ *
+ * Input:
+ *   - bm: the bitmap
+ */
+static void bitmap_destroy(bitmap_t *bm) {
+    if (bm->words != NULL) {
+        pthread_mutex_destroy(&bm->lock);
+    }
+
+    if (bm->owns_words) {
+        free(bm->words);
+    }
+    free(bm->full_words);
+    bm->words = NULL;
+    bm->full_words = NULL;
+}
+
+/**
+ * Take the lowest free entry of an allocation bitmap.
+ *
+ * Input:
+ *   - bm: the bitmap
+ *
+ * Returns the index of the entry, or -1 if the bitmap is full.
+ */
+static long bitmap_alloc(bitmap_t *bm) {
+    ALWAYS_ASSERT(pthread_mutex_lock(&bm->lock) == 0,
+                  "bitmap_alloc: failed to lock bitmap");
+
+    if (bm->n_free == 0) {
+        pthread_mutex_unlock(&bm->lock);
+        return -1;
+    }
+
+    for (size_t s = bm->hint; s < bm->n_full_words; s++) {
+        uint64_t not_full = ~bm->full_words[s];
+        if (not_full == 0) {
+            continue;
+        }
+
+        size_t w = s * BITMAP_WORD_BITS + (size_t)__builtin_ctzll(not_full);
+        size_t bit = (size_t)__builtin_ctzll(~bm->words[w]);
+
+        bm->words[w] |= 1ULL << bit;
+        if (bm->words[w] == ~0ULL) {
+            bm->full_words[s] |= 1ULL << (w % BITMAP_WORD_BITS);
+        }
+
+        bm->hint = s;
+        bm->n_free--;
+
+        pthread_mutex_unlock(&bm->lock);
+        return (long)(w * BITMAP_WORD_BITS + bit);
+    }
+
+    PANIC("bitmap_alloc: free count and bitmap disagree");
+    return -1;
+}
+
+/**
+ * Release an entry of an allocation bitmap.
+ *
+ * Input:
+ *   - bm: the bitmap
+ *   - i: index of the entry
+ *
+ * Returns true if the entry was taken, false if it was already free.
+ */
+static bool bitmap_free(bitmap_t *bm, size_t i) {
+    size_t w = i / BITMAP_WORD_BITS;
+    size_t s = w / BITMAP_WORD_BITS;
+    uint64_t mask = 1ULL << (i % BITMAP_WORD_BITS);
+
+    ALWAYS_ASSERT(pthread_mutex_lock(&bm->lock) == 0,
+                  "bitmap_free: failed to lock bitmap");
+
+    bool was_taken = (bm->words[w] & mask) != 0;
+    if (was_taken) {
+        bm->words[w] &= ~mask;
+        bm->full_words[s] &= ~(1ULL << (w % BITMAP_WORD_BITS));
+        if (s < bm->hint) {
+            bm->hint = s;
+        }
+        bm->n_free++;
+    }
+
+    pthread_mutex_unlock(&bm->lock);
+    return was_taken;
+}
+
+/**
+ * Map the image file holding the persistent FS state, creating it (empty) if
+ * it does not exist.
+ *
+ * The mapping is private: changes reach the file only through
+ * state_checkpoint, so that the file always holds a consistent checkpoint.
+ *
+ * Input:
+ *   - path: path name of the image (in the OS' file system)
+ *   - inode_words: where to store the location of the inode bitmap words
+ *   - block_words: where to store the location of the block bitmap words
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The image cannot be opened, created or mapped.
+ *   - The image is not a TFS image, or has a different geometry.
+ */
+static int image_map(char const *path, uint64_t **inode_words,
+                     uint64_t **block_words) {
+    size_t inode_table_offset = IMAGE_ALIGN_UP(sizeof(superblock_t));
+    size_t inode_words_offset =
+        inode_table_offset + IMAGE_ALIGN_UP(INODE_TABLE_SIZE * sizeof(inode_t));
+    size_t block_words_offset =
+        inode_words_offset +
+        IMAGE_ALIGN_UP(BITMAP_WORDS(INODE_TABLE_SIZE) * sizeof(uint64_t));
+    size_t data_offset =
+        block_words_offset +
+        IMAGE_ALIGN_UP(BITMAP_WORDS(DATA_BLOCKS) * sizeof(uint64_t));
+    image_size = data_offset + DATA_BLOCKS * BLOCK_SIZE;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    // a new image is all zeros: every entry free, no magic yet
+    bool fresh = st.st_size == 0;
+    if ((fresh && ftruncate(fd, (off_t)image_size) == -1) ||
+        (!fresh && (size_t)st.st_size != image_size)) {
+        close(fd);
+        return -1;
+    }
+
+    void *mapped =
+        mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return -1;
+    }
+
+    image = mapped;
+    superblock = (superblock_t *)image;
+
+    if (fresh) {
+        superblock->sb_magic = IMAGE_MAGIC;
+        superblock->sb_version = IMAGE_VERSION;
+        superblock->sb_generation = 0;
+        superblock->sb_inode_count = INODE_TABLE_SIZE;
+        superblock->sb_block_count = DATA_BLOCKS;
+        superblock->sb_block_size = BLOCK_SIZE;
+    } else if (superblock->sb_magic != IMAGE_MAGIC ||
+               superblock->sb_version != IMAGE_VERSION ||
+               superblock->sb_inode_count != INODE_TABLE_SIZE ||
+               superblock->sb_block_count != DATA_BLOCKS ||
+               superblock->sb_block_size != BLOCK_SIZE) {
+        munmap(image, image_size);
+        image = NULL;
+        return -1;
+    }
+
+    image_path = strdup(path);
+    if (image_path == NULL) {
+        munmap(image, image_size);
+        image = NULL;
+        return -1;
+    }
+
+    image_restored = !fresh;
+
+    inode_table = (inode_t *)(image + inode_table_offset);
+    *inode_words = (uint64_t *)(image + inode_words_offset);
+    *block_words = (uint64_t *)(image + block_words_offset);
+    fs_data = image + data_offset;
+
+    return 0;
+}
+
+/**
+ * Rebuild the volatile state of the directories of a restored image.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The root directory is missing, or a directory is malformed.
+ *   - malloc failure when allocating the directory indexes.
+ */
+static int image_restore(void) {
+    if (!bitmap_test(&inode_bitmap, ROOT_DIR_INUM) ||
+        inode_table[ROOT_DIR_INUM].i_node_type != T_DIRECTORY) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+        inode_t const *inode = &inode_table[i];
+        if (!bitmap_test(&inode_bitmap, i) ||
+            inode->i_node_type != T_DIRECTORY) {
+            continue;
+        }
+
+        if (inode->i_size == 0 || inode->i_size % BLOCK_SIZE != 0 ||
+            dir_index_build((int)i) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 /**
  * Initialize FS state.
  *
@@ -91,6 +496,7 @@ static void insert_delay(void) {
  * Possible errors:
  *   - TFS already initialized.
  *   - malloc failure when allocating TFS structures.
+ *   - (with an image) The image cannot be mapped, or is not valid.
  */
 int state_init(tfs_params params) {
     fs_params = params;
@@ -99,53 +505,202 @@ int state_init(tfs_params params) {
         return -1; // already initialized
     }
 
-    inode_table = malloc(INODE_TABLE_SIZE * sizeof(inode_t));
-    freeinode_ts = malloc(INODE_TABLE_SIZE * sizeof(allocation_state_t));
-    fs_data = malloc(DATA_BLOCKS * BLOCK_SIZE);
-    free_blocks = malloc(DATA_BLOCKS * sizeof(allocation_state_t));
+    uint64_t *inode_words = NULL;
+    uint64_t *block_words = NULL;
+    if (params.image_path != NULL) {
+        if (image_map(params.image_path, &inode_words, &block_words) != 0) {
+            return -1;
+        }
+    } else {
+        inode_table = malloc(INODE_TABLE_SIZE * sizeof(inode_t));
+        fs_data = malloc(DATA_BLOCKS * BLOCK_SIZE);
+    }
     open_file_table = malloc(MAX_OPEN_FILES * sizeof(open_file_entry_t));
     free_open_file_entries =
         malloc(MAX_OPEN_FILES * sizeof(allocation_state_t));
+    inode_locks = malloc(INODE_TABLE_SIZE * sizeof(pthread_rwlock_t));
+    dir_indexes = calloc(INODE_TABLE_SIZE, sizeof(dir_index_t));
 
-    if (!inode_table || !freeinode_ts || !fs_data || !free_blocks ||
-        !open_file_table || !free_open_file_entries) {
+    if (!inode_table || !fs_data || !open_file_table ||
+        !free_open_file_entries || !inode_locks || !dir_indexes) {
         return -1; // allocation failed
     }
 
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        freeinode_ts[i] = FREE;
+    if (bitmap_init(&inode_bitmap, INODE_TABLE_SIZE, inode_words) != 0 ||
+        bitmap_init(&block_bitmap, DATA_BLOCKS, block_words) != 0) {
+        return -1;
     }
 
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        free_blocks[i] = FREE;
+    if (cache_init(params.cache_size, INODE_TABLE_SIZE, DATA_BLOCKS) != 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+        if (pthread_rwlock_init(&inode_locks[i], NULL) != 0) {
+            return -1;
+        }
     }
 
     for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
         free_open_file_entries[i] = FREE;
+        if (pthread_mutex_init(&open_file_table[i].of_lock, NULL) != 0) {
+            return -1;
+        }
+    }
+
+    if (image_restored && image_restore() != 0) {
+        return -1;
     }
 
     return 0;
 }
 
+/**
+ * Check whether the FS state was restored from an image (so that it already
+ * has a root directory).
+ */
+bool state_restored(void) { return image_restored; }
+
+/**
+ * Number of the last checkpoint written to the image (0 if none).
+ */
+uint64_t state_generation(void) {
+    return superblock != NULL ? superblock->sb_generation : 0;
+}
+
+/**
+ * Write the FS state to the image file, replacing it atomically (through a
+ * temporary file, renamed over it once synced).
+ *
+ * The caller must make sure that the state does not change meanwhile.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors (the old image is then kept):
+ *   - The FS state is not kept in an image.
+ *   - Writing or syncing the image failed.
+ */
+int state_checkpoint(void) {
+    if (image == NULL) {
+        return -1;
+    }
+
+    char temp_path[PATH_MAX];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", image_path) >=
+        (int)sizeof(temp_path)) {
+        return -1;
+    }
+
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+
+    superblock->sb_generation++;
+
+    int ret = 0;
+    for (size_t done = 0; done < image_size && ret == 0;) {
+        ssize_t bytes_written = write(fd, image + done, image_size - done);
+        if (bytes_written == -1) {
+            ret = -1;
+        } else {
+            done += (size_t)bytes_written;
+        }
+    }
+    if (fsync(fd) == -1) {
+        ret = -1;
+    }
+    close(fd);
+
+    // the directory is opened before the rename, so that once the new image
+    // is in place nothing but syncing it is left to fail
+    char dir_path[PATH_MAX];
+    strcpy(dir_path, image_path);
+    char *slash = strrchr(dir_path, '/');
+    if (slash == NULL) {
+        strcpy(dir_path, ".");
+    } else if (slash == dir_path) {
+        slash[1] = '\0';
+    } else {
+        slash[0] = '\0';
+    }
+    int dir_fd = ret == 0 ? open(dir_path, O_RDONLY | O_DIRECTORY) : -1;
+    if (dir_fd == -1) {
+        ret = -1;
+    }
+
+    if (ret == 0 && rename(temp_path, image_path) == -1) {
+        ret = -1;
+    }
+
+    if (ret == -1) {
+        // the old image is still in place
+        superblock->sb_generation--;
+        unlink(temp_path);
+        if (dir_fd != -1) {
+            close(dir_fd);
+        }
+        return -1;
+    }
+
+    // the new image is in place, and the log is emptied for it next: were the
+    // rename lost in a crash, the log would name an image that is not there
+    ALWAYS_ASSERT(fsync(dir_fd) == 0,
+                  "state_checkpoint: failed to sync the image directory");
+    close(dir_fd);
+    return 0;
+}
+
 /**
  * Destroy FS state.
  *
  * Returns 0 if succesful, -1 otherwise.
  */
 int state_destroy(void) {
-    free(inode_table);
-    free(freeinode_ts);
-    free(fs_data);
-    free(free_blocks);
+    if (inode_locks != NULL) {
+        for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+            pthread_rwlock_destroy(&inode_locks[i]);
+        }
+    }
+    if (open_file_table != NULL) {
+        for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
+            pthread_mutex_destroy(&open_file_table[i].of_lock);
+        }
+    }
+    if (dir_indexes != NULL) {
+        for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+            free(dir_indexes[i].di_slots);
+            free(dir_indexes[i].di_free_entries);
+        }
+    }
+
+    bitmap_destroy(&inode_bitmap);
+    bitmap_destroy(&block_bitmap);
+    cache_destroy();
+
+    if (image != NULL) {
+        // changes since the last checkpoint are dropped with the mapping
+        munmap(image, image_size);
+        free(image_path);
+        image = NULL;
+        image_path = NULL;
+        superblock = NULL;
+        image_restored = false;
+    } else {
+        free(inode_table);
+        free(fs_data);
+    }
     free(open_file_table);
     free(free_open_file_entries);
+    free(inode_locks);
+    free(dir_indexes);
 
     inode_table = NULL;
-    freeinode_ts = NULL;
     fs_data = NULL;
-    free_blocks = NULL;
     open_file_table = NULL;
     free_open_file_entries = NULL;
+    inode_locks = NULL;
+    dir_indexes = NULL;
 
     return 0;
 }
@@ -160,31 +715,19 @@ int state_destroy(void) {
  *   - No free slots in inode table.
  */
 static int inode_alloc(void) {
-    for (size_t inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if ((inumber * sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-            insert_delay(); // simulate storage access delay (to freeinode_ts)
-        }
-
-        // Finds first free entry in inode table
-        if (freeinode_ts[inumber] == FREE) {
-            //  Found a free entry, so takes it for the new inode
-            freeinode_ts[inumber] = TAKEN;
+    storage_access(CACHE_INODE_BITMAP, 0); // simulate storage access delay
 
-            return (int)inumber;
-        }
-    }
-
-    // no free inodes
-    return -1;
+    // Finds (and takes) the first free entry in inode table; -1 if none
+    return (int)bitmap_alloc(&inode_bitmap);
 }
 
 /**
  * Create a new inode in the inode table.
  *
  * Allocates and initializes a new inode.
- * Directories will have their data block allocated and initialized, with i_size
- * set to BLOCK_SIZE. Regular files will not have their data block allocated
- * (i_size will be set to 0, i_data_block to -1).
+ * Directories will have their first data block allocated and initialized, with
+ * i_size set to BLOCK_SIZE. Regular files will not have any data block
+ * allocated (i_size will be set to 0, and the whole block map to -1).
  *
  * Input:
  *   - i_type: the type of the node (file or directory)
@@ -202,26 +745,31 @@ int inode_create(inode_type i_type) {
     }
 
     inode_t *inode = &inode_table[inumber];
-    insert_delay(); // simulate storage access delay (to inode)
+    // simulate storage access delay (to inode)
+    storage_access(CACHE_INODE, (size_t)inumber);
 
     inode->i_node_type = i_type;
+    inode->i_size = 0;
+    inode->i_block_count = 0;
+    inode->i_version = 0;
+    for (size_t i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+        inode->i_direct_blocks[i] = -1;
+    }
+    inode->i_indirect_block = -1;
+    inode->i_double_indirect_block = -1;
+
     switch (i_type) {
     case T_DIRECTORY: {
         // Initializes directory (filling its block with empty entries, labeled
         // with inumber==-1)
-        int b = data_block_alloc();
+        int b = inode_block_alloc(inode, 0);
         if (b == -1) {
-            // ensure fields are initialized
-            inode->i_size = 0;
-            inode->i_data_block = -1;
-
             // run regular deletion process
             inode_delete(inumber);
             return -1;
         }
 
         inode_table[inumber].i_size = BLOCK_SIZE;
-        inode_table[inumber].i_data_block = b;
 
         dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
         ALWAYS_ASSERT(dir_entry != NULL,
@@ -230,11 +778,14 @@ int inode_create(inode_type i_type) {
         for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
             dir_entry[i].d_inumber = -1;
         }
+
+        if (dir_index_build(inumber) == -1) {
+            inode_delete(inumber);
+            return -1;
+        }
     } break;
     case T_FILE:
-        // In case of a new file, simply sets its size to 0
-        inode_table[inumber].i_size = 0;
-        inode_table[inumber].i_data_block = -1;
+        // In case of a new file, there is nothing else to initialize
         break;
     default:
         PANIC("inode_create: unknown file type");
@@ -250,20 +801,23 @@ int inode_create(inode_type i_type) {
  *   - inumber: inode's number
  */
 void inode_delete(int inumber) {
-    // simulate storage access delay (to inode and freeinode_ts)
-    insert_delay();
-    insert_delay();
-
     ALWAYS_ASSERT(valid_inumber(inumber), "inode_delete: invalid inumber");
 
-    ALWAYS_ASSERT(freeinode_ts[inumber] == TAKEN,
-                  "inode_delete: inode already freed");
+    // simulate storage access delay (to inode and inode_bitmap)
+    storage_access(CACHE_INODE, (size_t)inumber);
+    storage_access(CACHE_INODE_BITMAP, 0);
 
-    if (inode_table[inumber].i_size > 0) {
-        data_block_free(inode_table[inumber].i_data_block);
+    if (inode_table[inumber].i_node_type == T_DIRECTORY) {
+        dir_index_t *index = &dir_indexes[inumber];
+        free(index->di_slots);
+        free(index->di_free_entries);
+        memset(index, 0, sizeof(dir_index_t));
     }
 
-    freeinode_ts[inumber] = FREE;
+    inode_blocks_free(&inode_table[inumber], 0);
+
+    ALWAYS_ASSERT(bitmap_free(&inode_bitmap, (size_t)inumber),
+                  "inode_delete: inode already freed");
 }
 
 /**
@@ -277,10 +831,457 @@ void inode_delete(int inumber) {
 inode_t *inode_get(int inumber) {
     ALWAYS_ASSERT(valid_inumber(inumber), "inode_get: invalid inumber");
 
-    insert_delay(); // simulate storage access delay to inode
+    // simulate storage access delay to inode
+    storage_access(CACHE_INODE, (size_t)inumber);
     return &inode_table[inumber];
 }
 
+/**
+ * Acquire the lock of an inode for reading (shared).
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_rdlock(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_rdlock: invalid inumber");
+    ALWAYS_ASSERT(pthread_rwlock_rdlock(&inode_locks[inumber]) == 0,
+                  "inode_rdlock: failed to lock inode");
+}
+
+/**
+ * Acquire the lock of an inode for writing (exclusive).
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_wrlock(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_wrlock: invalid inumber");
+    ALWAYS_ASSERT(pthread_rwlock_wrlock(&inode_locks[inumber]) == 0,
+                  "inode_wrlock: failed to lock inode");
+}
+
+/**
+ * Release the lock of an inode (acquired with inode_rdlock or inode_wrlock).
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_unlock(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_unlock: invalid inumber");
+    ALWAYS_ASSERT(pthread_rwlock_unlock(&inode_locks[inumber]) == 0,
+                  "inode_unlock: failed to unlock inode");
+}
+
+/**
+ * Resolve a reference to a block, allocating it if requested.
+ *
+ * Input:
+ *   - inode: the inode the block belongs to (its block count is updated)
+ *   - ref: location of the block number (in an inode or indirect block)
+ *   - alloc: whether to allocate the block if it is not allocated yet
+ *   - is_table: whether the block holds block numbers (so that a newly
+ *     allocated block must have all of its entries set to -1, rather than
+ *     be zeroed)
+ *
+ * Returns the block number, or -1 if it is not allocated (and could not be).
+ */
+static int block_ref(inode_t *inode, int *ref, bool alloc, bool is_table) {
+    if (*ref != -1 || !alloc) {
+        return *ref;
+    }
+
+    int b = data_block_alloc();
+    if (b == -1) {
+        return -1; // no space
+    }
+
+    if (is_table) {
+        int *table = (int *)data_block_get(b);
+        for (size_t i = 0; i < BLOCK_POINTERS; i++) {
+            table[i] = -1;
+        }
+    } else {
+        // a block past a hole must not show what a freed one held
+        memset(data_block_get(b), 0, BLOCK_SIZE);
+    }
+
+    inode->i_block_count++;
+    *ref = b;
+    return b;
+}
+
+/**
+ * Walk the block map of an inode, optionally allocating missing blocks.
+ *
+ * Input:
+ *   - inode: the inode
+ *   - block_index: index of the block within the file
+ *   - alloc: whether missing blocks (data or indirect) should be allocated
+ *
+ * Returns the block number, or -1 if it is not (and could not be) allocated.
+ */
+static int block_map_walk(inode_t *inode, size_t block_index, bool alloc) {
+    if (block_index < INODE_DIRECT_BLOCKS) {
+        return block_ref(inode, &inode->i_direct_blocks[block_index], alloc,
+                         false);
+    }
+    block_index -= INODE_DIRECT_BLOCKS;
+
+    if (block_index < BLOCK_POINTERS) {
+        int ind = block_ref(inode, &inode->i_indirect_block, alloc, true);
+        if (ind == -1) {
+            return -1;
+        }
+
+        int *table = (int *)data_block_get(ind);
+        return block_ref(inode, &table[block_index], alloc, false);
+    }
+    block_index -= BLOCK_POINTERS;
+
+    if (block_index < BLOCK_POINTERS * BLOCK_POINTERS) {
+        int dind =
+            block_ref(inode, &inode->i_double_indirect_block, alloc, true);
+        if (dind == -1) {
+            return -1;
+        }
+
+        int *outer = (int *)data_block_get(dind);
+        int ind = block_ref(inode, &outer[block_index / BLOCK_POINTERS], alloc,
+                            true);
+        if (ind == -1) {
+            return -1;
+        }
+
+        int *inner = (int *)data_block_get(ind);
+        return block_ref(inode, &inner[block_index % BLOCK_POINTERS], alloc,
+                         false);
+    }
+
+    return -1; // beyond the maximum file size
+}
+
+/**
+ * Obtain the number of the data block holding a given block of a file.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - block_index: index of the block within the file (offset / block size)
+ *
+ * Returns the block number, or -1 if that block is not allocated.
+ */
+int inode_block_get(inode_t const *inode, size_t block_index) {
+    // without allocation the walk never modifies the inode
+    return block_map_walk((inode_t *)inode, block_index, false);
+}
+
+/**
+ * Obtain the number of the data block holding a given block of a file,
+ * allocating it (and any indirect blocks needed to reach it) if necessary.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - block_index: index of the block within the file (offset / block size)
+ *
+ * Returns the block number, or -1 in the case of error.
+ *
+ * Possible errors:
+ *   - No free data blocks.
+ *   - block_index is beyond the maximum file size.
+ */
+int inode_block_alloc(inode_t *inode, size_t block_index) {
+    return block_map_walk(inode, block_index, true);
+}
+
+/**
+ * Free the blocks a block map entry leads to, from a given block of the file
+ * on, and the entry's own block if that leaves it without any.
+ *
+ * Input:
+ *   - inode: the inode the blocks belong to (its block count is updated)
+ *   - ref: location of the block number (in an inode or indirect block)
+ *   - first: first block to free, relative to the first one the entry maps
+ *   - depth: levels of block tables below the entry (0 for a data block)
+ */
+static void block_ref_free(inode_t *inode, int *ref, size_t first,
+                           int depth) {
+    if (*ref == -1) {
+        return;
+    }
+
+    if (depth == 0) {
+        if (first > 0) {
+            return; // kept
+        }
+    } else {
+        size_t span = depth == 2 ? BLOCK_POINTERS : 1; // blocks per entry
+        int *table = (int *)data_block_get(*ref);
+        bool empty = true;
+        for (size_t i = 0; i < BLOCK_POINTERS; i++) {
+            if ((i + 1) * span > first) {
+                block_ref_free(inode, &table[i],
+                               i * span >= first ? 0 : first - i * span,
+                               depth - 1);
+            }
+            empty = empty && table[i] == -1;
+        }
+        if (!empty) {
+            return;
+        }
+    }
+
+    data_block_free(*ref);
+    *ref = -1;
+    inode->i_block_count--;
+}
+
+/**
+ * Free the blocks of an inode (data and indirect) from a given block of the
+ * file on, along with the indirect blocks left without any. Does not change
+ * i_size.
+ *
+ * Input:
+ *   - inode: the inode
+ *   - first_block: index of the first block to free (0 for all of them)
+ */
+void inode_blocks_free(inode_t *inode, size_t first_block) {
+    for (size_t i = first_block; i < INODE_DIRECT_BLOCKS; i++) {
+        block_ref_free(inode, &inode->i_direct_blocks[i], 0, 0);
+    }
+
+    size_t first = first_block > INODE_DIRECT_BLOCKS
+                       ? first_block - INODE_DIRECT_BLOCKS
+                       : 0;
+    block_ref_free(inode, &inode->i_indirect_block, first, 1);
+
+    first = first > BLOCK_POINTERS ? first - BLOCK_POINTERS : 0;
+    block_ref_free(inode, &inode->i_double_indirect_block, first, 2);
+}
+
+/**
+ * Hash of a file name (FNV-1a), used by the directory indexes.
+ */
+static uint32_t name_hash(char const *name) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < MAX_FILE_NAME && name[i] != '\0'; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Obtain the index of a directory inode.
+ */
+static dir_index_t *dir_index_of(inode_t const *inode) {
+    return &dir_indexes[inode - inode_table];
+}
+
+/**
+ * Look up a name in a directory index.
+ *
+ * Returns the slot holding the name, or NULL if there is none.
+ */
+static dir_slot_t *dir_index_find(dir_index_t const *index,
+                                  char const *name) {
+    uint32_t hash = name_hash(name);
+    size_t mask = index->di_capacity - 1;
+
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        dir_slot_t *slot = &index->di_slots[i];
+        if (slot->ds_inumber == -1) {
+            return NULL;
+        }
+        if (slot->ds_hash == hash &&
+            strncmp(slot->ds_name, name, MAX_FILE_NAME) == 0) {
+            return slot;
+        }
+    }
+}
+
+/**
+ * Place a slot in a table with at least one empty slot (no growth).
+ */
+static void dir_index_place(dir_slot_t *slots, size_t capacity,
+                            dir_slot_t const *slot) {
+    size_t mask = capacity - 1;
+    size_t i = slot->ds_hash & mask;
+    while (slots[i].ds_inumber != -1) {
+        i = (i + 1) & mask;
+    }
+    slots[i] = *slot;
+}
+
+/**
+ * Add a name to a directory index, growing its table if it gets more than
+ * half full.
+ *
+ * Returns 0 if successful, -1 otherwise (allocation failure).
+ */
+static int dir_index_insert(dir_index_t *index, char const *name, int inumber,
+                            size_t entry) {
+    if ((index->di_count + 1) * 2 > index->di_capacity) {
+        size_t capacity = index->di_capacity * 2;
+        dir_slot_t *slots = malloc(capacity * sizeof(dir_slot_t));
+        if (slots == NULL) {
+            return -1;
+        }
+
+        for (size_t i = 0; i < capacity; i++) {
+            slots[i].ds_inumber = -1;
+        }
+        for (size_t i = 0; i < index->di_capacity; i++) {
+            if (index->di_slots[i].ds_inumber != -1) {
+                dir_index_place(slots, capacity, &index->di_slots[i]);
+            }
+        }
+
+        free(index->di_slots);
+        index->di_slots = slots;
+        index->di_capacity = capacity;
+    }
+
+    dir_slot_t slot = {
+        .ds_hash = name_hash(name),
+        .ds_inumber = inumber,
+        .ds_entry = entry,
+    };
+    strncpy(slot.ds_name, name, MAX_FILE_NAME - 1);
+    slot.ds_name[MAX_FILE_NAME - 1] = '\0';
+
+    dir_index_place(index->di_slots, index->di_capacity, &slot);
+    index->di_count++;
+    return 0;
+}
+
+/**
+ * Remove a slot from a directory index (backward shift deletion, so that no
+ * tombstones are needed).
+ */
+static void dir_index_remove(dir_index_t *index, dir_slot_t *slot) {
+    size_t mask = index->di_capacity - 1;
+    size_t hole = (size_t)(slot - index->di_slots);
+
+    for (size_t i = (hole + 1) & mask; index->di_slots[i].ds_inumber != -1;
+         i = (i + 1) & mask) {
+        size_t home = index->di_slots[i].ds_hash & mask;
+
+        // the entry at i can fill the hole if its home is not in (hole, i]
+        bool stays = (hole < i) ? (home > hole && home <= i)
+                                : (home > hole || home <= i);
+        if (!stays) {
+            index->di_slots[hole] = index->di_slots[i];
+            hole = i;
+        }
+    }
+
+    index->di_slots[hole].ds_inumber = -1;
+    index->di_count--;
+}
+
+/**
+ * Obtain a pointer to the entry at a given position of a directory.
+ */
+static dir_entry_t *dir_entry_get(inode_t const *inode, size_t entry) {
+    int b = inode_block_get(inode, entry / MAX_DIR_ENTRIES);
+    ALWAYS_ASSERT(b != -1, "dir_entry_get: directory block not allocated");
+
+    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
+    ALWAYS_ASSERT(dir_entry != NULL,
+                  "dir_entry_get: directory must have a data block");
+
+    return &dir_entry[entry % MAX_DIR_ENTRIES];
+}
+
+/**
+ * Make room in the free entry stack of an index for every entry of a
+ * directory with a given number of blocks.
+ *
+ * Returns 0 if successful, -1 otherwise (allocation failure).
+ */
+static int dir_index_reserve(dir_index_t *index, size_t n_blocks) {
+    size_t *free_entries = realloc(index->di_free_entries,
+                                   n_blocks * MAX_DIR_ENTRIES * sizeof(size_t));
+    if (free_entries == NULL) {
+        return -1;
+    }
+
+    index->di_free_entries = free_entries;
+    return 0;
+}
+
+/**
+ * (Re)build the index of a directory from the entries in its blocks.
+ *
+ * Input:
+ *   - inumber: the directory's inumber
+ *
+ * Returns 0 if successful, -1 otherwise (allocation failure).
+ */
+static int dir_index_build(int inumber) {
+    inode_t const *inode = &inode_table[inumber];
+    dir_index_t *index = &dir_indexes[inumber];
+    size_t n_blocks = inode->i_size / BLOCK_SIZE;
+
+    free(index->di_slots);
+    index->di_count = 0;
+    index->di_free_count = 0;
+
+    index->di_capacity = DIR_INDEX_MIN_CAPACITY;
+    index->di_slots = malloc(index->di_capacity * sizeof(dir_slot_t));
+    if (index->di_slots == NULL || dir_index_reserve(index, n_blocks) == -1) {
+        return -1;
+    }
+    for (size_t i = 0; i < index->di_capacity; i++) {
+        index->di_slots[i].ds_inumber = -1;
+    }
+
+    // push free entries from the last one, so that the lowest is reused first
+    for (size_t entry = n_blocks * MAX_DIR_ENTRIES; entry-- > 0;) {
+        dir_entry_t const *dir_entry = dir_entry_get(inode, entry);
+        if (dir_entry->d_inumber == -1) {
+            index->di_free_entries[index->di_free_count++] = entry;
+        } else if (dir_index_insert(index, dir_entry->d_name,
+                                    dir_entry->d_inumber, entry) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Add a new (empty) block to a directory, making its entries available.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No free data blocks, or the directory reached the maximum file size.
+ */
+static int dir_grow(inode_t *inode, dir_index_t *index) {
+    size_t n_blocks = inode->i_size / BLOCK_SIZE;
+    if (dir_index_reserve(index, n_blocks + 1) == -1) {
+        return -1;
+    }
+
+    int b = inode_block_alloc(inode, n_blocks);
+    if (b == -1) {
+        return -1; // no space
+    }
+
+    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        dir_entry[i].d_inumber = -1;
+    }
+    inode->i_size += BLOCK_SIZE;
+
+    for (size_t i = MAX_DIR_ENTRIES; i-- > 0;) {
+        index->di_free_entries[index->di_free_count++] =
+            n_blocks * MAX_DIR_ENTRIES + i;
+    }
+
+    return 0;
+}
+
 /**
  * Clear the directory entry associated with a sub file.
  *
@@ -295,24 +1296,26 @@ inode_t *inode_get(int inumber) {
  *   - Directory does not contain an entry for sub_name.
  */
 int clear_dir_entry(inode_t *inode, char const *sub_name) {
-    insert_delay();
+    // simulate storage access delay to inode
+    storage_access(CACHE_INODE, (size_t)(inode - inode_table));
     if (inode->i_node_type != T_DIRECTORY) {
         return -1; // not a directory
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "clear_dir_entry: directory must have a data block");
-
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (!strcmp(dir_entry[i].d_name, sub_name)) {
-            dir_entry[i].d_inumber = -1;
-            memset(dir_entry[i].d_name, 0, MAX_FILE_NAME);
-            return 0;
-        }
+    dir_index_t *index = dir_index_of(inode);
+    dir_slot_t *slot = dir_index_find(index, sub_name);
+    if (slot == NULL) {
+        return -1; // sub_name not found
     }
-    return -1; // sub_name not found
+
+    // Clears the entry in the directory block
+    dir_entry_t *dir_entry = dir_entry_get(inode, slot->ds_entry);
+    dir_entry->d_inumber = -1;
+    memset(dir_entry->d_name, 0, MAX_FILE_NAME);
+
+    index->di_free_entries[index->di_free_count++] = slot->ds_entry;
+    dir_index_remove(index, slot);
+    return 0;
 }
 
 /**
@@ -328,35 +1331,43 @@ int clear_dir_entry(inode_t *inode, char const *sub_name) {
  * Possible errors:
  *   - inode is not a directory inode.
  *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
- *   - Directory is already full of entries.
+ *   - Directory already has an entry for sub_name.
+ *   - Directory is full and cannot grow (no free data blocks).
  */
 int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
     if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
         return -1; // invalid sub_name
     }
 
-    insert_delay(); // simulate storage access delay to inode with inumber
+    // simulate storage access delay to inode
+    storage_access(CACHE_INODE, (size_t)(inode - inode_table));
     if (inode->i_node_type != T_DIRECTORY) {
         return -1; // not a directory
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "add_dir_entry: directory must have a data block");
+    dir_index_t *index = dir_index_of(inode);
+    if (dir_index_find(index, sub_name) != NULL) {
+        return -1; // name already taken
+    }
 
-    // Finds and fills the first empty entry
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_entry[i].d_inumber == -1) {
-            dir_entry[i].d_inumber = sub_inumber;
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = '\0';
+    // Takes the first free entry, adding a block to the directory if full
+    if (index->di_free_count == 0 && dir_grow(inode, index) == -1) {
+        return -1; // no space for entry
+    }
+    size_t entry = index->di_free_entries[--index->di_free_count];
 
-            return 0;
-        }
+    if (dir_index_insert(index, sub_name, sub_inumber, entry) == -1) {
+        index->di_free_count++;
+        return -1;
     }
 
-    return -1; // no space for entry
+    // Fills the entry in the directory block
+    dir_entry_t *dir_entry = dir_entry_get(inode, entry);
+    dir_entry->d_inumber = sub_inumber;
+    strncpy(dir_entry->d_name, sub_name, MAX_FILE_NAME - 1);
+    dir_entry->d_name[MAX_FILE_NAME - 1] = '\0';
+
+    return 0;
 }
 
 /**
@@ -376,27 +1387,51 @@ int find_in_dir(inode_t const *inode, char const *sub_name) {
     ALWAYS_ASSERT(inode != NULL, "find_in_dir: inode must be non-NULL");
     ALWAYS_ASSERT(sub_name != NULL, "find_in_dir: sub_name must be non-NULL");
 
-    insert_delay(); // simulate storage access delay to inode with inumber
+    // simulate storage access delay to inode
+    storage_access(CACHE_INODE, (size_t)(inode - inode_table));
     if (inode->i_node_type != T_DIRECTORY) {
         return -1; // not a directory
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "find_in_dir: directory inode must have a data block");
+    // The index maps names to entries without touching the directory blocks
+    dir_slot_t const *slot = dir_index_find(dir_index_of(inode), sub_name);
+    if (slot == NULL) {
+        return -1; // entry not found
+    }
 
-    // Iterates over the directory entries looking for one that has the target
-    // name
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
-        if ((dir_entry[i].d_inumber != -1) &&
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
+    return slot->ds_inumber;
+}
 
-            int sub_inumber = dir_entry[i].d_inumber;
-            return sub_inumber;
+/**
+ * Call a function with the name of every entry of a directory.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - fn: function to call, with each name and data
+ *   - data: passed to fn
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ */
+int list_dir_entries(inode_t const *inode,
+                     void (*fn)(char const *name, void *data), void *data) {
+    // simulate storage access delay to inode
+    storage_access(CACHE_INODE, (size_t)(inode - inode_table));
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1; // not a directory
+    }
+
+    // The index has every name, without touching the directory blocks
+    dir_index_t const *index = dir_index_of(inode);
+    for (size_t i = 0; i < index->di_capacity; i++) {
+        if (index->di_slots[i].ds_inumber != -1) {
+            fn(index->di_slots[i].ds_name, data);
         }
+    }
 
-    return -1; // entry not found
+    return 0;
 }
 
 /**
@@ -408,18 +1443,9 @@ int find_in_dir(inode_t const *inode, char const *sub_name) {
  *   - No free data blocks.
  */
 int data_block_alloc(void) {
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        if (i * sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-            insert_delay(); // simulate storage access delay to free_blocks
-        }
+    storage_access(CACHE_BLOCK_BITMAP, 0); // simulate storage access delay
 
-        if (free_blocks[i] == FREE) {
-            free_blocks[i] = TAKEN;
-
-            return (int)i;
-        }
-    }
-    return -1;
+    return (int)bitmap_alloc(&block_bitmap);
 }
 
 /**
@@ -432,9 +1458,10 @@ void data_block_free(int block_number) {
     ALWAYS_ASSERT(valid_block_number(block_number),
                   "data_block_free: invalid block number");
 
-    insert_delay(); // simulate storage access delay to free_blocks
+    storage_access(CACHE_BLOCK_BITMAP, 0); // simulate storage access delay
 
-    free_blocks[block_number] = FREE;
+    ALWAYS_ASSERT(bitmap_free(&block_bitmap, (size_t)block_number),
+                  "data_block_free: block already freed");
 }
 
 /**
@@ -449,7 +1476,8 @@ void *data_block_get(int block_number) {
     ALWAYS_ASSERT(valid_block_number(block_number),
                   "data_block_get: invalid block number");
 
-    insert_delay(); // simulate storage access delay to block
+    // simulate storage access delay to block
+    storage_access(CACHE_BLOCK, (size_t)block_number);
     return &fs_data[(size_t)block_number * BLOCK_SIZE];
 }
 
@@ -466,22 +1494,37 @@ void *data_block_get(int block_number) {
  *   - No space in open file table for a new open file.
  */
 int add_to_open_file_table(int inumber, size_t offset) {
+    ALWAYS_ASSERT(pthread_mutex_lock(&open_file_table_lock) == 0,
+                  "add_to_open_file_table: failed to lock open file table");
+
     for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        // an entry whose lock is held is in use (or being closed), skip it
+        if (pthread_mutex_trylock(&open_file_table[i].of_lock) != 0) {
+            continue;
+        }
+
         if (free_open_file_entries[i] == FREE) {
             free_open_file_entries[i] = TAKEN;
             open_file_table[i].of_inumber = inumber;
             open_file_table[i].of_offset = offset;
 
+            pthread_mutex_unlock(&open_file_table[i].of_lock);
+            pthread_mutex_unlock(&open_file_table_lock);
             return i;
         }
+
+        pthread_mutex_unlock(&open_file_table[i].of_lock);
     }
 
+    pthread_mutex_unlock(&open_file_table_lock);
     return -1;
 }
 
 /**
  * Free an entry from the open file table.
  *
+ * The caller must hold the entry's lock (see lock_open_file_entry).
+ *
  * Input:
  *   - fhandle: file handle to free/close
  */
@@ -515,3 +1558,42 @@ open_file_entry_t *get_open_file_entry(int fhandle) {
 
     return &open_file_table[fhandle];
 }
+
+/**
+ * Obtain pointer to a given entry in the open file table, with the entry's
+ * lock held.
+ *
+ * Input:
+ *   - fhandle: file handle
+ *
+ * Returns pointer to the locked entry, or NULL if the fhandle is
+ * invalid/closed/never opened.
+ */
+open_file_entry_t *lock_open_file_entry(int fhandle) {
+    if (!valid_file_handle(fhandle)) {
+        return NULL;
+    }
+
+    open_file_entry_t *file = &open_file_table[fhandle];
+    ALWAYS_ASSERT(pthread_mutex_lock(&file->of_lock) == 0,
+                  "lock_open_file_entry: failed to lock entry");
+
+    // the entry may have been closed while we waited for its lock
+    if (free_open_file_entries[fhandle] != TAKEN) {
+        pthread_mutex_unlock(&file->of_lock);
+        return NULL;
+    }
+
+    return file;
+}
+
+/**
+ * Release the lock of an open file entry obtained with lock_open_file_entry.
+ *
+ * Input:
+ *   - file: the locked entry
+ */
+void unlock_open_file_entry(open_file_entry_t *file) {
+    ALWAYS_ASSERT(pthread_mutex_unlock(&file->of_lock) == 0,
+                  "unlock_open_file_entry: failed to unlock entry");
+}
@@ -4,7 +4,9 @@
 #include "config.h"
 #include "operations.h"
 
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -26,7 +28,15 @@ typedef struct {
     inode_type i_node_type;
 
     size_t i_size;
-    int i_data_block;
+    size_t i_block_count; // blocks allocated (data and indirect)
+    uint64_t i_version;   // incremented whenever the contents change
+
+    // block map: direct blocks, then a block of block numbers (single
+    // indirect), then a block of single indirect blocks (double indirect);
+    // unused pointers are -1
+    int i_direct_blocks[INODE_DIRECT_BLOCKS];
+    int i_indirect_block;
+    int i_double_indirect_block;
 
     // in a more complete FS, more fields could exist here
 } inode_t;
@@ -39,20 +49,36 @@ typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
 typedef struct {
     int of_inumber;
     size_t of_offset;
+
+    pthread_mutex_t of_lock; // protects of_offset
 } open_file_entry_t;
 
 int state_init(tfs_params);
 int state_destroy(void);
+bool state_restored(void);
+uint64_t state_generation(void);
+int state_checkpoint(void);
 
 size_t state_block_size(void);
+size_t state_max_file_size(void);
 
 int inode_create(inode_type n_type);
 void inode_delete(int inumber);
 inode_t *inode_get(int inumber);
 
+void inode_rdlock(int inumber);
+void inode_wrlock(int inumber);
+void inode_unlock(int inumber);
+
+int inode_block_get(inode_t const *inode, size_t block_index);
+int inode_block_alloc(inode_t *inode, size_t block_index);
+void inode_blocks_free(inode_t *inode, size_t first_block);
+
 int clear_dir_entry(inode_t *inode, char const *sub_name);
 int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber);
 int find_in_dir(inode_t const *inode, char const *sub_name);
+int list_dir_entries(inode_t const *inode,
+                     void (*fn)(char const *name, void *data), void *data);
 
 int data_block_alloc(void);
 void data_block_free(int block_number);
@@ -61,5 +87,7 @@ void *data_block_get(int block_number);
 int add_to_open_file_table(int inumber, size_t offset);
 void remove_from_open_file_table(int fhandle);
 open_file_entry_t *get_open_file_entry(int fhandle);
+open_file_entry_t *lock_open_file_entry(int fhandle);
+void unlock_open_file_entry(open_file_entry_t *file);
 
 #endif // STATE_H
@@ -0,0 +1,532 @@
+#include "wal.h"
+#include "betterassert.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Write-ahead log
+ *
+ * Every change to the FS is recorded in the log (under the locks that order
+ * it with the changes it conflicts with) before the caller returns, and the
+ * image is only written at checkpoints, so that replaying the log over the
+ * last checkpoint rebuilds the FS after a crash.
+ *
+ * Records are appended to a buffer in memory; a flusher thread writes the
+ * buffered records with a single write and a single fdatasync once a group
+ * is complete (group_size records), or once the oldest record in the buffer
+ * has waited group_delay_us, so that syncing costs one fdatasync per group
+ * rather than one per change.
+ *
+ * The log starts with a header naming the checkpoint it follows, so that a
+ * log left behind by a crash during a checkpoint is never replayed over the
+ * newer image. Each record carries a checksum, and replay stops at the first
+ * torn (or otherwise invalid) record.
+ */
+
+typedef struct {
+    uint64_t wh_magic;
+    uint64_t wh_generation; // checkpoint the log follows
+} wal_header_t;
+
+typedef struct {
+    uint32_t wr_crc; // of the rest of the record, payload included
+    uint32_t wr_len; // payload length
+    uint32_t wr_op;
+    int32_t wr_inumber;
+    uint64_t wr_offset;
+} wal_record_t;
+
+#define WAL_MAGIC (0x31304c4157534654ULL) // "TFSWAL01"
+#define WAL_ALIGN (8)
+#define WAL_RECORD_SIZE(len)                                                   \
+    ((sizeof(wal_record_t) + (len) + WAL_ALIGN - 1) / WAL_ALIGN * WAL_ALIGN)
+#define WAL_MIN_BUFFER (64 * 1024)
+
+static struct {
+    int fd;
+
+    pthread_mutex_t lock;
+    pthread_cond_t flusher_condvar; // records to write, or a sync requested
+    pthread_cond_t durable_condvar; // records written and synced
+
+    // records not written yet (pending), and those being written (writing)
+    char *pending;
+    size_t pending_len;
+    size_t pending_capacity;
+    size_t pending_records;
+    struct timespec first_pending; // when the oldest pending record was added
+    char *writing;
+    size_t writing_capacity;
+
+    // bytes of records ever added, and of those known to be on disk (never
+    // moved back, so that a sync waiting across a checkpoint still returns);
+    // base is where appended was when the log was last emptied
+    uint64_t appended;
+    uint64_t durable;
+    uint64_t base;
+
+    size_t group_size;
+    size_t group_delay_us;
+
+    bool flushing;
+    bool sync_requested;
+    bool stopping;
+    bool failed;
+
+    pthread_t flusher;
+} wal = {.fd = -1};
+
+static uint32_t crc_table[256];
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+        }
+        crc_table[i] = crc;
+    }
+}
+
+/**
+ * CRC-32 of a buffer, continuing from a previous one (0 to start).
+ */
+static uint32_t crc_update(uint32_t crc, void const *buffer, size_t len) {
+    uint8_t const *bytes = buffer;
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = crc_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint32_t record_crc(wal_record_t const *record, void const *payload) {
+    uint32_t crc = crc_update(0, (char const *)record + sizeof(record->wr_crc),
+                              sizeof(wal_record_t) - sizeof(record->wr_crc));
+    return crc_update(crc, payload, record->wr_len);
+}
+
+static uint32_t record_crcv(wal_record_t const *record,
+                            struct iovec const *iov, int iovcnt) {
+    uint32_t crc = crc_update(0, (char const *)record + sizeof(record->wr_crc),
+                              sizeof(wal_record_t) - sizeof(record->wr_crc));
+
+    size_t left = record->wr_len;
+    for (int i = 0; i < iovcnt && left > 0; i++) {
+        size_t len = iov[i].iov_len < left ? iov[i].iov_len : left;
+        crc = crc_update(crc, iov[i].iov_base, len);
+        left -= len;
+    }
+    return crc;
+}
+
+/**
+ * Write a whole buffer to the log file.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int write_all(int fd, void const *buffer, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t bytes_written = write(fd, (char const *)buffer + done,
+                                      len - done);
+        if (bytes_written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += (size_t)bytes_written;
+    }
+    return 0;
+}
+
+/**
+ * Wait (with the log lock held) until the pending records must be written: a
+ * group is complete, a sync is requested, or the oldest record waited long
+ * enough.
+ */
+static void wait_for_group(void) {
+    struct timespec deadline = wal.first_pending;
+    deadline.tv_sec += (time_t)(wal.group_delay_us / 1000000);
+    deadline.tv_nsec += (long)(wal.group_delay_us % 1000000) * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    while (!wal.stopping && !wal.sync_requested &&
+           wal.pending_records < wal.group_size) {
+        if (pthread_cond_timedwait(&wal.flusher_condvar, &wal.lock,
+                                   &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+}
+
+/**
+ * Flusher thread: write and sync the pending records, a group at a time.
+ */
+static void *flusher_thread(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&wal.lock);
+    while (true) {
+        while (!wal.stopping && !wal.sync_requested &&
+               wal.pending_records == 0) {
+            pthread_cond_wait(&wal.flusher_condvar, &wal.lock);
+        }
+        if (wal.pending_records == 0) {
+            // nothing to write (a sync with everything durable, or stopping)
+            wal.sync_requested = false;
+            pthread_cond_broadcast(&wal.durable_condvar);
+            if (wal.stopping) {
+                break;
+            }
+            continue;
+        }
+
+        wait_for_group();
+
+        // take the group, so that new records go to the other buffer while
+        // it is written
+        char *group = wal.pending;
+        size_t group_len = wal.pending_len;
+        uint64_t group_end = wal.appended;
+
+        wal.pending = wal.writing;
+        wal.writing = group;
+        size_t capacity = wal.pending_capacity;
+        wal.pending_capacity = wal.writing_capacity;
+        wal.writing_capacity = capacity;
+        wal.pending_len = 0;
+        wal.pending_records = 0;
+        wal.sync_requested = false;
+        wal.flushing = true;
+
+        pthread_mutex_unlock(&wal.lock);
+        int ret = write_all(wal.fd, group, group_len);
+        if (ret == 0) {
+            ret = fdatasync(wal.fd);
+        }
+        pthread_mutex_lock(&wal.lock);
+
+        wal.flushing = false;
+        if (ret == -1) {
+            WARN("wal: failed to write the log, changes may be lost");
+            wal.failed = true;
+        }
+        if (wal.durable < group_end) {
+            wal.durable = group_end;
+        }
+        pthread_cond_broadcast(&wal.durable_condvar);
+    }
+    pthread_mutex_unlock(&wal.lock);
+
+    return NULL;
+}
+
+/**
+ * Open the log, creating it (empty) if it does not exist, and start the
+ * flusher.
+ *
+ * Input:
+ *   - path: path name of the log (in the OS' file system)
+ *   - group_size: records written and synced together
+ *   - group_delay_us: how long a record may wait for its group to complete
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int wal_open(char const *path, size_t group_size, size_t group_delay_us) {
+    if (wal.fd != -1) {
+        return -1; // already open
+    }
+
+    crc_init();
+
+    wal.fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (wal.fd == -1) {
+        return -1;
+    }
+
+    wal.pending = malloc(WAL_MIN_BUFFER);
+    wal.writing = malloc(WAL_MIN_BUFFER);
+    if (wal.pending == NULL || wal.writing == NULL) {
+        return -1;
+    }
+    wal.pending_capacity = WAL_MIN_BUFFER;
+    wal.writing_capacity = WAL_MIN_BUFFER;
+    wal.pending_len = 0;
+    wal.pending_records = 0;
+    wal.appended = 0;
+    wal.durable = 0;
+    wal.base = 0;
+
+    wal.group_size = group_size > 0 ? group_size : 1;
+    wal.group_delay_us = group_delay_us;
+    wal.flushing = false;
+    wal.sync_requested = false;
+    wal.stopping = false;
+    wal.failed = false;
+
+    if (pthread_mutex_init(&wal.lock, NULL) != 0 ||
+        pthread_cond_init(&wal.flusher_condvar, NULL) != 0 ||
+        pthread_cond_init(&wal.durable_condvar, NULL) != 0 ||
+        pthread_create(&wal.flusher, NULL, flusher_thread, NULL) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Stop the flusher (writing and syncing the pending records) and close the
+ * log.
+ */
+void wal_close(void) {
+    if (wal.fd == -1) {
+        return;
+    }
+
+    pthread_mutex_lock(&wal.lock);
+    wal.stopping = true;
+    pthread_cond_signal(&wal.flusher_condvar);
+    pthread_mutex_unlock(&wal.lock);
+    pthread_join(wal.flusher, NULL);
+
+    pthread_cond_destroy(&wal.durable_condvar);
+    pthread_cond_destroy(&wal.flusher_condvar);
+    pthread_mutex_destroy(&wal.lock);
+
+    free(wal.pending);
+    free(wal.writing);
+    wal.pending = NULL;
+    wal.writing = NULL;
+
+    close(wal.fd);
+    wal.fd = -1;
+}
+
+/**
+ * Replay the records of the log, if it follows a given checkpoint.
+ *
+ * Input:
+ *   - generation: the checkpoint the FS was restored from
+ *   - apply: called with every valid record, in order
+ *
+ * Returns the number of records replayed, or -1 if reading the log or
+ * applying a record failed.
+ */
+int wal_replay(uint64_t generation, wal_apply_fn apply) {
+    struct stat st;
+    if (fstat(wal.fd, &st) == -1) {
+        return -1;
+    }
+
+    size_t size = (size_t)st.st_size;
+    if (size < sizeof(wal_header_t)) {
+        return 0; // empty log
+    }
+
+    char *log = malloc(size);
+    if (log == NULL) {
+        return -1;
+    }
+    for (size_t done = 0; done < size;) {
+        ssize_t bytes_read = pread(wal.fd, log + done, size - done,
+                                   (off_t)done);
+        if (bytes_read <= 0) {
+            free(log);
+            return -1;
+        }
+        done += (size_t)bytes_read;
+    }
+
+    // a log from an older checkpoint only has changes the image already has
+    wal_header_t const *header = (wal_header_t const *)log;
+    if (header->wh_magic != WAL_MAGIC ||
+        header->wh_generation != generation) {
+        free(log);
+        return 0;
+    }
+
+    int count = 0;
+    size_t position = sizeof(wal_header_t);
+    while (size - position >= sizeof(wal_record_t)) {
+        wal_record_t record;
+        memcpy(&record, log + position, sizeof(wal_record_t));
+        char const *payload = log + position + sizeof(wal_record_t);
+
+        if (record.wr_len > size - position - sizeof(wal_record_t) ||
+            record_crc(&record, payload) != record.wr_crc) {
+            break; // torn record: the crash happened while writing it
+        }
+
+        if (apply((wal_op_t)record.wr_op, record.wr_inumber,
+                  (size_t)record.wr_offset, payload, record.wr_len) == -1) {
+            free(log);
+            return -1;
+        }
+
+        count++;
+        position += WAL_RECORD_SIZE(record.wr_len);
+    }
+
+    free(log);
+    return count;
+}
+
+/**
+ * Empty the log, once a checkpoint has every change it records.
+ *
+ * Input:
+ *   - generation: the new checkpoint
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int wal_reset(uint64_t generation) {
+    pthread_mutex_lock(&wal.lock);
+
+    // the group being written is in the checkpoint too
+    while (wal.flushing) {
+        pthread_cond_wait(&wal.durable_condvar, &wal.lock);
+    }
+
+    wal_header_t header = {.wh_magic = WAL_MAGIC,
+                           .wh_generation = generation};
+    int ret = -1;
+    if (ftruncate(wal.fd, 0) == 0 &&
+        write_all(wal.fd, &header, sizeof(header)) == 0 &&
+        fdatasync(wal.fd) == 0) {
+        ret = 0;
+    }
+
+    wal.pending_len = 0;
+    wal.pending_records = 0;
+    wal.durable = wal.appended; // the checkpoint has the discarded records
+    wal.base = wal.appended;
+    wal.failed = ret == -1;
+    pthread_cond_broadcast(&wal.durable_condvar);
+
+    pthread_mutex_unlock(&wal.lock);
+    return ret;
+}
+
+/**
+ * Add a record to the log (made durable with the rest of its group).
+ *
+ * Input:
+ *   - op: the operation
+ *   - inumber: inode's number
+ *   - offset: (WAL_WRITE) offset of the bytes written
+ *   - payload: (WAL_WRITE) bytes written, or the file name
+ *   - len: length of the payload
+ */
+void wal_log(wal_op_t op, int inumber, size_t offset, void const *payload,
+             size_t len) {
+    struct iovec iov = {.iov_base = (void *)payload, .iov_len = len};
+    wal_logv(op, inumber, offset, &iov, 1, len);
+}
+
+/**
+ * Add a record with a payload gathered from several buffers to the log.
+ *
+ * Input:
+ *   - op: the operation
+ *   - inumber: inode's number
+ *   - offset: (WAL_WRITE) offset of the bytes written
+ *   - iov: the buffers
+ *   - iovcnt: number of buffers
+ *   - len: length of the payload (the first len bytes of the buffers)
+ */
+void wal_logv(wal_op_t op, int inumber, size_t offset, struct iovec const *iov,
+              int iovcnt, size_t len) {
+    wal_record_t record = {
+        .wr_len = (uint32_t)len,
+        .wr_op = (uint32_t)op,
+        .wr_inumber = inumber,
+        .wr_offset = offset,
+    };
+    record.wr_crc = record_crcv(&record, iov, iovcnt);
+    size_t record_size = WAL_RECORD_SIZE(len);
+
+    ALWAYS_ASSERT(pthread_mutex_lock(&wal.lock) == 0,
+                  "wal_logv: failed to lock log");
+
+    if (wal.pending_len + record_size > wal.pending_capacity) {
+        size_t capacity = wal.pending_capacity * 2;
+        while (capacity < wal.pending_len + record_size) {
+            capacity *= 2;
+        }
+
+        char *pending = realloc(wal.pending, capacity);
+        ALWAYS_ASSERT(pending != NULL, "wal_logv: failed to grow log buffer");
+        wal.pending = pending;
+        wal.pending_capacity = capacity;
+    }
+
+    char *dest = wal.pending + wal.pending_len;
+    memcpy(dest, &record, sizeof(wal_record_t));
+    size_t copied = 0;
+    for (int i = 0; i < iovcnt && copied < len; i++) {
+        size_t chunk = iov[i].iov_len < len - copied ? iov[i].iov_len
+                                                     : len - copied;
+        memcpy(dest + sizeof(wal_record_t) + copied, iov[i].iov_base, chunk);
+        copied += chunk;
+    }
+    memset(dest + sizeof(wal_record_t) + len, 0,
+           record_size - sizeof(wal_record_t) - len);
+
+    wal.pending_len += record_size;
+    wal.appended += record_size;
+    if (wal.pending_records++ == 0) {
+        clock_gettime(CLOCK_REALTIME, &wal.first_pending);
+    }
+
+    // the flusher starts timing a new group, or writes a complete one
+    if (wal.pending_records == 1 || wal.pending_records >= wal.group_size) {
+        pthread_cond_signal(&wal.flusher_condvar);
+    }
+
+    pthread_mutex_unlock(&wal.lock);
+}
+
+/**
+ * Wait until every record added so far is durable, without waiting for its
+ * group to complete.
+ *
+ * Returns 0 if successful, -1 if writing the log failed.
+ */
+int wal_sync(void) {
+    ALWAYS_ASSERT(pthread_mutex_lock(&wal.lock) == 0,
+                  "wal_sync: failed to lock log");
+
+    uint64_t target = wal.appended;
+    while (wal.durable < target && !wal.failed) {
+        wal.sync_requested = true;
+        pthread_cond_signal(&wal.flusher_condvar);
+        pthread_cond_wait(&wal.durable_condvar, &wal.lock);
+    }
+    int ret = wal.failed ? -1 : 0;
+
+    pthread_mutex_unlock(&wal.lock);
+    return ret;
+}
+
+/**
+ * Size of the log (records added since the last checkpoint included).
+ */
+size_t wal_size(void) {
+    ALWAYS_ASSERT(pthread_mutex_lock(&wal.lock) == 0,
+                  "wal_size: failed to lock log");
+    size_t size = sizeof(wal_header_t) + (size_t)(wal.appended - wal.base);
+    pthread_mutex_unlock(&wal.lock);
+    return size;
+}
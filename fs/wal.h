@@ -0,0 +1,40 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * Operations recorded in the write-ahead log.
+ */
+typedef enum {
+    WAL_CREATE = 1,   // file created: inumber, name
+    WAL_TRUNCATE = 2, // file truncated: inumber, offset (the new size)
+    WAL_WRITE = 3,    // bytes written: inumber, offset, data
+    WAL_UNLINK = 4,   // file deleted: inumber, name
+} wal_op_t;
+
+/**
+ * Function called with every record of the log when it is replayed.
+ *
+ * Returns 0 if the record was applied, -1 otherwise.
+ */
+typedef int (*wal_apply_fn)(wal_op_t op, int inumber, size_t offset,
+                            void const *payload, size_t len);
+
+int wal_open(char const *path, size_t group_size, size_t group_delay_us);
+void wal_close(void);
+
+int wal_replay(uint64_t generation, wal_apply_fn apply);
+int wal_reset(uint64_t generation);
+
+void wal_log(wal_op_t op, int inumber, size_t offset, void const *payload,
+             size_t len);
+void wal_logv(wal_op_t op, int inumber, size_t offset, struct iovec const *iov,
+              int iovcnt, size_t len);
+int wal_sync(void);
+size_t wal_size(void);
+
+#endif // WAL_H
@@ -25,41 +25,38 @@ int compareBoxes(const void *a, const void *b)
 int createRemoveBox(OP_CODE_SIZE action_code, char *register_pipe_name, char *client_pipe_name, char *box_name)
 {
   // send create request by connecting to server with CREATE_BOX op_code
-  if (connect(action_code, register_pipe_name, client_pipe_name, box_name) == -1)
+  if (connect(action_code, 0, register_pipe_name, client_pipe_name, box_name) == -1)
   {
     printf("Error connecting to server");
     return -1;
   }
 
-  OP_CODE_SIZE op_code;
-  RETURN_CODE_SIZE return_code;
-  char error_message[MESSAGE_SIZE];
+  WireHeader header;
+  WireReturn response;
+  memset(&response, 0, sizeof(response));
 
   // open client_fifo to receive server response
   int client_fifo = open(client_pipe_name, O_RDONLY);
 
-  // listen for response
-  char wire_message[PROTOCOL_MESSAGE_SIZE];
-  if (read(client_fifo, wire_message, PROTOCOL_MESSAGE_SIZE) == -1)
+  // listen for response (keeping the error message terminated)
+  if (wireRead(client_fifo, &header, &response, sizeof(response) - 1) <= 0)
   {
     printf("Error reading response from server");
     return -1;
   }
 
-  sscanf(wire_message, "%hhd|%d|%[^\n]", &op_code, &return_code, error_message);
-
   // check if the message is directed to us (should be but..)
-  if (op_code != RETURN_CREATE_BOX && op_code != RETURN_DELETE_BOX)
+  if (header.op_code != RETURN_CREATE_BOX && header.op_code != RETURN_DELETE_BOX)
   {
     printf("Received misplaced response from server");
     return -1;
   }
 
   // print response
-  if (return_code == 0)
+  if (response.return_code == 0)
     fprintf(stdout, "OK\n");
   else
-    fprintf(stdout, "ERROR %s\n", error_message);
+    fprintf(stdout, "ERROR %s\n", response.error_message);
 
   // close client fifo
   if (close(client_fifo) == -1)
@@ -73,46 +70,40 @@ int createRemoveBox(OP_CODE_SIZE action_code, char *register_pipe_name, char *cl
 
 int listBox(char *register_pipe_name, char *client_pipe_name)
 {
-  if (connect(LIST_BOXES, register_pipe_name, client_pipe_name, "\0") == -1)
+  if (connect(LIST_BOXES, 0, register_pipe_name, client_pipe_name, "\0") == -1)
   {
     printf("Error connecting to server");
     return -1;
   }
 
-  OP_CODE_SIZE op_code;
-  uint8_t last_message;
-  char box_name[BOX_NAME_SIZE];
-  uint64_t box_size;
-  uint64_t n_publishers;
-  uint64_t n_subscribers;
+  WireHeader header;
+  WireBoxInfo box;
 
   int client_fifo = open(client_pipe_name, O_RDONLY);
 
   // listen for response
-  char wire_message[PROTOCOL_MESSAGE_SIZE];
   char **boxes = (char **)malloc(sizeof(char *));
   int n_boxes = 0;
   char buffer[PROTOCOL_MESSAGE_SIZE];
-  while (!last_message)
+  do
   {
-    if (read(client_fifo, wire_message, PROTOCOL_MESSAGE_SIZE) == -1)
+    memset(&box, 0, sizeof(box));
+    if (wireRead(client_fifo, &header, &box, sizeof(box)) <= 0)
     {
       printf("Error reading response from server");
       return -1;
     }
 
-    // parse
-    if (sscanf(wire_message, "%hhd|%hhd|%[^|]|%lu|%lu|%lu", &op_code, &last_message, box_name, &box_size, &n_publishers, &n_subscribers) < 3)
-    {
-      break; // box_name is \0
-    }
-
     // check if the message is directed to us (should be but..)
-    if (op_code != RETURN_LIST_BOXES)
+    if (header.op_code != RETURN_LIST_BOXES)
       break;
 
+    box.box_name[BOX_NAME_SIZE - 1] = '\0';
+    if (box.box_name[0] == '\0')
+      break; // no boxes
+
     // add string representation of the box to the buffer
-    sprintf(buffer, "%s %zu %zu %zu", box_name, box_size, n_publishers, n_subscribers);
+    sprintf(buffer, "%s %zu %zu %zu", box.box_name, box.box_size, box.n_publishers, box.n_subscribers);
 
     // allocate memory for the buffer that contains the string representation of the box
     boxes[n_boxes] = (char *)malloc((strlen(buffer) + 1) * sizeof(char));
@@ -124,7 +115,7 @@ int listBox(char *register_pipe_name, char *client_pipe_name)
 
     // reallocate dynamic vector memory
     boxes = (char **)realloc(boxes, (long unsigned int)(n_boxes + 1) * sizeof(char *));
-  }
+  } while (!(header.flags & WIRE_FLAG_LAST));
 
   // handle the list of boxes
   if (n_boxes != 0)
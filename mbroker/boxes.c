@@ -0,0 +1,526 @@
+#include "boxes.h"
+#include "operations.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+The registry keeps the boxes in a hash table with separate chaining, indexed
+by a hash of the box name, so finding a box does not depend on how many boxes
+exist.
+
+Lookups (done for every session) only take the registry lock for reading and
+run in parallel; creating and deleting boxes takes it for writing.
+
+Boxes are reference counted: the registry holds one reference and every
+session holds another while it uses the box, so a box deleted while a session
+still uses it is only freed when that session releases it.
+
+Each box also keeps its most recent messages in a ring, each message copied
+in once by the publisher, framed as subscribers receive it, and reference
+counted, so that subscribers only hold a sequence number and write messages
+to their pipes straight from the ring. TFS is the persistent copy
+and is only read by subscribers that fall behind the ring, which find the
+messages they need through the box index: the offset of every message in the
+box, in publication order, with lengths given by the next offset (or the box
+size, for the last message). A box restored from a TFS image gets its index
+rebuilt from its contents, with an empty ring.
+
+The message count doubles as the box sequence number: subscribers that have
+delivered every message wait for the next one on the box itself, so that a
+publisher only notifies the subscribers of its own box, and only those
+actually waiting.
+*/
+
+#define REGISTRY_MIN_BUCKETS 64
+#define BOX_INDEX_MIN_CAPACITY 64
+
+typedef struct
+{
+  BoxData **buckets;
+  size_t bucket_count; // power of two
+  size_t box_count;
+
+  pthread_rwlock_t lock;
+} BoxRegistry;
+
+static BoxRegistry registry;
+
+// FNV-1a hash of a box name
+static uint32_t hashBoxName(char const *name)
+{
+  uint32_t hash = 2166136261u;
+  for (; *name != '\0'; name++)
+  {
+    hash ^= (uint8_t)*name;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// find a box in the registry (the registry lock must be held)
+static BoxData *findBox(char const *box_name, uint32_t hash)
+{
+  BoxData *box = registry.buckets[hash & (registry.bucket_count - 1)];
+
+  while (box != NULL)
+  {
+    if (box->hash == hash && strcmp(box->name, box_name) == 0)
+      return box;
+
+    box = box->next;
+  }
+
+  return NULL;
+}
+
+static BoxData *initBox(char const *box_name)
+{
+  BoxData *box = (BoxData *)malloc(sizeof(BoxData));
+
+  if (box == NULL)
+    return NULL;
+
+  box->name = (char *)malloc(sizeof(char) * (strlen(box_name) + 1));
+
+  if (box->name == NULL)
+  {
+    free(box);
+    return NULL;
+  }
+
+  strcpy(box->name, box_name);
+
+  box->size = 0;
+  box->fhandle = -1;
+  box->subs = 0;
+  box->pubs = 0;
+
+  box->ring_first = 0;
+  box->message_count = 0;
+  memset(box->ring, 0, sizeof(box->ring));
+  box->offsets = NULL;
+  box->offsets_capacity = 0;
+  box->waiters = NULL;
+
+  box->hash = hashBoxName(box_name);
+  box->refs = 0;
+  box->deleted = false;
+  box->deleting = false;
+  box->next = NULL;
+
+  if (pthread_mutex_init(&box->pcq_publisher_condvar_lock, NULL) != 0 ||
+      pthread_cond_init(&box->pcq_publisher_condvar, NULL) != 0 ||
+      pthread_mutex_init(&box->ring_lock, NULL) != 0)
+  {
+    free(box->name);
+    free(box);
+    return NULL;
+  }
+
+  return box;
+}
+
+static void freeBox(BoxData *box)
+{
+  pthread_mutex_destroy(&box->pcq_publisher_condvar_lock);
+  pthread_cond_destroy(&box->pcq_publisher_condvar);
+
+  for (uint64_t seq = box->ring_first; seq < box->message_count; seq++)
+    releaseBoxMessage(box->ring[seq % BOX_RING_CAPACITY]);
+  pthread_mutex_destroy(&box->ring_lock);
+  free(box->offsets);
+
+  if (box->fhandle != -1)
+    tfs_close(box->fhandle);
+
+  free(box->name);
+  free(box);
+}
+
+// double the number of buckets (the registry lock must be held for writing)
+static int growRegistry(void)
+{
+  size_t bucket_count = registry.bucket_count * 2;
+  BoxData **buckets = (BoxData **)calloc(bucket_count, sizeof(BoxData *));
+
+  if (buckets == NULL)
+    return -1;
+
+  for (size_t i = 0; i < registry.bucket_count; i++)
+  {
+    BoxData *box = registry.buckets[i];
+    while (box != NULL)
+    {
+      BoxData *next = box->next;
+      size_t bucket = box->hash & (bucket_count - 1);
+
+      box->next = buckets[bucket];
+      buckets[bucket] = box;
+
+      box = next;
+    }
+  }
+
+  free(registry.buckets);
+  registry.buckets = buckets;
+  registry.bucket_count = bucket_count;
+
+  return 0;
+}
+
+int initBoxRegistry(void)
+{
+  registry.bucket_count = REGISTRY_MIN_BUCKETS;
+  registry.box_count = 0;
+  registry.buckets = (BoxData **)calloc(registry.bucket_count, sizeof(BoxData *));
+
+  if (registry.buckets == NULL)
+    return -1;
+
+  if (pthread_rwlock_init(&registry.lock, NULL) != 0)
+    return -1;
+
+  return 0;
+}
+
+void destroyBoxRegistry(void)
+{
+  pthread_rwlock_wrlock(&registry.lock);
+
+  for (size_t i = 0; i < registry.bucket_count; i++)
+  {
+    BoxData *box = registry.buckets[i];
+    while (box != NULL)
+    {
+      BoxData *next = box->next;
+
+      __atomic_store_n(&box->deleted, true, __ATOMIC_RELEASE);
+      releaseBox(box);
+
+      box = next;
+    }
+  }
+
+  free(registry.buckets);
+  registry.buckets = NULL;
+  registry.bucket_count = 0;
+  registry.box_count = 0;
+
+  pthread_rwlock_unlock(&registry.lock);
+  pthread_rwlock_destroy(&registry.lock);
+}
+
+BoxData *registerBox(char const *box_name)
+{
+  uint32_t hash = hashBoxName(box_name);
+
+  if (pthread_rwlock_wrlock(&registry.lock) != 0)
+    return NULL;
+
+  if (findBox(box_name, hash) != NULL)
+  {
+    pthread_rwlock_unlock(&registry.lock);
+    return NULL; // already exists
+  }
+
+  // keep chains short; if growing fails, chains just get longer
+  if (registry.box_count + 1 > registry.bucket_count)
+    growRegistry();
+
+  BoxData *box = initBox(box_name);
+  if (box == NULL)
+  {
+    pthread_rwlock_unlock(&registry.lock);
+    return NULL;
+  }
+
+  // one reference for the registry, one for the caller
+  box->refs = 2;
+
+  size_t bucket = hash & (registry.bucket_count - 1);
+  box->next = registry.buckets[bucket];
+  registry.buckets[bucket] = box;
+  registry.box_count++;
+
+  pthread_rwlock_unlock(&registry.lock);
+  return box;
+}
+
+BoxData *acquireBox(char const *box_name)
+{
+  uint32_t hash = hashBoxName(box_name);
+
+  if (pthread_rwlock_rdlock(&registry.lock) != 0)
+    return NULL;
+
+  BoxData *box = findBox(box_name, hash);
+  if (box != NULL)
+    __atomic_add_fetch(&box->refs, 1, __ATOMIC_RELAXED);
+
+  pthread_rwlock_unlock(&registry.lock);
+  return box;
+}
+
+void releaseBox(BoxData *box)
+{
+  if (__atomic_sub_fetch(&box->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    freeBox(box);
+}
+
+int unregisterBox(BoxData *box)
+{
+  if (pthread_rwlock_wrlock(&registry.lock) != 0)
+    return -1;
+
+  BoxData **link = &registry.buckets[box->hash & (registry.bucket_count - 1)];
+  while (*link != NULL && *link != box)
+    link = &(*link)->next;
+
+  if (*link == NULL)
+  {
+    pthread_rwlock_unlock(&registry.lock);
+    return -1; // not registered (e.g. deleted concurrently)
+  }
+
+  *link = box->next;
+  box->next = NULL;
+  registry.box_count--;
+  __atomic_store_n(&box->deleted, true, __ATOMIC_RELEASE);
+
+  pthread_rwlock_unlock(&registry.lock);
+
+  // drop the registry's reference
+  releaseBox(box);
+  return 0;
+}
+
+ssize_t acquireAllBoxes(BoxData ***boxes)
+{
+  if (pthread_rwlock_rdlock(&registry.lock) != 0)
+    return -1;
+
+  // one extra slot so that an empty registry still gets a valid array
+  *boxes = (BoxData **)malloc((registry.box_count + 1) * sizeof(BoxData *));
+  if (*boxes == NULL)
+  {
+    pthread_rwlock_unlock(&registry.lock);
+    return -1;
+  }
+
+  ssize_t count = 0;
+  for (size_t i = 0; i < registry.bucket_count; i++)
+  {
+    for (BoxData *box = registry.buckets[i]; box != NULL; box = box->next)
+    {
+      __atomic_add_fetch(&box->refs, 1, __ATOMIC_RELAXED);
+      (*boxes)[count++] = box;
+    }
+  }
+
+  pthread_rwlock_unlock(&registry.lock);
+  return count;
+}
+
+int reserveBoxMessages(BoxData *box, size_t count)
+{
+  int ret = 0;
+
+  pthread_mutex_lock(&box->ring_lock);
+
+  if (box->message_count + count > box->offsets_capacity)
+  {
+    size_t capacity = box->offsets_capacity == 0 ? BOX_INDEX_MIN_CAPACITY : box->offsets_capacity;
+    while (capacity < box->message_count + count)
+      capacity *= 2;
+
+    uint64_t *offsets = (uint64_t *)realloc(box->offsets, capacity * sizeof(uint64_t));
+
+    if (offsets == NULL)
+      ret = -1;
+    else
+    {
+      box->offsets = offsets;
+      box->offsets_capacity = capacity;
+    }
+  }
+
+  pthread_mutex_unlock(&box->ring_lock);
+  return ret;
+}
+
+ssize_t loadBoxMessages(BoxData *box, char const *contents, size_t size)
+{
+  size_t count = 0;
+  for (char const *end = contents; (end = memchr(end, '\0', size - (size_t)(end - contents))) != NULL; end++)
+    count++;
+
+  if (reserveBoxMessages(box, count) == -1)
+    return -1;
+
+  pthread_mutex_lock(&box->ring_lock);
+
+  size_t offset = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    box->offsets[i] = offset;
+    offset += strlen(contents + offset) + 1;
+  }
+
+  // none of them is in the ring
+  box->size = (ssize_t)offset;
+  box->ring_first = count;
+  box->message_count = count;
+
+  pthread_mutex_unlock(&box->ring_lock);
+  return (ssize_t)offset;
+}
+
+BoxMessage *createBoxMessage(char const *message, size_t message_len)
+{
+  size_t frame_len = sizeof(WireHeader) + message_len;
+
+  BoxMessage *entry = (BoxMessage *)malloc(sizeof(BoxMessage) + frame_len + 1);
+  if (entry == NULL)
+    return NULL;
+
+  entry->refs = 1;
+  entry->len = message_len;
+  entry->frame_len = frame_len;
+
+  WireHeader header = {.op_code = SEND_SUBSCRIBER, .flags = 0, .payload_len = (uint16_t)message_len};
+  memcpy(entry->frame, &header, sizeof(WireHeader));
+
+  entry->text = entry->frame + sizeof(WireHeader);
+  memcpy(entry->text, message, message_len);
+  entry->text[message_len] = '\0';
+
+  return entry;
+}
+
+void appendBoxMessages(BoxData *box, BoxMessage **messages, size_t count, size_t offset)
+{
+  pthread_mutex_lock(&box->ring_lock);
+
+  uint64_t message_count = box->message_count;
+  for (size_t i = 0; i < count; i++, message_count++)
+  {
+    if (message_count - box->ring_first == BOX_RING_CAPACITY)
+    {
+      // evict the oldest message (subscribers delivering it keep it alive)
+      releaseBoxMessage(box->ring[box->ring_first % BOX_RING_CAPACITY]);
+      box->ring_first++;
+    }
+
+    // the caller's reference becomes the ring's
+    box->ring[message_count % BOX_RING_CAPACITY] = messages[i];
+
+    // room was reserved by reserveBoxMessages
+    box->offsets[message_count] = offset;
+    offset += messages[i]->len + 1;
+
+    __atomic_store_n(&box->size, (ssize_t)offset, __ATOMIC_RELEASE);
+  }
+
+  __atomic_store_n(&box->message_count, message_count, __ATOMIC_RELEASE);
+
+  // everyone waiting is waiting for the first of these messages
+  BoxWaiter *waiter = box->waiters;
+  box->waiters = NULL;
+  while (waiter != NULL)
+  {
+    BoxWaiter *next = waiter->next;
+    waiter->waiting = false;
+    waiter->notify(waiter);
+    waiter = next;
+  }
+
+  pthread_mutex_unlock(&box->ring_lock);
+}
+
+size_t acquireBoxMessages(BoxData *box, uint64_t seq, BoxMessage **messages, size_t max)
+{
+  size_t count = 0;
+
+  pthread_mutex_lock(&box->ring_lock);
+
+  if (seq >= box->ring_first)
+  {
+    for (; count < max && seq + count < box->message_count; count++)
+    {
+      messages[count] = box->ring[(seq + count) % BOX_RING_CAPACITY];
+      __atomic_add_fetch(&messages[count]->refs, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  pthread_mutex_unlock(&box->ring_lock);
+  return count;
+}
+
+int findBoxMessage(BoxData *box, uint64_t seq, size_t *offset, size_t *len)
+{
+  int ret = -1;
+
+  pthread_mutex_lock(&box->ring_lock);
+
+  if (seq < box->message_count)
+  {
+    uint64_t end = seq + 1 < box->message_count ? box->offsets[seq + 1] : (uint64_t)box->size;
+
+    *offset = (size_t)box->offsets[seq];
+    *len = (size_t)(end - box->offsets[seq]) - 1;
+    ret = 0;
+  }
+
+  pthread_mutex_unlock(&box->ring_lock);
+  return ret;
+}
+
+bool waitBoxMessage(BoxData *box, BoxWaiter *waiter, uint64_t seq)
+{
+  pthread_mutex_lock(&box->ring_lock);
+
+  bool published = seq < box->message_count;
+  if (!published && !waiter->waiting)
+  {
+    waiter->waiting = true;
+    waiter->prev = NULL;
+    waiter->next = box->waiters;
+    if (box->waiters != NULL)
+      box->waiters->prev = waiter;
+    box->waiters = waiter;
+  }
+
+  pthread_mutex_unlock(&box->ring_lock);
+  return !published;
+}
+
+void cancelBoxWait(BoxData *box, BoxWaiter *waiter)
+{
+  pthread_mutex_lock(&box->ring_lock);
+
+  if (waiter->waiting)
+  {
+    if (waiter->prev != NULL)
+      waiter->prev->next = waiter->next;
+    else
+      box->waiters = waiter->next;
+    if (waiter->next != NULL)
+      waiter->next->prev = waiter->prev;
+
+    waiter->waiting = false;
+  }
+
+  pthread_mutex_unlock(&box->ring_lock);
+}
+
+void releaseBoxMessage(BoxMessage *message)
+{
+  if (__atomic_sub_fetch(&message->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    free(message);
+}
+
+uint64_t boxMessageCount(BoxData *box)
+{
+  return __atomic_load_n(&box->message_count, __ATOMIC_ACQUIRE);
+}
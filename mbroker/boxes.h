@@ -0,0 +1,175 @@
+#ifndef __MBROKER_BOXES_H__
+#define __MBROKER_BOXES_H__
+
+#include "wire_protocol.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// number of recent messages each box keeps in memory
+#define BOX_RING_CAPACITY 256
+
+// a message kept in memory by a box, shared by every subscriber delivering it
+//
+// The message is kept framed as it is sent to subscribers, so that it is
+// written to their pipes as is
+typedef struct
+{
+  uint64_t refs;
+  size_t len;       // not counting the NUL terminator
+  char *text;       // NUL-terminated, within frame
+  size_t frame_len; // wire header and text, without the NUL terminator
+  char frame[];
+} BoxMessage;
+
+// someone waiting for a message to be published to a box
+typedef struct BoxWaiter
+{
+  // called (with the box ring lock held) once the message is published
+  void (*notify)(struct BoxWaiter *waiter);
+  void *data;
+
+  bool waiting;
+  struct BoxWaiter *next;
+  struct BoxWaiter *prev;
+} BoxWaiter;
+
+typedef struct BoxData
+{
+  char *name;
+  ssize_t size;
+
+  // tfs handle of the box, kept open while the box exists (-1 until it is
+  // set, once the box is created in tfs), for positional reads and appends
+  int fhandle;
+
+  uint64_t subs;
+  uint64_t pubs;
+
+  // set while the box is being deleted, so that no session starts on it
+  // (sessions count themselves in before checking it, see joinBox)
+  bool deleting;
+
+  pthread_mutex_t pcq_publisher_condvar_lock;
+  pthread_cond_t pcq_publisher_condvar;
+
+  // the most recent messages, so that subscribers do not go through tfs
+  pthread_mutex_t ring_lock;
+  BoxMessage *ring[BOX_RING_CAPACITY];
+  uint64_t ring_first;    // sequence number of the oldest message in the ring
+  uint64_t message_count; // sequence number of the next message
+
+  // offset of every message in the box (protected by ring_lock)
+  uint64_t *offsets;
+  size_t offsets_capacity;
+
+  // waiting for message number message_count (protected by ring_lock)
+  BoxWaiter *waiters;
+
+  // registry bookkeeping
+  uint32_t hash;
+  uint64_t refs;         // references held by the registry and by sessions
+  bool deleted;          // set once the box is removed from the registry
+  struct BoxData *next;  // next box in the same registry bucket
+} BoxData;
+
+// initBoxRegistry: create the (empty) registry of boxes
+int initBoxRegistry(void);
+
+// destroyBoxRegistry: drop the registry's references to every box
+void destroyBoxRegistry(void);
+
+// registerBox: create a box and add it to the registry
+//
+// Returns the new box with a reference held by the caller, or NULL if a box
+// with the same name already exists (or memory is exhausted)
+BoxData *registerBox(char const *box_name);
+
+// acquireBox: find a box by name and take a reference to it
+//
+// The box stays valid until the reference is released, even if it is
+// removed from the registry in the meantime
+BoxData *acquireBox(char const *box_name);
+
+// releaseBox: drop a reference to a box, freeing it if it was the last one
+void releaseBox(BoxData *box);
+
+// unregisterBox: remove a box from the registry
+//
+// Returns 0 if the box was removed, -1 if it was not registered
+int unregisterBox(BoxData *box);
+
+// acquireAllBoxes: take a reference to every registered box
+//
+// Stores a newly allocated array with the boxes in *boxes (to be released
+// with releaseBox and freed by the caller) and returns its length, or -1 on
+// allocation failure
+ssize_t acquireAllBoxes(BoxData ***boxes);
+
+// reserveBoxMessages: make room in the box index for count more messages
+//
+// To be called by the box publisher before writing the messages to tfs, so
+// that appendBoxMessages cannot fail once the messages are persisted
+//
+// Returns 0 if successful, -1 otherwise
+int reserveBoxMessages(BoxData *box, size_t count);
+
+// loadBoxMessages: index the messages of a box restored from tfs, given its
+// contents (NUL-terminated messages, one after the other)
+//
+// The messages are not put in the ring: subscribers read them from tfs. A
+// message missing its NUL terminator (torn write) is not indexed.
+//
+// Returns the number of bytes indexed, -1 on allocation failure
+ssize_t loadBoxMessages(BoxData *box, char const *contents, size_t size);
+
+// createBoxMessage: copy a message into a new box message, with a reference
+// held by the caller
+//
+// Returns NULL on allocation failure
+BoxMessage *createBoxMessage(char const *message, size_t message_len);
+
+// appendBoxMessages: add count messages (already written to the box in tfs,
+// one after the other from offset) to the box ring, evicting the oldest ones
+// if the ring is full
+//
+// Takes the caller's references to the messages. Also accounts for the
+// messages in the box size, message count and index, and notifies the
+// waiters once for all of them
+void appendBoxMessages(BoxData *box, BoxMessage **messages, size_t count, size_t offset);
+
+// acquireBoxMessages: take a reference to messages number seq onwards of a
+// box, up to max of them, storing them in messages
+//
+// Returns how many consecutive messages were taken: 0 if message number seq
+// is not in the ring (not published yet, or evicted, in which case it has to
+// be read from tfs)
+size_t acquireBoxMessages(BoxData *box, uint64_t seq, BoxMessage **messages, size_t max);
+
+// findBoxMessage: offset and length (not counting the NUL terminator) of
+// message number seq in the box
+//
+// Returns 0 if successful, -1 if the message was not published yet
+int findBoxMessage(BoxData *box, uint64_t seq, size_t *offset, size_t *len);
+
+// waitBoxMessage: have waiter notified once message number seq of a box is
+// published (only once: the waiter must wait again for the next message)
+//
+// Returns false, without waiting, if it already was
+bool waitBoxMessage(BoxData *box, BoxWaiter *waiter, uint64_t seq);
+
+// cancelBoxWait: stop waiting; once this returns, waiter is not notified
+void cancelBoxWait(BoxData *box, BoxWaiter *waiter);
+
+// releaseBoxMessage: drop a reference to a message
+void releaseBoxMessage(BoxMessage *message);
+
+// boxMessageCount: number of messages published to a box
+//
+// Box size is updated before the count, so after reading the count the box
+// size covers at least that many messages
+uint64_t boxMessageCount(BoxData *box);
+
+#endif // __MBROKER_BOXES_H__
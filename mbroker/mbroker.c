@@ -6,93 +6,73 @@
 
 #include "pthread.h"
 #include "errno.h"
+#include "stddef.h"
 
 #include "producer-consumer.h"
+#include "boxes.h"
+#include "sessions.h"
+#include "workers.h"
+#include "shm_ring.h"
 
 #include "signal.h"
+#include "limits.h"
 #include "errno.h"
-volatile sig_atomic_t exit_flag = 0;
+#include "time.h"
+// bytes read from the register pipe at once
+#define REGISTER_BUFFER_SIZE (16 * PROTOCOL_MESSAGE_SIZE)
 
-static void handleSIGINT(int sig)
-{
-  (void)sig;
-  exit_flag = 1;
-}
-typedef struct
-{
-  char *name;
-  ssize_t size;
+// register messages each worker queues (across its priority classes)
+#define WORKER_QUEUE_CAPACITY 32
 
-  uint64_t subs;
-  uint64_t pubs;
+// queue priority class of control plane register messages (create, delete
+// and list boxes), handled by the control lane rather than the session workers
+#define CONTROL_PRIORITY 1
 
-  pthread_mutex_t pcq_publisher_condvar_lock;
-  pthread_cond_t pcq_publisher_condvar;
+// workers of the control lane (more are started while some are blocked on
+// clients, up to the maximum)
+#define CONTROL_MIN_WORKERS 1
+#define CONTROL_MAX_WORKERS 4
 
-  pthread_cond_t pcq_subscriber_condvar;
-} BoxData;
+// how long a control plane reply waits for the client to open its pipe, and
+// how often it checks
+#define CLIENT_OPEN_TIMEOUT_MS 2000
+#define CLIENT_OPEN_RETRY_US 1000
 
-typedef struct
-{
-  BoxData **boxes;
-  long unsigned int box_count;
-} State;
+// register requests allocated at once when none is free
+#define REQUEST_SLAB_SIZE 64
 
-State *server_state;
+// session workers kept running when idle, unless given on the command line
+#define MIN_SESSION_WORKERS 1
 
-// init global state
-int initServerState()
-{
-  server_state = (State *)malloc(sizeof(State));
+// publisher and subscriber handshakes can block on slow clients
+static WorkerPool session_workers;
 
-  if (server_state == NULL)
-    return -1;
+// control plane operations are short, and never wait behind handshakes
+static WorkerPool control_lane;
 
-  server_state->box_count = 0;
-  return 0;
-}
+volatile sig_atomic_t exit_flag = 0;
 
-BoxData *initBox(char *box_name)
+static void handleSIGINT(int sig)
 {
-  BoxData *box = (BoxData *)malloc(sizeof(BoxData));
-
-  box->name = (char *)malloc(sizeof(char) * (strlen(box_name) + 1));
-
-  if (box->name == NULL)
-    return NULL;
-
-  strcpy(box->name, box_name);
-
-  box->size = 0;
-  box->subs = 0;
-  box->pubs = 0;
-
-  if (pthread_mutex_init(&box->pcq_publisher_condvar_lock, NULL) != 0)
-    return NULL;
-
-  if (pthread_cond_init(&box->pcq_publisher_condvar, NULL) != 0)
-    return NULL;
-
-  if (pthread_cond_init(&box->pcq_subscriber_condvar, NULL) != 0)
-    return NULL;
-
-  return box;
+  (void)sig;
+  exit_flag = 1;
 }
-
-BoxData *getBox(char *box_name)
+// count a session in on a box (subs or pubs), unless the box is being
+// deleted: the count is raised before checking, so either deleteBox sees the
+// session or the session sees the deletion
+static bool joinBox(BoxData *box, uint64_t *count)
 {
-  for (int i = 0; i < server_state->box_count; i++)
-  {
-    if (strcmp(server_state->boxes[i]->name, box_name) == 0)
-      return server_state->boxes[i];
-  }
+  __atomic_add_fetch(count, 1, __ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&box->deleting, __ATOMIC_SEQ_CST))
+    return true;
 
-  return NULL;
+  __atomic_sub_fetch(count, 1, __ATOMIC_SEQ_CST);
+  return false;
 }
 
-int handlePublisher(char *client_pipe_name, char *box_name)
+int handlePublisher(char *client_pipe_name, char *box_name, bool shm)
 {
-  BoxData *box = getBox(box_name);
+  BoxData *box = acquireBox(box_name);
 
   if (box == NULL)
   {
@@ -106,6 +86,7 @@ int handlePublisher(char *client_pipe_name, char *box_name)
   {
     unlink(client_pipe_name);
     WARN("Error lock mutex: %s\n", strerror(errno));
+    releaseBox(box);
     return -1;
   }
 
@@ -115,140 +96,66 @@ int handlePublisher(char *client_pipe_name, char *box_name)
   {
     if (pthread_cond_wait(&box->pcq_publisher_condvar, &box->pcq_publisher_condvar_lock) != 0)
     {
+      pthread_mutex_unlock(&box->pcq_publisher_condvar_lock);
       unlink(client_pipe_name);
       WARN("Error waiting mutex: %s\n", strerror(errno));
+      releaseBox(box);
       return -1;
     }
   }
 
-  box->pubs++;
-
-  // Unlock publisher mutex
-  if (pthread_mutex_unlock(&box->pcq_publisher_condvar_lock) != 0)
+  if (!joinBox(box, &box->pubs))
   {
+    pthread_cond_broadcast(&box->pcq_publisher_condvar);
+    pthread_mutex_unlock(&box->pcq_publisher_condvar_lock);
     unlink(client_pipe_name);
-    WARN("Error unlock mutex: %s\n", strerror(errno));
-    box->pubs--;
-
-    // broadcast pubs decrement
-    if (pthread_cond_broadcast(&box->pcq_publisher_condvar) != 0)
-    {
-      WARN("Error broadcasting mutex: %s\n", strerror(errno));
-    }
-
+    WARN("Box %s is being deleted\n", box_name);
+    releaseBox(box);
     return -1;
   }
 
-  char updatedBoxName[BOX_NAME_SIZE + 1] = "/";
+  // Unlock publisher mutex
+  if (pthread_mutex_unlock(&box->pcq_publisher_condvar_lock) != 0)
+    WARN("Error unlock mutex: %s\n", strerror(errno));
 
-  strcat(updatedBoxName, box->name);
+  // map the publisher's ring before connecting, while it surely exists
+  ShmRing *ring = NULL;
+  char shm_name[NAME_MAX + 1];
+  if (shm && (shmRingName(shm_name, sizeof(shm_name), client_pipe_name) == -1 || (ring = shmRingOpen(shm_name)) == NULL))
+    WARN("Error opening shared memory ring for %s\n", client_pipe_name);
 
   // connect to publisher
-  int client_fifo = open(client_pipe_name, O_RDONLY);
-
-  int fhandle = -1;
+  int client_fifo = -1;
+  if (!shm || ring != NULL)
+    client_fifo = open(client_pipe_name, O_RDONLY);
 
-  bool error = false;
-
-  // read from publisher fifo
-  char buffer[PROTOCOL_MESSAGE_SIZE];
-  while (1)
-  {
-    if (read(client_fifo, buffer, PROTOCOL_MESSAGE_SIZE) == 0)
-      break;
-
-    // parse wire message received
-    OP_CODE_SIZE message_op_code;
-    char message[MESSAGE_SIZE];
-    sscanf(buffer, "%hhd|%[^\n]", &message_op_code, message);
-
-    size_t message_len = strlen(message);
-
-    char buffer_to_write[message_len + 1];
-    strcpy(buffer_to_write, message);
-    buffer_to_write[message_len] = '\0';
-
-    // needs to be open every time to adjust offset to start writing in correct spot
-    fhandle = tfs_open(updatedBoxName, TFS_O_APPEND);
-
-    if (fhandle == -1)
-    {
-      WARN("Error opening box: %s\n", box->name);
-      error = true;
-      break;
-    }
-
-    ssize_t bytes_written = tfs_write(fhandle, buffer_to_write, message_len + 1);
-
-    if (bytes_written == -1)
-    {
-      WARN("Error writing to box %s\n", box->name);
-      error = true;
-
-      if (tfs_close(fhandle) == -1)
-        WARN("Error closing box %s\n", box->name);
-
-      break;
-    }
-
-    box->size += bytes_written;
-
-    // broadcast change in box subs
-    if (pthread_cond_broadcast(&box->pcq_subscriber_condvar) != 0)
-    {
-      WARN("Error broadcasting mutex: %s\n", strerror(errno));
-      error = true;
-      break;
-    }
-
-    if (tfs_close(fhandle) == -1)
-    {
-      WARN("Error closing box %s\n", box->name);
-      error = true;
-      break;
-    }
-  }
-
-  // close box
-  // no error checking because if error still need to run command below
-  if (fhandle != -1)
-  {
-    if (tfs_close(fhandle) == -1)
-    {
-      WARN("Error closing box %s\n", box->name);
-      error = true;
-    }
-  }
-
-  // close fifo
-  if (close(client_fifo) == -1)
-  {
-    WARN("Error closing fifo %s\n", client_pipe_name);
-    error = true;
-  }
+  // the session now owns the fifo, the ring, the box reference and the
+  // publisher slot
+  if (client_fifo != -1 && startPublisherSession(box, client_fifo, client_pipe_name, ring) == 0)
+    return 0;
 
-  box->pubs--;
+  WARN("Error starting publisher session for %s\n", client_pipe_name);
 
-  // broadcast change in box pubs
-  if (pthread_cond_broadcast(&box->pcq_publisher_condvar) != 0)
-  {
-    WARN("Error broadcasting mutex: %s\n", strerror(errno));
-    error = true;
-  }
+  if (client_fifo != -1)
+    close(client_fifo);
+  if (ring != NULL)
+    shmRingClose(ring);
+  unlink(client_pipe_name);
 
-  if (error)
-  {
-    unlink(client_pipe_name);
-    return -1;
-  }
+  // free the box for the next publisher
+  pthread_mutex_lock(&box->pcq_publisher_condvar_lock);
+  __atomic_sub_fetch(&box->pubs, 1, __ATOMIC_RELAXED);
+  pthread_cond_broadcast(&box->pcq_publisher_condvar);
+  pthread_mutex_unlock(&box->pcq_publisher_condvar_lock);
 
-  return 0;
+  releaseBox(box);
+  return -1;
 }
 
 int handleSubscriber(char *client_pipe_name, char *box_name)
 {
   // Find the specified box
-  BoxData *box = getBox(box_name);
+  BoxData *box = acquireBox(box_name);
   if (box == NULL)
   {
     unlink(client_pipe_name);
@@ -256,159 +163,97 @@ int handleSubscriber(char *client_pipe_name, char *box_name)
     return -1;
   }
 
-  box->subs++;
-
-  char updatedBoxName[BOX_NAME_SIZE + 1] = "/";
-
-  strcat(updatedBoxName, box->name);
-
-  int fhandle = -1;
-
-  ssize_t bytes_read;
-  ssize_t last_bytes_read = 0;
-
-  pthread_mutex_t box_subscriber;
-
-  if (pthread_mutex_init(&box_subscriber, NULL) != 0)
+  if (!joinBox(box, &box->subs))
   {
-    WARN("Error init mutex: %s\n", strerror(errno));
+    unlink(client_pipe_name);
+    WARN("Error: Box %s is being deleted.\n", box_name);
+    releaseBox(box);
     return -1;
   }
 
-  // connect to publisher
+  // connect to subscriber
   int client_fifo = open(client_pipe_name, O_WRONLY);
-  char buffer[PROTOCOL_MESSAGE_SIZE];
-
-  bool error = false;
-
-  while (access(client_pipe_name, F_OK) != -1)
-  {
-    if (pthread_mutex_lock(&box_subscriber) != 0)
-    {
-      WARN("Error lock mutex: %s\n", strerror(errno));
-      error = true;
-      break;
-    }
-
-    int res = 0;
-
-    while (box->size == last_bytes_read)
-    {
-      // wait for publisher to write to box
-      struct timespec ts;
-      clock_gettime(CLOCK_REALTIME, &ts);
-      ts.tv_sec += 1; // 1s
-
-      // time out limit to check if subscriber is still connected
-      res = pthread_cond_timedwait(&box->pcq_subscriber_condvar, &box_subscriber, &ts);
-      if (res != 0)
-        break;
-    }
-
-    if (res == ETIMEDOUT)
-    {
-      if (pthread_mutex_unlock(&box_subscriber) != 0)
-      {
-        WARN("Error unlock mutex: %s\n", strerror(errno));
-        error = true;
-        break;
-      }
-
-      continue;
-    }
-
-    if (pthread_mutex_unlock(&box_subscriber) != 0)
-    {
-      WARN("Error unlock mutex: %s\n", strerror(errno));
-      error = true;
-      break;
-    }
-
-    // needs to be open every time to adjust offset to start writing in correct spot
-    fhandle = tfs_open(updatedBoxName, 0);
-
-    if (fhandle == -1)
-    {
-      WARN("Error opening box: %s\n", box->name);
-      error = true;
-      break;
-    }
-
-    bytes_read = tfs_read(fhandle, buffer, PROTOCOL_MESSAGE_SIZE);
-    if (bytes_read == -1)
-    {
-      WARN("Error reading box: %s\n", box->name);
-      error = true;
-      break;
-    }
 
-    char message[MESSAGE_SIZE];
+  // the session now owns the fifo and the box reference
+  if (client_fifo != -1 && startSubscriberSession(box, client_fifo, client_pipe_name) == 0)
+    return 0;
 
-    for (int i = 0; i < bytes_read - last_bytes_read; i++)
-    {
-      if (buffer[last_bytes_read + i] == '\0')
-      {
-        message[i] = '\0';
-        last_bytes_read += i + 1;
-        break;
-      }
-      else
-      {
-        message[i] = buffer[last_bytes_read + i];
-      }
-    }
+  WARN("Error starting subscriber session for %s\n", client_pipe_name);
 
-    char wire_message[PROTOCOL_MESSAGE_SIZE];
+  if (client_fifo != -1)
+    close(client_fifo);
+  unlink(client_pipe_name);
 
-    sprintf(wire_message, "%d|%s", SEND_SUBSCRIBER, message);
+  __atomic_sub_fetch(&box->subs, 1, __ATOMIC_RELAXED);
+  releaseBox(box);
+  return -1;
+}
 
-    if (write(client_fifo, wire_message, PROTOCOL_MESSAGE_SIZE) == -1)
-    {
-      WARN("Error writing to fifo %s\n", client_pipe_name);
-      error = true;
-      break;
-    }
+// open a client pipe to reply to a control plane request, waiting at most
+// CLIENT_OPEN_TIMEOUT_MS for the client to open it (a client that died
+// before opening it would otherwise block the worker forever)
+static int openClientPipe(char const *client_pipe_name)
+{
+  struct timespec retry = {.tv_sec = 0, .tv_nsec = CLIENT_OPEN_RETRY_US * 1000};
+  int client_fifo = -1;
 
-    if (tfs_close(fhandle) == -1)
-    {
-      WARN("Error closing box %s\n", box->name);
-      error = true;
+  // without a reader, a non-blocking open fails with ENXIO
+  for (long waited_us = 0; waited_us <= CLIENT_OPEN_TIMEOUT_MS * 1000L; waited_us += CLIENT_OPEN_RETRY_US)
+  {
+    client_fifo = open(client_pipe_name, O_WRONLY | O_NONBLOCK);
+    if (client_fifo != -1 || (errno != ENXIO && errno != EINTR))
       break;
-    }
+    nanosleep(&retry, NULL);
   }
 
-  // close box
-  // no error checking because if error still need to run command below
-  if (fhandle != -1)
+  if (client_fifo == -1)
   {
-    if (tfs_close(fhandle) == -1)
-    {
-      WARN("Error closing box %s\n", box->name);
-      error = true;
-    }
+    WARN("Error opening fifo %s: %s\n", client_pipe_name, strerror(errno));
+    return -1;
   }
 
-  // close fifo
-  if (close(client_fifo) == -1)
+  // replies are written whole, as with a blocking open
+  if (fcntl(client_fifo, F_SETFL, fcntl(client_fifo, F_GETFL) & ~O_NONBLOCK) == -1)
   {
-    WARN("Error closing fifo %s\n", client_pipe_name);
-    error = true;
+    close(client_fifo);
+    return -1;
   }
 
-  box->subs--;
+  return client_fifo;
+}
+
+// write a create or delete box response to the client pipe
+static int replyBox(char *client_pipe_name, OP_CODE_SIZE op_code, int return_code, char const *error_message)
+{
+  // build response
+  WireReturn response;
+  response.return_code = return_code;
+  size_t error_len = strnlen(error_message, MESSAGE_SIZE);
+  memcpy(response.error_message, error_message, error_len);
 
-  if (error)
+  // write to client pipe
+  int client_fifo = openClientPipe(client_pipe_name);
+  if (client_fifo == -1)
+    return -1;
+  if (wireWrite(client_fifo, op_code, 0, &response, offsetof(WireReturn, error_message) + error_len) == -1)
   {
-    unlink(client_pipe_name);
+    WARN("Error while writing to client fifo");
+    if (close(client_fifo) == -1)
+      WARN("Error closing fifo %s\n", client_pipe_name);
     return -1;
   }
 
+  // close client pipe
+  if (close(client_fifo) == -1)
+    WARN("Error closing fifo %s\n", client_pipe_name);
+
   return 0;
 }
 
 int createBox(char *client_pipe_name, char *box_name)
 {
-  char wire_message[PROTOCOL_MESSAGE_SIZE];
+  int return_code = 0;
+  char const *error_message = "";
 
   // format string for tfs
   char box_name_update[BOX_NAME_SIZE + 1] = "/";
@@ -416,71 +261,61 @@ int createBox(char *client_pipe_name, char *box_name)
   // probably need to extend tfs api
   strcat(box_name_update, box_name);
 
-  // create box in tfs open
-  int fhandle = tfs_open(box_name_update, TFS_O_CREAT);
-
-  if (fhandle == -1 || tfs_close(fhandle) == -1 || getBox(box_name) != NULL)
-    // build ERROR response
-    snprintf(wire_message, PROTOCOL_MESSAGE_SIZE, "%d|%d|%s", RETURN_CREATE_BOX, -1, "Error creating box");
-  else
-    // build OK response
-    snprintf(wire_message, PROTOCOL_MESSAGE_SIZE, "%d|%d|%s", RETURN_CREATE_BOX, 0, "\0");
+  // register the box first, so that duplicate names are rejected before
+  // touching tfs
+  BoxData *box = registerBox(box_name);
 
-  // open client pipe
-  int client_fifo = open(client_pipe_name, O_WRONLY);
+  // create box in tfs, keeping it open for the sessions of the box (the box
+  // closes it once freed); a file the registry does not know about holds
+  // messages that were never restored, so it is not overwritten
+  int fhandle = -1;
+  if (box != NULL && !tfs_exists(box_name_update))
+    fhandle = tfs_open(box_name_update, TFS_O_CREAT);
+  if (fhandle != -1)
+    __atomic_store_n(&box->fhandle, fhandle, __ATOMIC_RELEASE);
 
-  if (write(client_fifo, wire_message, PROTOCOL_MESSAGE_SIZE) == -1)
+  // the box exists (durably, with an image) before the client is told so
+  if (box == NULL || fhandle == -1 || tfs_sync() == -1)
   {
-    WARN("Error while writing to client fifo\n");
-    if (close(client_fifo) == -1)
-      WARN("Error closing fifo %s\n", client_pipe_name);
-    return -1;
-  };
-
-  // close client pipe
-  if (close(client_fifo) == -1)
-    WARN("Error closing fifo %s\n", client_pipe_name);
-
-  // create box structure
-  BoxData *box = (BoxData *)malloc(sizeof(BoxData));
-  box->subs = 0;
-  box->pubs = 0;
-
-  if (box == NULL)
-    return -1;
+    if (box != NULL)
+      unregisterBox(box);
 
-  // allocate memory for the box name
-  box->name = (char *)malloc(sizeof(char) * (strlen(box_name) + 1));
-  if (box->name == NULL)
-    return -1;
-  strcpy(box->name, box_name);
-
-  // add box to the server state
-  server_state->box_count++;
-
-  server_state->boxes = realloc(server_state->boxes, sizeof(BoxData *) * server_state->box_count);
-  if (server_state->boxes == NULL)
-    return -1;
+    // build ERROR response
+    return_code = -1;
+    error_message = "Error creating box";
+  }
 
-  // insert the newly created box
-  server_state->boxes[server_state->box_count - 1] = box;
+  if (box != NULL)
+    releaseBox(box);
 
-  return 0;
+  return replyBox(client_pipe_name, RETURN_CREATE_BOX, return_code, error_message);
 }
 
 int listBoxes(char *client_pipe_name)
 {
-  char wire_message[PROTOCOL_MESSAGE_SIZE];
+  WireBoxInfo box_info;
+  memset(&box_info, 0, sizeof(box_info));
+
+  // snapshot the registered boxes
+  BoxData **boxes;
+  ssize_t box_count = acquireAllBoxes(&boxes);
+
+  if (box_count == -1)
+  {
+    WARN("Error while listing boxes");
+    return -1;
+  }
 
   // check if no box was created
-  if (server_state->box_count == 0)
+  if (box_count == 0)
   {
-    // write message
-    snprintf(wire_message, PROTOCOL_MESSAGE_SIZE, "%d|%d|%s|%d|%d|%d", RETURN_LIST_BOXES, 1, "\0", 0, 0, 0);
+    free(boxes);
 
-    // write to client pipe
-    int client_fifo = open(client_pipe_name, O_WRONLY);
-    if (write(client_fifo, wire_message, PROTOCOL_MESSAGE_SIZE) == -1)
+    // write to client pipe (a last box with no name)
+    int client_fifo = openClientPipe(client_pipe_name);
+    if (client_fifo == -1)
+      return -1;
+    if (wireWrite(client_fifo, RETURN_LIST_BOXES, WIRE_FLAG_LAST, &box_info, sizeof(box_info)) == -1)
     {
       WARN("Error while writing to client fifo");
       if (close(client_fifo) == -1)
@@ -495,117 +330,63 @@ int listBoxes(char *client_pipe_name)
   }
 
   // open client fifo
-  int client_fifo = open(client_pipe_name, O_WRONLY);
+  int client_fifo = openClientPipe(client_pipe_name);
 
-  for (int i = 0; i < server_state->box_count; i++)
+  int ret = client_fifo == -1 ? -1 : 0;
+  for (ssize_t i = 0; i < box_count && ret == 0; i++)
   {
 
-    BoxData *box_data = server_state->boxes[i];
+    BoxData *box_data = boxes[i];
 
-    char *name = box_data->name;
-    uint64_t pub = box_data->pubs;
-    uint64_t sub = box_data->subs;
-
-    // format string for tfs
-    char box_name_update[BOX_NAME_SIZE + 1] = "/";
-    strcat(box_name_update, name);
-
-    int fhandle = tfs_open(box_name_update, 0);
-    if (fhandle == -1)
-    {
-      WARN("Error while getting file bytes");
-      if (close(client_fifo) == -1)
-        WARN("Error closing fifo %s\n", client_pipe_name);
-      return -1;
-    }
+    strncpy(box_info.box_name, box_data->name, BOX_NAME_SIZE - 1);
+    box_info.n_publishers = __atomic_load_n(&box_data->pubs, __ATOMIC_RELAXED);
+    box_info.n_subscribers = __atomic_load_n(&box_data->subs, __ATOMIC_RELAXED);
 
-    char buffer[MESSAGE_SIZE];
-    BOX_SIZE box_size = (BOX_SIZE)tfs_read(fhandle, buffer, 1024);
-
-    if (box_size == -1)
-    {
-      WARN("Error while getting file bytes");
-      if (close(client_fifo) == -1)
-        WARN("Error closing fifo %s\n", client_pipe_name);
-      return -1;
-    }
-
-    // parse wire message
-    snprintf(wire_message, PROTOCOL_MESSAGE_SIZE, "%hhd|%hhd|%s|%ld|%ld|%ld", RETURN_LIST_BOXES, i == server_state->box_count - 1, name, box_size, pub, sub);
+    // the box index keeps track of the size, no need to read the box
+    box_info.box_size = (BOX_SIZE)__atomic_load_n(&box_data->size, __ATOMIC_ACQUIRE);
 
     // write to client pipe
-    if (write(client_fifo, wire_message, PROTOCOL_MESSAGE_SIZE) == -1)
+    uint8_t flags = i == box_count - 1 ? WIRE_FLAG_LAST : 0;
+    if (wireWrite(client_fifo, RETURN_LIST_BOXES, flags, &box_info, sizeof(box_info)) == -1)
     {
       WARN("Error while writing to client fifo");
-      if (close(client_fifo) == -1)
-        WARN("Error closing fifo %s\n", client_pipe_name);
-      return -1;
+      ret = -1;
+      break;
     };
   }
 
+  for (ssize_t i = 0; i < box_count; i++)
+    releaseBox(boxes[i]);
+  free(boxes);
+
   // close client fifo
-  if (close(client_fifo) == -1)
+  if (client_fifo != -1 && close(client_fifo) == -1)
     WARN("Error closing fifo %s\n", client_pipe_name);
-  return 0;
+  return ret;
 }
 
 int deleteBox(char *client_pipe_name, char *box_name)
 {
-  char wire_message[PROTOCOL_MESSAGE_SIZE];
-  int box_index = -1;
-
   // check if box exists
-  for (int i = 0; i < server_state->box_count; i++)
-  {
-    if (strcmp(server_state->boxes[i]->name, box_name) == 0)
-    {
-      box_index = i;
-      break;
-    }
-  }
-
-  if (box_index == -1)
-  {
-    // build ERROR response
-    snprintf(wire_message, PROTOCOL_MESSAGE_SIZE, "%d|%d|%s", RETURN_DELETE_BOX, -1, "Box does not exist");
-
-    // write to client pipe
-    int client_fifo = open(client_pipe_name, O_WRONLY);
-    if (write(client_fifo, wire_message, PROTOCOL_MESSAGE_SIZE) == -1)
-    {
-      if (close(client_fifo) == -1)
-        WARN("Error closing fifo %s\n", client_pipe_name);
-      return -1;
-    }
+  BoxData *box = acquireBox(box_name);
 
-    // close client pipe
-    if (close(client_fifo) == -1)
-      WARN("Error closing fifo %s\n", client_pipe_name);
+  if (box == NULL)
+    return replyBox(client_pipe_name, RETURN_DELETE_BOX, -1, "Box does not exist");
 
-    return 0;
+  // keep new sessions (and other deletions) off the box before checking for
+  // sessions, so that none starts between the check and the unlink
+  bool deleting = false;
+  if (!__atomic_compare_exchange_n(&box->deleting, &deleting, true, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+  {
+    releaseBox(box);
+    return replyBox(client_pipe_name, RETURN_DELETE_BOX, -1, "Box is being deleted");
   }
 
-  BoxData *box = server_state->boxes[box_index];
-
-  if (box->subs || box->pubs)
+  if (__atomic_load_n(&box->subs, __ATOMIC_SEQ_CST) || __atomic_load_n(&box->pubs, __ATOMIC_SEQ_CST))
   {
-    // build ERROR response
-    snprintf(wire_message, PROTOCOL_MESSAGE_SIZE, "%d|%d|%s", RETURN_DELETE_BOX, -1, "Box is still in use");
-
-    // write to client pipe
-    int client_fifo = open(client_pipe_name, O_WRONLY);
-    if (write(client_fifo, wire_message, PROTOCOL_MESSAGE_SIZE) == -1)
-    {
-      if (close(client_fifo) == -1)
-        WARN("Error closing fifo %s\n", client_pipe_name);
-      return -1;
-    }
-
-    // close client pipe
-    if (close(client_fifo) == -1)
-      WARN("Error closing fifo %s\n", client_pipe_name);
-
-    return 0;
+    __atomic_store_n(&box->deleting, false, __ATOMIC_SEQ_CST);
+    releaseBox(box);
+    return replyBox(client_pipe_name, RETURN_DELETE_BOX, -1, "Box is still in use");
   }
 
   // delete box from tfs
@@ -614,65 +395,30 @@ int deleteBox(char *client_pipe_name, char *box_name)
 
   if (tfs_unlink(box_name_update) == -1)
   {
-    // build ERROR response
-    snprintf(wire_message, PROTOCOL_MESSAGE_SIZE, "%d|%d|%s", RETURN_DELETE_BOX, -1, "Error deleting box from TFS");
-
-    // write to client pipe
-    int client_fifo = open(client_pipe_name, O_WRONLY);
-    if (write(client_fifo, wire_message, PROTOCOL_MESSAGE_SIZE) == -1)
-    {
-      WARN("Error while writing to client fifo");
-      if (close(client_fifo) == -1)
-        WARN("Error closing fifo %s\n", client_pipe_name);
-      return -1;
-    }
-
-    // close client pipe
-    if (close(client_fifo) == -1)
-      WARN("Error closing fifo %s\n", client_pipe_name);
-
+    __atomic_store_n(&box->deleting, false, __ATOMIC_SEQ_CST);
+    releaseBox(box);
+    replyBox(client_pipe_name, RETURN_DELETE_BOX, -1, "Error deleting box from TFS");
     return -1;
   }
 
-  // free memory allocated for the box name
-  free(server_state->boxes[box_index]->name);
-
-  // free memory allocated for the box data structure
-  free(server_state->boxes[box_index]);
+  // remove the box from the server state; its memory is freed once the last
+  // session using it releases it
+  unregisterBox(box);
+  releaseBox(box);
 
-  // remove the box from the server state
-  for (int i = box_index; i < server_state->box_count - 1; i++)
-  {
-    server_state->boxes[i] = server_state->boxes[i + 1];
-  }
-  server_state->box_count--;
+  if (tfs_sync() == -1)
+    return replyBox(client_pipe_name, RETURN_DELETE_BOX, -1, "Error deleting box from TFS");
 
   // build OK response
-  snprintf(wire_message, PROTOCOL_MESSAGE_SIZE, "%d|%d|%s", RETURN_DELETE_BOX, 0, "\0");
-
-  // write to client pipe
-  int client_fifo = open(client_pipe_name, O_WRONLY);
-  if (write(client_fifo, wire_message, PROTOCOL_MESSAGE_SIZE) == -1)
-  {
-    WARN("Error while writing to client fifo");
-    if (close(client_fifo) == -1)
-      WARN("Error closing fifo %s\n", client_pipe_name);
-    return -1;
-  }
-
-  // close client pipe
-  if (close(client_fifo) == -1)
-    WARN("Error closing fifo %s\n", client_pipe_name);
-
-  return 0;
+  return replyBox(client_pipe_name, RETURN_DELETE_BOX, 0, "");
 }
 
-void session(OP_CODE_SIZE op_code, char *client_pipe_name, char *box_name)
+void session(OP_CODE_SIZE op_code, uint8_t flags, char *client_pipe_name, char *box_name)
 {
   switch (op_code)
   {
   case REGISTER_PUBLISHER:
-    handlePublisher(client_pipe_name, box_name);
+    handlePublisher(client_pipe_name, box_name, (flags & WIRE_FLAG_SHM) != 0);
     break;
 
   case REGISTER_SUBSCRIBER:
@@ -696,37 +442,325 @@ void session(OP_CODE_SIZE op_code, char *client_pipe_name, char *box_name)
   }
 }
 
-void thread_function(pc_queue_t *pcq)
+// queue priority class of a register message
+static size_t registrationPriority(OP_CODE_SIZE op_code)
 {
-  while (1)
+  switch (op_code)
   {
-    // get register message from producer-consumer queue
-    char *register_message = pcq_dequeue(pcq);
+  // a publisher holds the box slot other publishers wait for
+  case REGISTER_PUBLISHER:
+    return 0;
 
-    // parse register message
-    OP_CODE_SIZE op_code;
-    char client_pipe_name[PIPE_NAME_SIZE];
-    char box_name[BOX_NAME_SIZE];
-    sscanf(register_message, "%hhd|%[^|]|%s", &op_code, client_pipe_name, box_name);
+  // control plane
+  case CREATE_BOX:
+  case DELETE_BOX:
+  case LIST_BOXES:
+    return CONTROL_PRIORITY;
 
-    // free memory allocated for register message
-    // free(register_message);
+  default:
+    return 2;
+  }
+}
 
-    // handle session
-    session(op_code, client_pipe_name, box_name);
+// register message read from the register pipe, handed to a worker
+typedef struct RegisterRequest
+{
+  WireHeader header;
+  WireRegistration registration;
+  struct RegisterRequest *next; // in a free list
+} RegisterRequest;
+
+// requests freed by the workers, recycled by the register reader
+static pthread_mutex_t free_requests_lock = PTHREAD_MUTEX_INITIALIZER;
+static RegisterRequest *free_requests;
+
+// free requests owned by the register reader
+static RegisterRequest *reader_requests;
+
+// get a request for a register message (register reader only)
+static RegisterRequest *allocRequest(void)
+{
+  if (reader_requests == NULL)
+  {
+    // take every request freed by the workers at once
+    pthread_mutex_lock(&free_requests_lock);
+    reader_requests = free_requests;
+    free_requests = NULL;
+    pthread_mutex_unlock(&free_requests_lock);
+  }
+
+  if (reader_requests == NULL)
+  {
+    // requests are recycled, never freed: the pool only grows to the most
+    // register messages ever in flight
+    RegisterRequest *slab = (RegisterRequest *)calloc(REQUEST_SLAB_SIZE, sizeof(RegisterRequest));
+    if (slab == NULL)
+      return NULL;
+
+    for (size_t i = 0; i < REQUEST_SLAB_SIZE; i++)
+    {
+      slab[i].next = reader_requests;
+      reader_requests = &slab[i];
+    }
   }
+
+  RegisterRequest *request = reader_requests;
+  reader_requests = request->next;
+  return request;
+}
+
+static void freeRequest(RegisterRequest *request)
+{
+  pthread_mutex_lock(&free_requests_lock);
+  request->next = free_requests;
+  free_requests = request;
+  pthread_mutex_unlock(&free_requests_lock);
+}
+
+// handle a register message
+static void handleRegistration(void *work)
+{
+  RegisterRequest *request = (RegisterRequest *)work;
+  WireHeader header = request->header;
+  WireRegistration registration = request->registration;
+
+  // the request can be reused right away
+  freeRequest(request);
+
+  // names sent by clients are not trusted to be terminated
+  registration.client_pipe_name[PIPE_NAME_SIZE - 1] = '\0';
+  registration.box_name[BOX_NAME_SIZE - 1] = '\0';
+
+  // handle session
+  session(header.op_code, header.flags, registration.client_pipe_name, registration.box_name);
+}
+
+// read register messages until interrupted, handing each burst read to the
+// workers at once
+static void readRegistrations(int register_fifo)
+{
+  char buffer[REGISTER_BUFFER_SIZE];
+  size_t buffered = 0;
+
+  ssize_t bytes_read;
+  while ((bytes_read = read(register_fifo, buffer + buffered, REGISTER_BUFFER_SIZE - buffered)) > 0)
+  {
+    buffered += (size_t)bytes_read;
+
+    // register messages read, by queue priority class
+    void *batches[PCQ_PRIORITIES][REGISTER_BUFFER_SIZE / (sizeof(WireHeader) + sizeof(WireRegistration))];
+    size_t counts[PCQ_PRIORITIES] = {0};
+
+    WireHeader header;
+    void const *payload;
+    size_t start = 0;
+    ssize_t size;
+    while ((size = wireDecode(buffer + start, buffered - start, &header, &payload)) > 0)
+    {
+      start += (size_t)size;
+
+      if (header.payload_len != sizeof(WireRegistration))
+      {
+        WARN("Ignoring malformed register message");
+        continue;
+      }
+
+      // request for the workers (freed by the worker thread)
+      RegisterRequest *request = allocRequest();
+      if (request == NULL)
+      {
+        WARN("Error allocating register message");
+        continue;
+      }
+      request->header = header;
+      memcpy(&request->registration, payload, sizeof(WireRegistration));
+
+      size_t priority = registrationPriority(header.op_code);
+      batches[priority][counts[priority]++] = request;
+    }
+
+    if (size == -1)
+    {
+      // nothing after a malformed message can be trusted
+      WARN("Dropping malformed register messages");
+      start = buffered;
+    }
+
+    for (size_t priority = 0; priority < PCQ_PRIORITIES; priority++)
+    {
+      if (counts[priority] > 0)
+      {
+        WorkerPool *pool = priority == CONTROL_PRIORITY ? &control_lane : &session_workers;
+        submitWork(pool, batches[priority], counts[priority], priority);
+      }
+    }
+
+    // keep the beginning of a register message not read yet
+    memmove(buffer, buffer + start, buffered - start);
+    buffered -= start;
+  }
+
+  if (bytes_read == -1 && errno != EINTR)
+    WARN("Error while reading register fifo");
+}
+
+// names of the boxes found in tfs
+typedef struct
+{
+  char (*names)[BOX_NAME_SIZE];
+  size_t count;
+  size_t capacity;
+  bool failed;
+} BoxNames;
+
+static void collectBoxName(char const *name, void *data)
+{
+  BoxNames *box_names = (BoxNames *)data;
+
+  // not a box the broker could have created
+  if (strlen(name) >= BOX_NAME_SIZE || box_names->failed)
+    return;
+
+  if (box_names->count == box_names->capacity)
+  {
+    size_t capacity = box_names->capacity == 0 ? 16 : box_names->capacity * 2;
+    char(*names)[BOX_NAME_SIZE] = realloc(box_names->names, capacity * sizeof(*names));
+    if (names == NULL)
+    {
+      box_names->failed = true;
+      return;
+    }
+    box_names->names = names;
+    box_names->capacity = capacity;
+  }
+
+  strcpy(box_names->names[box_names->count++], name);
+}
+
+// register a box kept in tfs, indexing the messages it holds
+static int restoreBox(char const *box_name)
+{
+  char box_path[BOX_NAME_SIZE + 1] = "/";
+  strcat(box_path, box_name);
+
+  BoxData *box = registerBox(box_name);
+  if (box == NULL)
+    return -1;
+
+  // kept open for the sessions of the box (the box closes it once freed)
+  int fhandle = tfs_open(box_path, 0);
+  if (fhandle == -1)
+  {
+    unregisterBox(box);
+    releaseBox(box);
+    return -1;
+  }
+  __atomic_store_n(&box->fhandle, fhandle, __ATOMIC_RELEASE);
+
+  // read the whole box at once, its size known from the metadata
+  tfs_stat_t box_stat;
+  char *contents = NULL;
+  size_t size = 0;
+  ssize_t bytes_read = -1;
+  int status = tfs_stat(box_path, &box_stat);
+  if (status != -1)
+  {
+    size = box_stat.st_size;
+    contents = malloc(size > 0 ? size : 1);
+  }
+  if (contents != NULL)
+  {
+    bytes_read = tfs_pread(fhandle, contents, size, 0);
+    if (bytes_read != -1)
+      size = (size_t)bytes_read;
+  }
+
+  ssize_t indexed = bytes_read == -1 ? -1 : loadBoxMessages(box, contents, size);
+
+  // drop a torn last message, so that the next one is written where the
+  // index expects it
+  if (indexed != -1 && (size_t)indexed != size)
+  {
+    WARN("Dropping a partial message from box %s\n", box_name);
+    // in place, as a single change, so that a crash cannot lose the rest
+    if (tfs_truncate(fhandle, (size_t)indexed) == -1)
+      indexed = -1;
+  }
+
+  free(contents);
+
+  if (indexed == -1)
+    unregisterBox(box);
+  releaseBox(box);
+  return indexed == -1 ? -1 : 0;
+}
+
+// rebuild the box registry from the boxes kept in tfs
+static int restoreBoxes(void)
+{
+  BoxNames box_names = {.names = NULL, .count = 0, .capacity = 0, .failed = false};
+
+  int ret = tfs_list(collectBoxName, &box_names) == -1 || box_names.failed ? -1 : 0;
+
+  for (size_t i = 0; i < box_names.count && ret == 0; i++)
+  {
+    if (restoreBox(box_names.names[i]) == -1)
+    {
+      WARN("Error restoring box %s\n", box_names.names[i]);
+      ret = -1;
+    }
+  }
+
+  if (ret == 0 && box_names.count > 0)
+    WARN("Restored %zu boxes\n", box_names.count);
+
+  free(box_names.names);
+  return ret;
 }
 
 int main(int argc, char **argv)
 {
-  if (argc != 3)
+  if (argc < 3)
   {
-    printf("too few arguments");
+    printf("usage: mbroker <register_pipe_name> <max_sessions> [min_sessions] [--image <path>] [--wal-group <changes>] [--wal-delay <us>] [--cache <entries>]");
     return -1;
   }
 
   char *register_pipe_name = argv[1];
-  size_t n_sessions = (size_t)atoi(argv[2]); // used when multi-threading
+  size_t max_sessions = (size_t)atoi(argv[2]);
+  size_t min_sessions = MIN_SESSION_WORKERS;
+
+  // --cache sets how many inodes and blocks of tfs are cached (0 to delay
+  // every access)
+  //
+  // with --image, the file system (and so every box) is kept in a file, its
+  // changes logged and made durable in groups of --wal-group changes, or
+  // after --wal-delay microseconds
+  tfs_params params = tfs_default_params();
+  for (int i = 3; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--image") == 0 && i + 1 < argc)
+      params.image_path = argv[++i];
+    else if (strcmp(argv[i], "--wal-group") == 0 && i + 1 < argc)
+      params.wal_group_size = (size_t)atol(argv[++i]);
+    else if (strcmp(argv[i], "--wal-delay") == 0 && i + 1 < argc)
+      params.wal_group_delay_us = (size_t)atol(argv[++i]);
+    else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+      params.cache_size = (size_t)atol(argv[++i]);
+    else if (i == 3)
+      min_sessions = (size_t)atoi(argv[i]);
+    else
+    {
+      printf("usage: mbroker <register_pipe_name> <max_sessions> [min_sessions] [--image <path>] [--wal-group <changes>] [--wal-delay <us>] [--cache <entries>]");
+      return -1;
+    }
+  }
+
+  if (min_sessions > max_sessions)
+    min_sessions = max_sessions;
+
+  // every box keeps its file open, and restoring a box opens one more
+  params.max_open_files_count = params.max_inode_count + 1;
 
   // create the register pipe
   if (mkfifo(register_pipe_name, 0666) == -1)
@@ -737,59 +771,68 @@ int main(int argc, char **argv)
 
   // init tfs
   WARN("Creating file system\n");
-  if (tfs_init(NULL) == -1)
+  if (tfs_init(&params) == -1)
   {
     WARN("Error creating file system");
     return -1;
   };
 
-  if (initServerState() == -1)
+  if (initBoxRegistry() == -1 || restoreBoxes() == -1)
   {
     WARN("Error initializing server state");
     return -1;
   }
 
-  // init n_sessions threads
-  pc_queue_t pcq;
-
-  pcq_create(&pcq, n_sessions + 20);
+  // init the session workers, between min_sessions and max_sessions threads,
+  // and the control lane
+  if (startWorkers(&session_workers, min_sessions, max_sessions, WORKER_QUEUE_CAPACITY, handleRegistration) == -1 ||
+      startWorkers(&control_lane, CONTROL_MIN_WORKERS, CONTROL_MAX_WORKERS, WORKER_QUEUE_CAPACITY, handleRegistration) == -1)
+  {
+    WARN("Error starting worker threads");
+    return -1;
+  }
 
-  for (int i = 0; i < n_sessions; i++)
+  // start the event loops that serve publishers and subscribers
+  if (startEventLoops(EVENT_LOOP_COUNT) == -1)
   {
-    pthread_t thread;
-    pthread_create(&thread, NULL, (void *)thread_function, &pcq);
+    WARN("Error starting event loops");
+    return -1;
   }
 
   // setup signal handler to handle client CTRL-C
   signal(SIGINT, handleSIGINT);
 
-  // receive register messages
-  while (1)
+  // a subscriber closing its pipe must not kill the broker
+  signal(SIGPIPE, SIG_IGN);
+
+  // open the register pipe once for the broker's lifetime, along with a
+  // writer of its own, so that clients closing it never cause an EOF (the
+  // read end is opened non-blocking, since no writer exists yet)
+  int register_fifo = open(register_pipe_name, O_RDONLY | O_NONBLOCK);
+  int register_writer = register_fifo == -1 ? -1 : open(register_pipe_name, O_WRONLY);
+  if (register_writer == -1 || fcntl(register_fifo, F_SETFL, fcntl(register_fifo, F_GETFL) & ~O_NONBLOCK) == -1)
   {
-    if (exit_flag)
-    {
-      break;
-    }
+    WARN("Error opening register pipe");
+    return -1;
+  }
 
-    // open the register pipe
-    int register_fifo = open(register_pipe_name, O_RDONLY);
+  // receive register messages (until CTRL-C interrupts the read)
+  while (!exit_flag)
+    readRegistrations(register_fifo);
 
-    // read from the register pipe
-    char buffer[PROTOCOL_MESSAGE_SIZE];
-    if (read(register_fifo, buffer, PROTOCOL_MESSAGE_SIZE) == -1)
-    {
-      WARN("Error while reading register fifo");
-      return -1;
-    };
-    // enqueue register message
-    pcq_enqueue(&pcq, buffer);
+  close(register_writer);
+  close(register_fifo);
 
-    close(register_fifo);
-  }
+  // free sessions, boxes and file system
+  stopEventLoops();
+  destroyBoxRegistry();
+
+  // how many tfs accesses were (and were not) served by the cache
+  tfs_cache_stats_t cache_stats;
+  tfs_cache_stats(&cache_stats);
+  LOG("tfs cache: %lu hits, %lu misses\n", (unsigned long)cache_stats.hits, (unsigned long)cache_stats.misses);
 
-  // free file system and queue
   tfs_destroy();
-  pcq_destroy(&pcq);
 
   return 0;
 }
\ No newline at end of file
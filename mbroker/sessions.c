@@ -0,0 +1,824 @@
+#include "sessions.h"
+
+#include "logging.h"
+#include "operations.h"
+#include "wire_protocol.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*
+Publisher and subscriber sessions are not bound to a thread: once a worker
+thread has connected a client, the session is handed to one of a small, fixed
+set of event loop threads, each multiplexing the client pipes of its sessions
+with epoll. Client pipes are non-blocking, so a slow client never blocks a
+loop, and an idle session costs no thread at all.
+
+- A publisher session reads messages whenever its pipe is readable and
+  appends them to the box. A publisher can instead push its messages to a
+  shared memory ring, and only write a doorbell to its pipe when the session
+  drained the ring and went to sleep, so a busy publisher does no syscall
+  per message. A session publishes at most RING_DRAIN_BUDGET messages from
+  its ring per turn; one with messages left gets another turn once the loop
+  has served the events ready meanwhile, so that a publisher keeping up with
+  the broker never holds its loop.
+- A subscriber session only holds the number of the next message to deliver.
+  It delivers the new messages from the box ring, where they are already
+  framed, writing as many as fit in PIPE_BUF with a single writev (or from
+  tfs, one at a time, once evicted). Once it has delivered them all, it
+  waits on the box for the next one; the box notifies it when that message
+  is published. When its pipe is full, it waits for the pipe to become
+  writable instead.
+- A client closing its pipe shows up as EOF (publisher) or EPOLLERR
+  (subscriber) and ends the session.
+
+Each loop also has an eventfd, used to hand it new sessions and subscriber
+sessions that were notified of new messages. Notifications are coalesced: the
+eventfd is only written when the loop has nothing pending yet.
+*/
+
+#define MAX_EVENTS 64
+
+// ring messages written to a subscriber pipe at once (within PIPE_BUF)
+#define DELIVERY_BATCH_SIZE 16
+
+// bytes read from a publisher pipe at once (publishers batch their messages
+// in writes of up to PIPE_BUF)
+#define PUBLISHER_INPUT_SIZE (4 * PIPE_BUF)
+
+// publisher messages appended to the box at once
+#define PUBLISH_BATCH_SIZE 64
+
+// messages published from a shared memory ring per turn of the session
+#define RING_DRAIN_BUDGET (16 * PUBLISH_BATCH_SIZE)
+
+// bytes of a box read from tfs at once by a subscriber catching up
+#define CATCH_UP_READ_SIZE (64 * 1024)
+
+// messages received from a publisher, appended to its box at once (straight
+// from their ring entries)
+typedef struct
+{
+  BoxMessage *messages[PUBLISH_BATCH_SIZE];
+  size_t count;
+} PublishBatch;
+
+typedef enum
+{
+  PUBLISHER_SESSION,
+  SUBSCRIBER_SESSION,
+} SessionKind;
+
+typedef struct Session
+{
+  SessionKind kind;
+  int client_fifo;
+  char client_pipe_name[PIPE_NAME_SIZE];
+
+  BoxData *box;
+
+  // publisher: bytes received that do not form a whole message yet
+  char input[PUBLISHER_INPUT_SIZE];
+  size_t input_len;
+
+  // publisher: shared memory ring the messages come through, if any (the
+  // pipe then only carries doorbells)
+  ShmRing *ring;
+  bool draining; // messages left in the ring, in the loop's draining list
+  struct Session *next_draining;
+
+  // subscriber: next message to deliver
+  uint64_t next_message;
+
+  // subscriber: part of the box read from tfs, while catching up on messages
+  // no longer in the box ring
+  char *contents;
+  size_t contents_offset; // offset of the part in the box
+  size_t contents_len;
+  bool waiting_writable;
+
+  // subscriber: waiting for the next message of the box
+  BoxWaiter waiter;
+  bool ready; // notified, in the loop's ready list
+  struct Session *next_ready;
+
+  struct EventLoop *loop;
+  struct Session *next;
+  struct Session *prev;
+} Session;
+
+typedef struct EventLoop
+{
+  pthread_t thread;
+  int epoll_fd;
+  int wake_fd;
+
+  // sessions handed over by other threads, adopted on the next wakeup, and
+  // subscriber sessions notified of new messages
+  pthread_mutex_t pending_lock;
+  Session *incoming;
+  Session *ready;
+
+  // sessions owned by this loop
+  Session *sessions;
+
+  // publisher sessions with messages left in their ring (only used by the
+  // loop's thread)
+  Session *draining;
+} EventLoop;
+
+static EventLoop *loops;
+static size_t loop_count;
+static size_t next_loop; // round-robin assignment of sessions
+static bool stopping;
+
+static void wakeLoop(EventLoop *loop)
+{
+  uint64_t one = 1;
+
+  if (write(loop->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+    WARN("Error waking event loop: %s\n", strerror(errno));
+}
+
+// box notification: the next message a subscriber waits for was published
+static void notifySubscriber(BoxWaiter *waiter)
+{
+  Session *session = (Session *)waiter->data;
+  EventLoop *loop = session->loop;
+
+  pthread_mutex_lock(&loop->pending_lock);
+
+  bool wake = loop->incoming == NULL && loop->ready == NULL;
+  if (!session->ready)
+  {
+    session->ready = true;
+    session->next_ready = loop->ready;
+    loop->ready = session;
+  }
+
+  pthread_mutex_unlock(&loop->pending_lock);
+
+  if (wake)
+    wakeLoop(loop);
+}
+
+static void endSession(EventLoop *loop, Session *session)
+{
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, session->client_fifo, NULL);
+
+  if (close(session->client_fifo) == -1)
+    WARN("Error closing fifo %s\n", session->client_pipe_name);
+
+  // unlink from the loop's sessions
+  if (session->prev != NULL)
+    session->prev->next = session->next;
+  else
+    loop->sessions = session->next;
+  if (session->next != NULL)
+    session->next->prev = session->prev;
+
+  // and from the publishers waiting for another turn
+  if (session->draining)
+  {
+    Session **link = &loop->draining;
+    while (*link != session)
+      link = &(*link)->next_draining;
+    *link = session->next_draining;
+  }
+
+  BoxData *box = session->box;
+
+  if (session->kind == PUBLISHER_SESSION)
+  {
+    // free the box for the next publisher
+    if (pthread_mutex_lock(&box->pcq_publisher_condvar_lock) != 0)
+      WARN("Error lock mutex: %s\n", strerror(errno));
+
+    __atomic_sub_fetch(&box->pubs, 1, __ATOMIC_RELAXED);
+
+    if (pthread_cond_broadcast(&box->pcq_publisher_condvar) != 0)
+      WARN("Error broadcasting mutex: %s\n", strerror(errno));
+
+    if (pthread_mutex_unlock(&box->pcq_publisher_condvar_lock) != 0)
+      WARN("Error unlock mutex: %s\n", strerror(errno));
+  }
+  else
+  {
+    // no notifications after this
+    cancelBoxWait(box, &session->waiter);
+
+    pthread_mutex_lock(&loop->pending_lock);
+    if (session->ready)
+    {
+      Session **link = &loop->ready;
+      while (*link != session)
+        link = &(*link)->next_ready;
+      *link = session->next_ready;
+    }
+    pthread_mutex_unlock(&loop->pending_lock);
+
+    __atomic_sub_fetch(&box->subs, 1, __ATOMIC_RELAXED);
+  }
+
+  if (session->ring != NULL)
+    shmRingClose(session->ring);
+
+  releaseBox(box);
+  free(session->contents);
+  free(session);
+}
+
+// write a batch of messages to the box in tfs, all of them or none (the
+// part of a short write that made it is dropped, so that the box file ends
+// where its index does)
+//
+// Returns 0 if successful, -1 on error; stores where the batch was written
+// in offset
+static int writeBatch(Session *session, PublishBatch *batch, size_t *offset)
+{
+  if (reserveBoxMessages(session->box, batch->count) == -1)
+  {
+    WARN("Error indexing messages for box %s\n", session->box->name);
+    return -1;
+  }
+
+  // messages are kept NUL-terminated in the box, and appended with a single
+  // tfs call, from their ring entries
+  struct iovec texts[PUBLISH_BATCH_SIZE];
+  size_t text_len = 0;
+  for (size_t i = 0; i < batch->count; i++)
+  {
+    texts[i].iov_base = batch->messages[i]->text;
+    texts[i].iov_len = batch->messages[i]->len + 1;
+    text_len += texts[i].iov_len;
+  }
+
+  int fhandle = __atomic_load_n(&session->box->fhandle, __ATOMIC_ACQUIRE);
+  ssize_t bytes_written = tfs_appendv(fhandle, texts, (int)batch->count, offset);
+  if (bytes_written == (ssize_t)text_len)
+    return 0;
+
+  WARN("Error writing to box %s\n", session->box->name);
+  if (bytes_written > 0 && tfs_truncate(fhandle, *offset) == -1)
+    WARN("Error dropping a partial batch from box %s\n", session->box->name);
+  return -1;
+}
+
+// append the messages received from a publisher to its box, with a single
+// tfs write
+static int publishBatch(Session *session, PublishBatch *batch)
+{
+  if (batch->count == 0)
+    return 0;
+
+  size_t offset = 0;
+  int ret = writeBatch(session, batch, &offset);
+
+  // publish the messages only after they are in the box (none of them if the
+  // box is full)
+  if (ret == 0)
+    appendBoxMessages(session->box, batch->messages, batch->count, offset);
+  else
+  {
+    for (size_t i = 0; i < batch->count; i++)
+      releaseBoxMessage(batch->messages[i]);
+  }
+
+  batch->count = 0;
+  return ret;
+}
+
+// add a message from a publisher (up to len bytes of text) to the batch of
+// messages to append to its box
+static int batchMessage(Session *session, PublishBatch *batch, char const *text, size_t len)
+{
+  size_t message_len = strnlen(text, len < MESSAGE_SIZE - 1 ? len : MESSAGE_SIZE - 1);
+
+  if (batch->count == PUBLISH_BATCH_SIZE && publishBatch(session, batch) == -1)
+    return -1;
+
+  // the box ring entry, written to every subscriber pipe from there
+  BoxMessage *message = createBoxMessage(text, message_len);
+  if (message == NULL)
+  {
+    WARN("Error allocating message for box %s\n", session->box->name);
+    return -1;
+  }
+  batch->messages[batch->count++] = message;
+  return 0;
+}
+
+// handle a wire message received from a publisher
+static int appendMessage(Session *session, PublishBatch *batch, WireHeader const *header, char const *payload)
+{
+  // the ring is drained whenever the pipe is readable
+  if (header->op_code == SHM_DOORBELL && session->ring != NULL)
+    return 0;
+
+  if (header->op_code != SEND_MESSAGE || session->ring != NULL)
+  {
+    WARN("Ignoring unexpected message from %s\n", session->client_pipe_name);
+    return 0;
+  }
+
+  return batchMessage(session, batch, payload, header->payload_len);
+}
+
+// publish the messages in a publisher's shared memory ring, at most budget
+// of them
+//
+// Returns 0 once the ring is empty (the session then waits for a doorbell),
+// 1 if messages may be left for the next turn, -1 on error
+static int drainRing(Session *session, PublishBatch *batch, size_t budget)
+{
+  do
+  {
+    char const *text;
+    size_t len;
+    int ret = 0;
+    while (budget > 0 && (ret = shmRingFront(session->ring, &text, &len)) == 1)
+    {
+      int batched = batchMessage(session, batch, text, len);
+      shmRingPop(session->ring, len);
+      budget--;
+
+      if (batched == -1)
+        return -1;
+    }
+
+    if (ret == -1)
+    {
+      WARN("Corrupted shared memory ring from %s\n", session->client_pipe_name);
+      return -1;
+    }
+
+    if (publishBatch(session, batch) == -1)
+      return -1;
+
+    // not asleep: no doorbell comes, the loop gives the session another turn
+    if (budget == 0)
+      return 1;
+  } while (!shmRingSleep(session->ring));
+
+  return 0;
+}
+
+// read everything available from a publisher pipe
+//
+// Returns false if the session is over
+static bool receiveMessages(EventLoop *loop, Session *session)
+{
+  bool open = true;
+  PublishBatch batch = {.count = 0};
+
+  while (open)
+  {
+    ssize_t bytes_read = read(session->client_fifo, session->input + session->input_len, sizeof(session->input) - session->input_len);
+
+    if (bytes_read == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN)
+      {
+        WARN("Error reading fifo %s\n", session->client_pipe_name);
+        open = false;
+      }
+      break;
+    }
+
+    // publisher closed its pipe
+    if (bytes_read == 0)
+    {
+      open = false;
+      break;
+    }
+
+    session->input_len += (size_t)bytes_read;
+
+    // handle every whole wire message received
+    size_t start = 0;
+    while (open)
+    {
+      WireHeader header;
+      void const *payload;
+      ssize_t size = wireDecode(session->input + start, session->input_len - start, &header, &payload);
+
+      if (size == 0)
+        break;
+
+      if (size == -1)
+      {
+        WARN("Malformed message from %s\n", session->client_pipe_name);
+        open = false;
+      }
+      else if (appendMessage(session, &batch, &header, payload) == -1)
+        open = false;
+      else
+        start += (size_t)size;
+    }
+
+    memmove(session->input, session->input + start, session->input_len - start);
+    session->input_len -= start;
+  }
+
+  // everything read, even if the publisher closed its pipe since
+  if (publishBatch(session, &batch) == -1)
+    open = false;
+
+  // also after the publisher closed its pipe: it may have pushed messages
+  // just before (all of them are published then, as the session ends)
+  int drained = session->ring == NULL ? 0 : drainRing(session, &batch, open ? RING_DRAIN_BUDGET : SIZE_MAX);
+  if (drained == -1)
+    open = false;
+  else if (drained == 1 && open && !session->draining)
+  {
+    session->draining = true;
+    session->next_draining = loop->draining;
+    loop->draining = session;
+  }
+
+  return open;
+}
+
+// arm or disarm the wait for a subscriber pipe to become writable
+static void waitWritable(EventLoop *loop, Session *session, bool wait)
+{
+  if (session->waiting_writable == wait)
+    return;
+
+  // EPOLLERR (reader gone) is always reported, even with no events
+  struct epoll_event event = {.events = wait ? EPOLLOUT : 0, .data.ptr = session};
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, session->client_fifo, &event) == -1)
+    WARN("Error updating fifo %s: %s\n", session->client_pipe_name, strerror(errno));
+
+  session->waiting_writable = wait;
+}
+
+// read the part of the box starting at offset into the session (up to
+// CATCH_UP_READ_SIZE bytes, so whole messages fit)
+static int readBox(Session *session, size_t offset)
+{
+  if (session->contents == NULL && (session->contents = (char *)malloc(CATCH_UP_READ_SIZE)) == NULL)
+    return -1;
+
+  size_t size = (size_t)__atomic_load_n(&session->box->size, __ATOMIC_ACQUIRE);
+  size_t len = size - offset < CATCH_UP_READ_SIZE ? size - offset : CATCH_UP_READ_SIZE;
+
+  int fhandle = __atomic_load_n(&session->box->fhandle, __ATOMIC_ACQUIRE);
+  ssize_t bytes_read = tfs_pread(fhandle, session->contents, len, offset);
+
+  if (bytes_read == -1)
+  {
+    WARN("Error reading box: %s\n", session->box->name);
+    return -1;
+  }
+
+  session->contents_offset = offset;
+  session->contents_len = (size_t)bytes_read;
+  return 0;
+}
+
+// write a batch of messages from the box ring to a subscriber pipe at once
+//
+// Returns how many were written, or -1 on error (nothing was written)
+static ssize_t writeMessages(Session *session, BoxMessage **messages, size_t count)
+{
+  struct iovec frames[DELIVERY_BATCH_SIZE];
+  size_t batch_len = 0;
+
+  // the batch fits in PIPE_BUF, so it is written whole or not at all
+  size_t n = 0;
+  while (n < count && batch_len + messages[n]->frame_len <= PIPE_BUF)
+  {
+    frames[n].iov_base = messages[n]->frame;
+    frames[n].iov_len = messages[n]->frame_len;
+    batch_len += messages[n]->frame_len;
+    n++;
+  }
+
+  ssize_t bytes_written;
+  do
+    bytes_written = writev(session->client_fifo, frames, (int)n);
+  while (bytes_written == -1 && errno == EINTR);
+
+  return bytes_written == -1 ? -1 : (ssize_t)n;
+}
+
+// send a subscriber the box messages it has not received yet, then wait for
+// the next one
+//
+// Returns false if the session is over
+static bool deliverMessages(EventLoop *loop, Session *session)
+{
+  uint64_t message_count = boxMessageCount(session->box);
+
+  while (session->next_message < message_count ||
+         !waitBoxMessage(session->box, &session->waiter, session->next_message))
+  {
+    // published while we were not waiting yet
+    if (session->next_message == message_count)
+    {
+      message_count = boxMessageCount(session->box);
+      continue;
+    }
+
+    ssize_t delivered;
+
+    BoxMessage *entries[DELIVERY_BATCH_SIZE];
+    size_t entry_count = acquireBoxMessages(session->box, session->next_message, entries, DELIVERY_BATCH_SIZE);
+    if (entry_count > 0)
+    {
+      // caught up with the ring
+      free(session->contents);
+      session->contents = NULL;
+      session->contents_len = 0;
+
+      delivered = writeMessages(session, entries, entry_count);
+
+      for (size_t i = 0; i < entry_count; i++)
+        releaseBoxMessage(entries[i]);
+    }
+    else
+    {
+      // evicted from the ring: catch up from tfs
+      size_t offset;
+      size_t message_len;
+      if (findBoxMessage(session->box, session->next_message, &offset, &message_len) == -1)
+        return false;
+
+      // the message (with its NUL terminator) must be in the part of the box read
+      bool in_contents = offset >= session->contents_offset &&
+                  offset + message_len < session->contents_offset + session->contents_len;
+      if (!in_contents && readBox(session, offset) == -1)
+        return false;
+
+      if (offset + message_len >= session->contents_offset + session->contents_len)
+      {
+        WARN("Corrupted box: %s\n", session->box->name);
+        return false;
+      }
+
+      // wire messages fit in PIPE_BUF, so they are written whole or not at all
+      char const *message = session->contents + (offset - session->contents_offset);
+      delivered = wireWrite(session->client_fifo, SEND_SUBSCRIBER, 0, message, message_len) == -1 ? -1 : 1;
+    }
+
+    if (delivered == -1)
+    {
+      if (errno == EAGAIN)
+      {
+        // pipe full: resume when the subscriber catches up
+        waitWritable(loop, session, true);
+        return true;
+      }
+
+      // subscriber closed its pipe (EPIPE) or some other error
+      return false;
+    }
+
+    session->next_message += (uint64_t)delivered;
+  }
+
+  waitWritable(loop, session, false);
+  return true;
+}
+
+// take the sessions handed over to the loop
+static void adoptSessions(EventLoop *loop)
+{
+  pthread_mutex_lock(&loop->pending_lock);
+  Session *session = loop->incoming;
+  loop->incoming = NULL;
+  pthread_mutex_unlock(&loop->pending_lock);
+
+  while (session != NULL)
+  {
+    Session *next = session->next;
+
+    session->prev = NULL;
+    session->next = loop->sessions;
+    if (loop->sessions != NULL)
+      loop->sessions->prev = session;
+    loop->sessions = session;
+
+    struct epoll_event event = {
+        .events = session->kind == PUBLISHER_SESSION ? EPOLLIN : 0,
+        .data.ptr = session,
+    };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, session->client_fifo, &event) == -1)
+    {
+      WARN("Error watching fifo %s: %s\n", session->client_pipe_name, strerror(errno));
+      endSession(loop, session);
+    }
+    // new subscribers start with the messages already in the box
+    else if (session->kind == SUBSCRIBER_SESSION && !deliverMessages(loop, session))
+      endSession(loop, session);
+
+    session = next;
+  }
+}
+
+// deliver the new messages to the subscribers notified by their boxes
+static void deliverReady(EventLoop *loop)
+{
+  pthread_mutex_lock(&loop->pending_lock);
+  Session *session = loop->ready;
+  loop->ready = NULL;
+  for (Session *ready = session; ready != NULL; ready = ready->next_ready)
+    ready->ready = false;
+  pthread_mutex_unlock(&loop->pending_lock);
+
+  while (session != NULL)
+  {
+    Session *next = session->next_ready;
+
+    if (!deliverMessages(loop, session))
+      endSession(loop, session);
+
+    session = next;
+  }
+}
+
+// give the publishers with messages left in their ring another turn
+static void drainPending(EventLoop *loop)
+{
+  Session *session = loop->draining;
+  loop->draining = NULL;
+  for (Session *pending = session; pending != NULL; pending = pending->next_draining)
+    pending->draining = false;
+
+  while (session != NULL)
+  {
+    Session *next = session->next_draining;
+
+    if (!receiveMessages(loop, session))
+      endSession(loop, session);
+
+    session = next;
+  }
+}
+
+static void *eventLoop(void *arg)
+{
+  EventLoop *loop = (EventLoop *)arg;
+  struct epoll_event events[MAX_EVENTS];
+
+  while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+  {
+    // with publishers waiting for another turn, only check for events
+    int n_events = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, loop->draining != NULL ? 0 : -1);
+    if (n_events == -1)
+    {
+      if (errno != EINTR)
+        WARN("Error waiting for events: %s\n", strerror(errno));
+      continue;
+    }
+
+    bool woken = false;
+    for (int i = 0; i < n_events; i++)
+    {
+      Session *session = (Session *)events[i].data.ptr;
+
+      // wakeup: new sessions and/or subscribers notified of new messages,
+      // handled once the batch is done (sessions ended while delivering may
+      // still have events further in it)
+      if (session == NULL)
+      {
+        woken = true;
+        continue;
+      }
+
+      bool open;
+      if (session->kind == PUBLISHER_SESSION)
+        open = receiveMessages(loop, session);
+      else if (events[i].events & (EPOLLERR | EPOLLHUP))
+        open = false;
+      else
+        open = deliverMessages(loop, session);
+
+      if (!open)
+        endSession(loop, session);
+    }
+
+    if (woken)
+    {
+      uint64_t count;
+      if (read(loop->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        WARN("Error reading eventfd: %s\n", strerror(errno));
+
+      adoptSessions(loop);
+      deliverReady(loop);
+    }
+
+    drainPending(loop);
+  }
+
+  // close the sessions still open
+  adoptSessions(loop);
+  while (loop->sessions != NULL)
+    endSession(loop, loop->sessions);
+
+  return NULL;
+}
+
+int startEventLoops(size_t count)
+{
+  loops = (EventLoop *)calloc(count, sizeof(EventLoop));
+  if (loops == NULL)
+    return -1;
+
+  for (size_t i = 0; i < count; i++)
+  {
+    EventLoop *loop = &loops[i];
+
+    loop->epoll_fd = epoll_create1(0);
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (loop->epoll_fd == -1 || loop->wake_fd == -1)
+      return -1;
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &event) == -1)
+      return -1;
+
+    if (pthread_mutex_init(&loop->pending_lock, NULL) != 0)
+      return -1;
+
+    if (pthread_create(&loop->thread, NULL, eventLoop, loop) != 0)
+      return -1;
+
+    loop_count++;
+  }
+
+  return 0;
+}
+
+void stopEventLoops(void)
+{
+  __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+  for (size_t i = 0; i < loop_count; i++)
+    wakeLoop(&loops[i]);
+
+  for (size_t i = 0; i < loop_count; i++)
+  {
+    pthread_join(loops[i].thread, NULL);
+    close(loops[i].epoll_fd);
+    close(loops[i].wake_fd);
+    pthread_mutex_destroy(&loops[i].pending_lock);
+  }
+
+  free(loops);
+  loops = NULL;
+  loop_count = 0;
+}
+
+static int startSession(SessionKind kind, BoxData *box, int client_fifo, char const *client_pipe_name, ShmRing *ring)
+{
+  if (fcntl(client_fifo, F_SETFL, fcntl(client_fifo, F_GETFL) | O_NONBLOCK) == -1)
+  {
+    WARN("Error setting fifo %s non-blocking\n", client_pipe_name);
+    return -1;
+  }
+
+  Session *session = (Session *)calloc(1, sizeof(Session));
+  if (session == NULL)
+    return -1;
+
+  session->kind = kind;
+  session->client_fifo = client_fifo;
+  session->ring = ring;
+  strncpy(session->client_pipe_name, client_pipe_name, PIPE_NAME_SIZE - 1);
+  session->box = box;
+
+  session->waiter.notify = notifySubscriber;
+  session->waiter.data = session;
+
+  // hand the session to the next loop
+  EventLoop *loop = &loops[__atomic_fetch_add(&next_loop, 1, __ATOMIC_RELAXED) % loop_count];
+  session->loop = loop;
+
+  pthread_mutex_lock(&loop->pending_lock);
+  session->next = loop->incoming;
+  loop->incoming = session;
+  pthread_mutex_unlock(&loop->pending_lock);
+
+  wakeLoop(loop);
+  return 0;
+}
+
+int startPublisherSession(BoxData *box, int client_fifo, char const *client_pipe_name, ShmRing *ring)
+{
+  return startSession(PUBLISHER_SESSION, box, client_fifo, client_pipe_name, ring);
+}
+
+int startSubscriberSession(BoxData *box, int client_fifo, char const *client_pipe_name)
+{
+  return startSession(SUBSCRIBER_SESSION, box, client_fifo, client_pipe_name, NULL);
+}
@@ -0,0 +1,39 @@
+#ifndef __MBROKER_SESSIONS_H__
+#define __MBROKER_SESSIONS_H__
+
+#include "boxes.h"
+#include "shm_ring.h"
+
+#include <stddef.h>
+
+// number of threads multiplexing publisher and subscriber sessions
+#define EVENT_LOOP_COUNT 4
+
+// startEventLoops: launch the threads that multiplex publisher and subscriber
+// sessions
+//
+// Returns 0 if successful, -1 otherwise
+int startEventLoops(size_t loop_count);
+
+// stopEventLoops: stop (and join) the event loop threads
+void stopEventLoops(void);
+
+// startPublisherSession: hand a connected publisher to an event loop
+//
+// client_fifo is the read end of the client pipe; the session takes ownership
+// of it, of ring (the publisher's shared memory ring, NULL if it sends its
+// messages through the pipe) and of the caller's reference to box (and of the
+// box publisher slot)
+//
+// Returns 0 if successful, -1 otherwise (in which case nothing is taken)
+int startPublisherSession(BoxData *box, int client_fifo, char const *client_pipe_name, ShmRing *ring);
+
+// startSubscriberSession: hand a connected subscriber to an event loop
+//
+// client_fifo is the write end of the client pipe; the session takes
+// ownership of it and of the caller's reference to box
+//
+// Returns 0 if successful, -1 otherwise (in which case nothing is taken)
+int startSubscriberSession(BoxData *box, int client_fifo, char const *client_pipe_name);
+
+#endif // __MBROKER_SESSIONS_H__
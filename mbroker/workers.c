@@ -0,0 +1,250 @@
+#include "workers.h"
+
+#include "logging.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+Register messages are handled by pools of worker threads. Instead of a single
+queue shared by every worker, each worker owns a queue, so that the threads
+submitting and taking work are spread over many queues rather than all
+contending on one.
+
+- Work is spread round-robin over the running workers' queues; when a queue
+  is full, the next one is tried.
+- A worker takes work from its own queue first. When it is empty, it steals
+  from the other worker slots (running or not), starting with the next one,
+  so that work queued behind a worker blocked on a slow client is still
+  handled.
+- A worker with nothing to do, nor to steal, sleeps until new work is
+  submitted. Workers take one unit of work at a time, so that everything
+  queued stays available to thieves.
+
+The pool is elastic: when work is submitted and there are not enough idle
+workers to take it, the submitter starts new workers, up to the pool maximum.
+A worker that stays idle for WORKER_IDLE_TIMEOUT seconds exits, down to the
+pool minimum. Only the submitter starts workers, so it alone reuses slots.
+*/
+
+// take work from the worker's own queue or, failing that, from another slot
+static void *findWork(Worker *worker)
+{
+  WorkerPool *pool = worker->pool;
+  void *work = pcq_try_dequeue(&worker->queue);
+
+  for (size_t i = 1; work == NULL && i < pool->max_workers; i++)
+    work = pcq_try_dequeue(&pool->workers[(worker->index + i) % pool->max_workers].queue);
+
+  if (work != NULL)
+    __atomic_sub_fetch(&pool->queued_work, 1, __ATOMIC_RELAXED);
+
+  return work;
+}
+
+// leave the pool, unless it is already at its minimum
+static bool retireWorker(WorkerPool *pool)
+{
+  size_t running = __atomic_load_n(&pool->running_workers, __ATOMIC_RELAXED);
+  while (running > pool->min_workers)
+  {
+    if (__atomic_compare_exchange_n(&pool->running_workers, &running, running - 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return true;
+  }
+
+  return false;
+}
+
+// wait until some work can be found, the worker being counted idle
+//
+// Returns NULL if the worker should exit instead
+static void *awaitWork(Worker *worker)
+{
+  WorkerPool *pool = worker->pool;
+
+  // work submitted before the worker was counted idle is found by the scan,
+  // work submitted after it bumps the epoch
+  size_t epoch = __atomic_load_n(&pool->work_epoch, __ATOMIC_ACQUIRE);
+
+  void *work;
+  while ((work = findWork(worker)) == NULL)
+  {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += WORKER_IDLE_TIMEOUT;
+
+    pthread_mutex_lock(&pool->idle_lock);
+
+    int ret = 0;
+    while (ret != ETIMEDOUT && pool->work_epoch == epoch)
+      ret = pthread_cond_timedwait(&pool->idle_condvar, &pool->idle_lock, &deadline);
+
+    // no work was submitted for a whole timeout
+    if (pool->work_epoch == epoch && retireWorker(pool))
+    {
+      __atomic_sub_fetch(&pool->idle_workers, 1, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock(&pool->idle_lock);
+      return NULL;
+    }
+
+    epoch = pool->work_epoch;
+    pthread_mutex_unlock(&pool->idle_lock);
+  }
+
+  __atomic_sub_fetch(&pool->idle_workers, 1, __ATOMIC_SEQ_CST);
+  return work;
+}
+
+static void *workerThread(void *arg)
+{
+  Worker *worker = (Worker *)arg;
+  WorkerPool *pool = worker->pool;
+
+  // started counted idle
+  void *work;
+  while ((work = awaitWork(worker)) != NULL)
+  {
+    pool->handler(work);
+    __atomic_add_fetch(&pool->idle_workers, 1, __ATOMIC_SEQ_CST);
+  }
+
+  // the slot may be reused by the submitter from here on (anything left in
+  // its queue is stolen)
+  __atomic_store_n(&worker->running, false, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// start a worker in a free slot (submitter only)
+static int startWorker(WorkerPool *pool)
+{
+  Worker *worker = NULL;
+  for (size_t i = 0; i < pool->max_workers && worker == NULL; i++)
+  {
+    if (!__atomic_load_n(&pool->workers[i].running, __ATOMIC_ACQUIRE))
+      worker = &pool->workers[i];
+  }
+
+  if (worker == NULL)
+    return -1;
+
+  worker->running = true;
+  __atomic_add_fetch(&pool->running_workers, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&pool->idle_workers, 1, __ATOMIC_SEQ_CST);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  pthread_t thread;
+  int ret = pthread_create(&thread, &attr, workerThread, worker);
+  pthread_attr_destroy(&attr);
+
+  if (ret != 0)
+  {
+    WARN("Error creating worker thread: %s\n", strerror(ret));
+    __atomic_sub_fetch(&pool->idle_workers, 1, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&pool->running_workers, 1, __ATOMIC_RELAXED);
+    worker->running = false;
+    return -1;
+  }
+
+  return 0;
+}
+
+// wake up to count idle workers, and start new ones for the queued work no
+// idle worker is left for
+static void wakeWorkers(WorkerPool *pool, size_t count)
+{
+  // pairs with the increment of idle_workers: either the worker finds the
+  // work, or it is seen idle here
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  size_t idle = __atomic_load_n(&pool->idle_workers, __ATOMIC_SEQ_CST);
+
+  if (idle > 0)
+  {
+    pthread_mutex_lock(&pool->idle_lock);
+    __atomic_store_n(&pool->work_epoch, pool->work_epoch + 1, __ATOMIC_RELEASE);
+    if (count == 1)
+      pthread_cond_signal(&pool->idle_condvar);
+    else
+      pthread_cond_broadcast(&pool->idle_condvar);
+    pthread_mutex_unlock(&pool->idle_lock);
+  }
+
+  size_t queued = __atomic_load_n(&pool->queued_work, __ATOMIC_RELAXED);
+  while (queued > idle && __atomic_load_n(&pool->running_workers, __ATOMIC_RELAXED) < pool->max_workers)
+  {
+    if (startWorker(pool) == -1)
+      break;
+    idle++;
+  }
+}
+
+int startWorkers(WorkerPool *pool, size_t min_workers, size_t max_workers, size_t capacity, WorkHandler handler)
+{
+  if (min_workers == 0 || min_workers > max_workers)
+    return -1;
+
+  memset(pool, 0, sizeof(WorkerPool));
+  pool->handler = handler;
+  pool->min_workers = min_workers;
+  pool->max_workers = max_workers;
+
+  if (pthread_mutex_init(&pool->idle_lock, NULL) != 0 || pthread_cond_init(&pool->idle_condvar, NULL) != 0)
+    return -1;
+
+  pool->workers = (Worker *)calloc(max_workers, sizeof(Worker));
+  if (pool->workers == NULL)
+    return -1;
+
+  // all queues exist before any worker steals from them
+  for (size_t i = 0; i < max_workers; i++)
+  {
+    pool->workers[i].pool = pool;
+    pool->workers[i].index = i;
+    if (pcq_create(&pool->workers[i].queue, capacity) == -1)
+      return -1;
+  }
+
+  for (size_t i = 0; i < min_workers; i++)
+  {
+    if (startWorker(pool) == -1)
+      return -1;
+  }
+
+  return 0;
+}
+
+void submitWork(WorkerPool *pool, void **work, size_t count, size_t priority)
+{
+  __atomic_add_fetch(&pool->queued_work, count, __ATOMIC_RELAXED);
+
+  for (size_t i = 0; i < count; i++)
+  {
+    // next running worker queue with space
+    size_t tries = 0;
+    while (tries < pool->max_workers)
+    {
+      Worker *worker = &pool->workers[pool->next_worker];
+      if (__atomic_load_n(&worker->running, __ATOMIC_RELAXED) && pcq_try_enqueue(&worker->queue, work[i], priority) == 0)
+        break;
+
+      pool->next_worker = (pool->next_worker + 1) % pool->max_workers;
+      tries++;
+    }
+
+    if (tries == pool->max_workers)
+    {
+      // every queue is full: let the workers drain the work already
+      // submitted, then wait for space
+      wakeWorkers(pool, pool->max_workers);
+      pcq_enqueue_priority(&pool->workers[pool->next_worker].queue, work[i], priority);
+    }
+
+    pool->next_worker = (pool->next_worker + 1) % pool->max_workers;
+  }
+
+  wakeWorkers(pool, count);
+}
@@ -0,0 +1,61 @@
+#ifndef __MBROKER_WORKERS_H__
+#define __MBROKER_WORKERS_H__
+
+#include "producer-consumer.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// seconds a worker above the pool minimum stays idle before it exits
+#define WORKER_IDLE_TIMEOUT 5
+
+// handles one unit of work submitted to the workers
+typedef void (*WorkHandler)(void *work);
+
+typedef struct
+{
+  struct WorkerPool *pool;
+  size_t index;
+  bool running; // has a thread (set by the submitter, cleared by the thread)
+  pc_queue_t queue;
+} Worker;
+
+typedef struct WorkerPool
+{
+  WorkHandler handler;
+
+  // max_workers worker slots, min_workers to max_workers of them running
+  Worker *workers;
+  size_t min_workers;
+  size_t max_workers;
+  size_t running_workers;
+  size_t next_worker; // round-robin assignment of work (submitter only)
+
+  size_t queued_work; // submitted, not yet taken
+
+  // idle workers sleep here until work is submitted
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle_condvar;
+  size_t idle_workers;
+  size_t work_epoch; // bumped, under idle_lock, on every wakeup
+} WorkerPool;
+
+// startWorkers: launch a pool of min_workers to max_workers worker threads,
+// each with its own queue holding up to capacity units of work per priority
+// class
+//
+// The pool grows when work is submitted and no worker is idle, and shrinks
+// back to min_workers as workers stay idle
+//
+// Returns 0 if successful, -1 otherwise
+int startWorkers(WorkerPool *pool, size_t min_workers, size_t max_workers, size_t capacity, WorkHandler handler);
+
+// submitWork: hand count units of work of the given priority class to the
+// workers, spreading them round-robin over the running workers' queues
+//
+// Must always be called from the same thread. If every worker queue is full,
+// sleep until one has space
+void submitWork(WorkerPool *pool, void **work, size_t count, size_t priority);
+
+#endif // __MBROKER_WORKERS_H__
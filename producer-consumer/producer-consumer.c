@@ -1,58 +1,216 @@
 #include "producer-consumer.h"
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include "wire_protocol.h"
 /*
-pc_queue_t is treated as a circular buffer.
+pc_queue_t is made of one lock-free bounded ring per priority class, so
+enqueueing with a priority costs the same as without one. Dequeues take from
+the highest class that has elements, except that one in every aging interval
+dequeues starts from a lower class (each lower class in turn), so a busy
+higher class delays lower ones but never starves them.
+
+Each ring slot carries a sequence number telling whose turn it is:
+- seq == pos: free, for the producer that claims position pos;
+- seq == pos + 1: full, for the consumer that claims position pos;
+and positions are claimed by a compare-and-swap on head (producers) or tail
+(consumers), so no lock is taken while the queue is neither full nor empty.
+
+The capacity bounds the queue as a whole: a producer first reserves a spot
+in the queue size (also with a compare-and-swap), which consumers give back
+once they took their element out of its ring. Every ring can hold the whole
+capacity, so a producer with a reserved spot always finds one in its ring
+(at most waiting for a consumer to finish taking an element out of it).
+
+Only a producer finding the queue full (or a consumer finding it empty)
+takes the wait lock and sleeps. It registers itself as waiting before trying
+one last time, and the other side checks for waiters after each operation,
+both with sequentially consistent fences, so no wakeup is lost.
+*/
 
-This means that we keep track of the head and tail of the array, and we can
-use the modulo operator to wrap around the array.
+static int ring_create(pcq_ring_t *ring, size_t capacity)
+{
+  ring->slots = (pcq_slot_t *)malloc(capacity * sizeof(pcq_slot_t));
 
-This allows for O(1) enqueue and dequeue operations.
-*/
+  if (ring->slots == NULL)
+    return -1;
+
+  // every slot starts free for the first lap
+  for (size_t i = 0; i < capacity; i++)
+  {
+    ring->slots[i].seq = i;
+    ring->slots[i].elem = NULL;
+  }
+
+  ring->capacity = capacity;
+  ring->head = 0;
+  ring->tail = 0;
+
+  return 0;
+}
 
-int has_priority(void *element)
+// returns 0 if successful, -1 if the ring is full
+static int ring_push(pcq_ring_t *ring, void *elem)
 {
-  char *str = (char *)element;
+  size_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
 
-  // str[0] to int
-  int priority = str[0] - '0';
+  while (1)
+  {
+    pcq_slot_t *slot = &ring->slots[pos % ring->capacity];
+    size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
 
-  return priority == REGISTER_PUBLISHER;
+    if (seq == pos)
+    {
+      // slot free: claim the position (on failure, pos is reloaded)
+      if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      {
+        slot->elem = elem;
+        __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+        return 0;
+      }
+    }
+    else if (seq < pos)
+      // slot not consumed since the previous lap
+      return -1;
+    else
+      // another producer got here first
+      pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  }
 }
 
-int pcq_create(pc_queue_t *queue, size_t capacity)
+// returns the element, or NULL if the ring is empty
+static void *ring_pop(pcq_ring_t *ring)
 {
-  if (queue == NULL)
+  size_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+  while (1)
   {
-    return -1;
+    pcq_slot_t *slot = &ring->slots[pos % ring->capacity];
+    size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+    if (seq == pos + 1)
+    {
+      // slot full: claim the position (on failure, pos is reloaded)
+      if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      {
+        void *elem = slot->elem;
+        // free for the producer of the next lap
+        __atomic_store_n(&slot->seq, pos + ring->capacity, __ATOMIC_RELEASE);
+        return elem;
+      }
+    }
+    else if (seq < pos + 1)
+      // nothing produced here yet
+      return NULL;
+    else
+      // another consumer got here first
+      pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
   }
+}
 
-  // Allocate memory for the buffer
-  queue->pcq_buffer = (void **)malloc(capacity * sizeof(char *));
+// returns 0 if a spot in the queue was reserved, -1 if the queue is full
+static int queue_reserve(pc_queue_t *queue)
+{
+  size_t size = __atomic_load_n(&queue->pcq_size, __ATOMIC_RELAXED);
 
-  if (queue->pcq_buffer == NULL)
+  do
   {
-    return -1;
+    if (size >= queue->pcq_capacity)
+      return -1;
+  } while (!__atomic_compare_exchange_n(&queue->pcq_size, &size, size + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  return 0;
+}
+
+// push elem into the spot reserved for it
+static void queue_push(pc_queue_t *queue, size_t priority, void *elem)
+{
+  // the ring only looks full while a consumer is still taking an element
+  // out of the slot, which it is about to free
+  while (ring_push(&queue->pcq_rings[priority], elem) != 0)
+    ;
+}
+
+static void *queue_pop(pc_queue_t *queue, size_t first)
+{
+  // first class to look at, then all of them from the highest
+  void *elem = ring_pop(&queue->pcq_rings[first]);
+
+  for (size_t priority = 0; elem == NULL && priority < PCQ_PRIORITIES; priority++)
+  {
+    if (priority != first)
+      elem = ring_pop(&queue->pcq_rings[priority]);
   }
 
-  // initialize the queue for circular buffer
-  queue->pcq_capacity = capacity;
-  queue->pcq_current_size = 0;
+  // give the spot back, now that the slot is free
+  if (elem != NULL)
+    __atomic_sub_fetch(&queue->pcq_size, 1, __ATOMIC_RELAXED);
+
+  return elem;
+}
+
+// class a dequeue should look at first
+static size_t first_priority(pc_queue_t *queue)
+{
+  size_t interval = __atomic_load_n(&queue->pcq_aging_interval, __ATOMIC_RELAXED);
+  if (interval == 0 || PCQ_PRIORITIES == 1)
+    return 0;
 
-  queue->pcq_head = 0;
-  queue->pcq_tail = 0;
+  size_t n = __atomic_fetch_add(&queue->pcq_dequeues, 1, __ATOMIC_RELAXED);
+  if (n % interval != interval - 1)
+    return 0;
 
-  // Initialize the mutex and condition variables
-  if (pthread_mutex_init(&queue->pcq_current_size_lock, NULL) != 0)
-    return -1;
-  if (pthread_mutex_init(&queue->pcq_head_lock, NULL) != 0)
+  // each lower class in turn
+  return 1 + (n / interval) % (PCQ_PRIORITIES - 1);
+}
+
+// wake the threads sleeping on condvar, if any
+static int wake_waiters(pc_queue_t *queue, size_t *waiting, pthread_cond_t *condvar)
+{
+  // pairs with the fence in the waiting thread
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(waiting, __ATOMIC_RELAXED) == 0)
+    return 0;
+
+  if (pthread_mutex_lock(&queue->pcq_wait_lock) != 0)
     return -1;
-  if (pthread_mutex_init(&queue->pcq_tail_lock, NULL) != 0)
+
+  // waiters may be waiting on different rings, so wake them all
+  pthread_cond_broadcast(condvar);
+
+  if (pthread_mutex_unlock(&queue->pcq_wait_lock) != 0)
     return -1;
-  if (pthread_mutex_init(&queue->pcq_pusher_condvar_lock, NULL) != 0)
+
+  return 0;
+}
+
+int pcq_create(pc_queue_t *queue, size_t capacity)
+{
+  if (queue == NULL || capacity == 0)
+  {
     return -1;
-  if (pthread_mutex_init(&queue->pcq_popper_condvar_lock, NULL) != 0)
+  }
+
+  // each ring can hold the whole capacity, which bounds them together
+  for (size_t priority = 0; priority < PCQ_PRIORITIES; priority++)
+  {
+    if (ring_create(&queue->pcq_rings[priority], capacity) != 0)
+    {
+      while (priority-- > 0)
+        free(queue->pcq_rings[priority].slots);
+      return -1;
+    }
+  }
+
+  queue->pcq_capacity = capacity;
+  queue->pcq_size = 0;
+  queue->pcq_aging_interval = PCQ_AGING_INTERVAL;
+  queue->pcq_dequeues = 0;
+  queue->pcq_waiting_pushers = 0;
+  queue->pcq_waiting_poppers = 0;
+
+  // Initialize the mutex and condition variables
+  if (pthread_mutex_init(&queue->pcq_wait_lock, NULL) != 0)
     return -1;
   if (pthread_cond_init(&queue->pcq_pusher_condvar, NULL) != 0)
     return -1;
@@ -69,19 +227,12 @@ int pcq_destroy(pc_queue_t *queue)
     return -1;
   }
 
-  // Free the buffer
-  free(queue->pcq_buffer);
+  // Free the rings
+  for (size_t priority = 0; priority < PCQ_PRIORITIES; priority++)
+    free(queue->pcq_rings[priority].slots);
 
   // Destroy the mutex and condition variables
-  if (pthread_mutex_destroy(&queue->pcq_current_size_lock) != 0)
-    return -1;
-  if (pthread_mutex_destroy(&queue->pcq_head_lock) != 0)
-    return -1;
-  if (pthread_mutex_destroy(&queue->pcq_tail_lock) != 0)
-    return -1;
-  if (pthread_mutex_destroy(&queue->pcq_pusher_condvar_lock) != 0)
-    return -1;
-  if (pthread_mutex_destroy(&queue->pcq_popper_condvar_lock) != 0)
+  if (pthread_mutex_destroy(&queue->pcq_wait_lock) != 0)
     return -1;
   if (pthread_cond_destroy(&queue->pcq_pusher_condvar) != 0)
     return -1;
@@ -91,153 +242,201 @@ int pcq_destroy(pc_queue_t *queue)
   return 0;
 }
 
-int pcq_enqueue(pc_queue_t *queue, void *elem)
+void pcq_set_aging(pc_queue_t *queue, size_t interval)
 {
-  if (queue == NULL)
-  {
-    return -1;
-  }
-  
-  // Lock the mutex
-  if (pthread_mutex_lock(&queue->pcq_popper_condvar_lock) != 0)
+  __atomic_store_n(&queue->pcq_aging_interval, interval, __ATOMIC_RELAXED);
+}
+
+// reserve a spot in the queue, sleeping while it is full (until abstime, if
+// not NULL)
+static int reserve_slow(pc_queue_t *queue, struct timespec const *abstime)
+{
+  if (pthread_mutex_lock(&queue->pcq_wait_lock) != 0)
     return -1;
 
-  // Wait until the queue has an open spot
-  // queue only has open spot if "pop" action happens
-  while (queue->pcq_current_size == queue->pcq_capacity)
+  __atomic_add_fetch(&queue->pcq_waiting_pushers, 1, __ATOMIC_RELAXED);
+
+  // try again now that poppers will see us waiting
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  int ret = 0;
+  while (queue_reserve(queue) != 0)
   {
-    // wait for pusher condvar to be changed
-    if (pthread_cond_wait(&queue->pcq_popper_condvar, &queue->pcq_popper_condvar_lock) != 0)
-      return -1;
+    if (abstime == NULL)
+      ret = pthread_cond_wait(&queue->pcq_pusher_condvar, &queue->pcq_wait_lock);
+    else
+      ret = pthread_cond_timedwait(&queue->pcq_pusher_condvar, &queue->pcq_wait_lock, abstime);
+
+    // timed out or failed
+    if (ret != 0)
+      break;
   }
 
-  // Lock the current_size mutex
-  if (pthread_mutex_lock(&queue->pcq_current_size_lock) != 0)
-    return -1;
+  __atomic_sub_fetch(&queue->pcq_waiting_pushers, 1, __ATOMIC_RELAXED);
 
-  // Lock the head mutex
-  if (pthread_mutex_lock(&queue->pcq_head_lock) != 0)
+  if (pthread_mutex_unlock(&queue->pcq_wait_lock) != 0)
     return -1;
 
-  // Lock the tail mutex
-  if (pthread_mutex_lock(&queue->pcq_tail_lock) != 0)
-    return -1;
+  return ret == 0 ? 0 : -1;
+}
 
-  // Add the element to the queue
-  queue->pcq_buffer[queue->pcq_head] = elem;
+// pop an element, sleeping while the queue is empty (until abstime, if not
+// NULL)
+static void *pop_slow(pc_queue_t *queue, size_t first, struct timespec const *abstime)
+{
+  if (pthread_mutex_lock(&queue->pcq_wait_lock) != 0)
+    return NULL;
 
-  if (has_priority(elem))
-  {
-    size_t i = queue->pcq_head;
+  __atomic_add_fetch(&queue->pcq_waiting_poppers, 1, __ATOMIC_RELAXED);
 
-    while (i != queue->pcq_tail)
-    {
-      
-      size_t next = (i + 1) % queue->pcq_capacity;
-      
-      if(!has_priority(queue->pcq_buffer[next])) {
-        // swap
-        void *temp = queue->pcq_buffer[i];
-        queue->pcq_buffer[i] = queue->pcq_buffer[next];
-        queue->pcq_buffer[next] = temp;
-      }
-      else {
-        break;
-      }
+  // try again now that pushers will see us waiting
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
 
-      i = next;
-    }
+  void *elem;
+  while ((elem = queue_pop(queue, first)) == NULL)
+  {
+    int ret;
+    if (abstime == NULL)
+      ret = pthread_cond_wait(&queue->pcq_popper_condvar, &queue->pcq_wait_lock);
+    else
+      ret = pthread_cond_timedwait(&queue->pcq_popper_condvar, &queue->pcq_wait_lock, abstime);
+
+    // timed out or failed
+    if (ret != 0)
+      break;
   }
 
-  // Update head value
-  if (queue->pcq_head == 0)
-    queue->pcq_head = queue->pcq_capacity - 1;
-  else
-    queue->pcq_head--;
+  __atomic_sub_fetch(&queue->pcq_waiting_poppers, 1, __ATOMIC_RELAXED);
 
-  // Increase the current size
-  queue->pcq_current_size++;
+  pthread_mutex_unlock(&queue->pcq_wait_lock);
+  return elem;
+}
 
-  if (pthread_mutex_unlock(&queue->pcq_tail_lock) != 0)
+static int enqueue(pc_queue_t *queue, void *elem, size_t priority, bool block, struct timespec const *abstime)
+{
+  if (queue == NULL || priority >= PCQ_PRIORITIES)
+  {
     return -1;
+  }
 
-  // Unlock the tail mutex
-  if (pthread_mutex_unlock(&queue->pcq_head_lock) != 0)
-    return -1;
+  // fast path: the queue has an open spot
+  if (queue_reserve(queue) != 0)
+  {
+    // slow path: sleep until a "pop" action opens a spot
+    if (!block || reserve_slow(queue, abstime) != 0)
+      return -1;
+  }
 
-  // Unlock the current_size mutex
-  if (pthread_mutex_unlock(&queue->pcq_current_size_lock) != 0)
-    return -1;
+  queue_push(queue, priority, elem);
 
-  // Unlock
-  if (pthread_mutex_unlock(&queue->pcq_popper_condvar_lock) != 0)
-    return -1;
+  // signal popper cond var
+  return wake_waiters(queue, &queue->pcq_waiting_poppers, &queue->pcq_popper_condvar);
+}
+
+static void *dequeue(pc_queue_t *queue, bool block, struct timespec const *abstime)
+{
+  if (queue == NULL)
+  {
+    return NULL;
+  }
+
+  size_t first = first_priority(queue);
+
+  // fast path: the queue has an element
+  void *elem = queue_pop(queue, first);
+
+  // slow path: sleep until a "push" action adds an element
+  if (elem == NULL && block)
+    elem = pop_slow(queue, first, abstime);
 
   // signal pusher cond var
-  if (pthread_cond_signal(&queue->pcq_pusher_condvar) != 0)
-    return -1;
+  if (elem != NULL)
+    wake_waiters(queue, &queue->pcq_waiting_pushers, &queue->pcq_pusher_condvar);
 
-  printf("Added to queue: %s\n", (char *)elem);
+  return elem;
+}
 
-  return 0;
+int pcq_enqueue(pc_queue_t *queue, void *elem)
+{
+  return enqueue(queue, elem, PCQ_PRIORITIES - 1, true, NULL);
 }
 
-void *pcq_dequeue(pc_queue_t *queue)
+int pcq_enqueue_priority(pc_queue_t *queue, void *elem, size_t priority)
 {
-  if (queue == NULL)
+  return enqueue(queue, elem, priority, true, NULL);
+}
+
+int pcq_try_enqueue(pc_queue_t *queue, void *elem, size_t priority)
+{
+  return enqueue(queue, elem, priority, false, NULL);
+}
+
+int pcq_timed_enqueue(pc_queue_t *queue, void *elem, size_t priority, struct timespec const *abstime)
+{
+  return enqueue(queue, elem, priority, true, abstime);
+}
+
+int pcq_enqueue_batch(pc_queue_t *queue, void **elems, size_t count, size_t priority)
+{
+  if (queue == NULL || priority >= PCQ_PRIORITIES)
   {
-    return NULL;
+    return -1;
   }
 
-  // Lock the mutex
-  if (pthread_mutex_lock(&queue->pcq_pusher_condvar_lock) != 0)
-    return NULL;
-
-  // Wait until the queue has an open spot
-  // queue only has open spot if "pop" action happens
-  while (queue->pcq_current_size == 0)
+  for (size_t i = 0; i < count; i++)
   {
-    // wait for pusher condvar to be changed
-    if (pthread_cond_wait(&queue->pcq_pusher_condvar, &queue->pcq_pusher_condvar_lock) != 0)
-      return NULL;
+    // the queue is full: let poppers drain what was pushed before sleeping
+    if (queue_reserve(queue) != 0 &&
+        (wake_waiters(queue, &queue->pcq_waiting_poppers, &queue->pcq_popper_condvar) != 0 ||
+         reserve_slow(queue, NULL) != 0))
+      return -1;
+
+    queue_push(queue, priority, elems[i]);
   }
 
-  // Lock the current_size mutex
-  if (pthread_mutex_lock(&queue->pcq_current_size_lock) != 0)
-    return NULL;
+  // a single wakeup for the whole batch
+  return wake_waiters(queue, &queue->pcq_waiting_poppers, &queue->pcq_popper_condvar);
+}
 
-  // Lock the tail mutex
-  if (pthread_mutex_lock(&queue->pcq_tail_lock) != 0)
-    return NULL;
+void *pcq_dequeue(pc_queue_t *queue)
+{
+  return dequeue(queue, true, NULL);
+}
 
-  // Remove the element from the queue
-  void *elem = queue->pcq_buffer[queue->pcq_tail];
-  queue->pcq_buffer[queue->pcq_tail] = NULL;
-  // Update tail value
-  if (queue->pcq_tail == 0)
-    queue->pcq_tail = queue->pcq_capacity - 1;
-  else
-    queue->pcq_tail--;
+void *pcq_try_dequeue(pc_queue_t *queue)
+{
+  return dequeue(queue, false, NULL);
+}
 
-  // Decrease the current size
-  queue->pcq_current_size--;
+void *pcq_timed_dequeue(pc_queue_t *queue, struct timespec const *abstime)
+{
+  return dequeue(queue, true, abstime);
+}
 
-  // Unlock the tail mutex
-  if (pthread_mutex_unlock(&queue->pcq_tail_lock) != 0)
-    return NULL;
+size_t pcq_dequeue_batch(pc_queue_t *queue, void **elems, size_t max)
+{
+  if (queue == NULL || max == 0)
+  {
+    return 0;
+  }
 
-  // Unlock the current_size mutex
-  if (pthread_mutex_unlock(&queue->pcq_current_size_lock) != 0)
-    return NULL;
+  size_t first = first_priority(queue);
 
-  
-  // Unlock
-  if (pthread_mutex_unlock(&queue->pcq_pusher_condvar_lock) != 0)
-    return NULL;
+  // sleep only for the first element
+  void *elem = queue_pop(queue, first);
+  if (elem == NULL)
+    elem = pop_slow(queue, first, NULL);
+  if (elem == NULL)
+    return 0;
 
-  // signal popper cond var
-  if (pthread_cond_signal(&queue->pcq_popper_condvar) != 0)
-    return NULL;
+  size_t count = 0;
+  elems[count++] = elem;
 
-  return elem;
-}
\ No newline at end of file
+  while (count < max && (elem = queue_pop(queue, 0)) != NULL)
+    elems[count++] = elem;
+
+  // a single wakeup for the whole batch
+  wake_waiters(queue, &queue->pcq_waiting_pushers, &queue->pcq_pusher_condvar);
+
+  return count;
+}
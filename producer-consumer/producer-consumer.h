@@ -2,30 +2,55 @@
 #define __PRODUCER_CONSUMER_H__
 
 #include <pthread.h>
+#include <time.h>
 
 // IMPORTANT: do not change anything in this file
 //
 // This API will be used separately to test your producer consumer
 // implementation
 
+#define PCQ_CACHE_LINE 64
+
+// number of priority classes (0 is the highest)
+#define PCQ_PRIORITIES 3
+
+// by default, one in every PCQ_AGING_INTERVAL dequeues serves a lower class
+// first, so that lower classes are never starved
+#define PCQ_AGING_INTERVAL 8
+
+typedef struct {
+    size_t seq;
+    void *elem;
+} pcq_slot_t;
+
+// bounded lock-free multi-producer multi-consumer ring
 typedef struct {
-    void **pcq_buffer;
-    size_t pcq_capacity;
+    pcq_slot_t *slots;
+    size_t capacity;
 
-    pthread_mutex_t pcq_current_size_lock;
-    size_t pcq_current_size;
+    // producers and consumers each get their own cache line
+    _Alignas(PCQ_CACHE_LINE) size_t head; // next position to enqueue
+    _Alignas(PCQ_CACHE_LINE) size_t tail; // next position to dequeue
+} pcq_ring_t;
 
-    pthread_mutex_t pcq_head_lock;
-    size_t pcq_head;
+typedef struct {
+    // one ring per priority class
+    pcq_ring_t pcq_rings[PCQ_PRIORITIES];
+    size_t pcq_capacity; // elements the queue holds, across every class
 
-    pthread_mutex_t pcq_tail_lock;
-    size_t pcq_tail;
+    // elements in the queue, or about to be pushed (each push reserves its
+    // spot here first, so that the classes together never exceed capacity)
+    _Alignas(PCQ_CACHE_LINE) size_t pcq_size;
 
-    pthread_mutex_t pcq_pusher_condvar_lock;
-    pthread_cond_t pcq_pusher_condvar;
+    size_t pcq_aging_interval; // 0 disables aging
+    _Alignas(PCQ_CACHE_LINE) size_t pcq_dequeues;
 
-    pthread_mutex_t pcq_popper_condvar_lock;
+    // only used to sleep when the queue is full or empty
+    _Alignas(PCQ_CACHE_LINE) pthread_mutex_t pcq_wait_lock;
+    pthread_cond_t pcq_pusher_condvar;
     pthread_cond_t pcq_popper_condvar;
+    size_t pcq_waiting_pushers;
+    size_t pcq_waiting_poppers;
 } pc_queue_t;
 
 // pcq_create: create a queue, with a given (fixed) capacity
@@ -44,9 +69,50 @@ int pcq_destroy(pc_queue_t *queue);
 // If the queue is full, sleep until the queue has space
 int pcq_enqueue(pc_queue_t *queue, void *elem);
 
-// pcq_dequeue: remove an element from the back of the queue
+// pcq_enqueue_priority: insert a new element with the given priority class
+// (pcq_enqueue uses the lowest one)
+//
+// The classes share the queue capacity; if the queue is full, sleep until it
+// has space
+int pcq_enqueue_priority(pc_queue_t *queue, void *elem, size_t priority);
+
+// pcq_try_enqueue: like pcq_enqueue_priority, but fail instead of sleeping
+// if the queue is full
+int pcq_try_enqueue(pc_queue_t *queue, void *elem, size_t priority);
+
+// pcq_timed_enqueue: like pcq_enqueue_priority, but fail if the queue is
+// still full at abstime (CLOCK_REALTIME)
+int pcq_timed_enqueue(pc_queue_t *queue, void *elem, size_t priority, struct timespec const *abstime);
+
+// pcq_enqueue_batch: insert count elements with the given priority class,
+// waking sleeping consumers once for the whole batch
+//
+// If the queue becomes full, sleep until it has space
+int pcq_enqueue_batch(pc_queue_t *queue, void **elems, size_t count, size_t priority);
+
+// pcq_set_aging: serve a lower class first once every interval dequeues
+// (0 to always serve the highest non-empty class first)
+void pcq_set_aging(pc_queue_t *queue, size_t interval);
+
+// pcq_dequeue: remove an element from the back of the queue, taking it from
+// the highest priority class that has one (subject to aging)
 //
 // If the queue is empty, sleep until the queue has an element
 void *pcq_dequeue(pc_queue_t *queue);
 
+// pcq_try_dequeue: like pcq_dequeue, but return NULL instead of sleeping if
+// the queue is empty
+void *pcq_try_dequeue(pc_queue_t *queue);
+
+// pcq_timed_dequeue: like pcq_dequeue, but return NULL if the queue is still
+// empty at abstime (CLOCK_REALTIME)
+void *pcq_timed_dequeue(pc_queue_t *queue, struct timespec const *abstime);
+
+// pcq_dequeue_batch: remove up to max elements into elems, waking sleeping
+// producers once for the whole batch
+//
+// If the queue is empty, sleep until it has an element; returns the number
+// of elements removed
+size_t pcq_dequeue_batch(pc_queue_t *queue, void **elems, size_t max);
+
 #endif // __PRODUCER_CONSUMER_H__
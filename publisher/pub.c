@@ -1,12 +1,165 @@
 #include "logging.h"
 #include "client.h"
 #include "wire_protocol.h"
+#include "shm_ring.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <time.h>
+
+// how long to wait for the broker to make room in a full shared memory ring
+#define SHM_FULL_BACKOFF_NS 50000
+
+// bytes of stdin read at once
+#define INPUT_SIZE 65536
+
+// by default, send the pending messages as soon as stdin has nothing more
+// to read right away
+#define DEFAULT_LINGER_MS 0
+
+static void print_usage()
+{
+  fprintf(stderr, "usage: pub <register_pipe_name> <pipe_name> <box_name> [--shm] [--linger <ms>]\n");
+}
+
+typedef struct
+{
+  int client_fifo;
+  ShmRing *ring; // NULL when messages go through the client pipe
+
+  // wire messages not sent yet, written to the pipe at once (in a single
+  // write up to PIPE_BUF, so never interleaved with anything)
+  char batch[PIPE_BUF];
+  size_t batch_len;
+} Publisher;
+
+// send a message through the shared memory ring, ringing the doorbell if the
+// broker waits for one
+static int sendShmMessage(ShmRing *ring, int client_fifo, char const *message, size_t message_len)
+{
+  while (!shmRingPush(ring, message, message_len))
+  {
+    if (shmRingWake(ring) && wireWrite(client_fifo, SHM_DOORBELL, 0, "", 0) == -1)
+      return -1;
+
+    struct timespec backoff = {.tv_sec = 0, .tv_nsec = SHM_FULL_BACKOFF_NS};
+    nanosleep(&backoff, NULL);
+  }
+
+  if (shmRingWake(ring) && wireWrite(client_fifo, SHM_DOORBELL, 0, "", 0) == -1)
+    return -1;
+
+  return 0;
+}
+
+// write the pending wire messages to the client pipe
+static int flushBatch(Publisher *publisher)
+{
+  if (publisher->batch_len == 0)
+    return 0;
+
+  ssize_t bytes_written;
+  do
+    bytes_written = write(publisher->client_fifo, publisher->batch, publisher->batch_len);
+  while (bytes_written == -1 && errno == EINTR);
+
+  publisher->batch_len = 0;
+  return bytes_written == -1 ? -1 : 0;
+}
+
+// send a message through the ring, or add it to the pending wire messages
+static int sendMessage(Publisher *publisher, char const *message, size_t message_len)
+{
+  if (publisher->ring != NULL)
+    return sendShmMessage(publisher->ring, publisher->client_fifo, message, message_len);
+
+  if (publisher->batch_len + sizeof(WireHeader) + message_len > sizeof(publisher->batch) && flushBatch(publisher) == -1)
+    return -1;
+
+  WireHeader header = {.op_code = SEND_MESSAGE, .flags = 0, .payload_len = (uint16_t)message_len};
+  memcpy(publisher->batch + publisher->batch_len, &header, sizeof(WireHeader));
+  memcpy(publisher->batch + publisher->batch_len + sizeof(WireHeader), message, message_len);
+  publisher->batch_len += sizeof(WireHeader) + message_len;
+  return 0;
+}
+
+// send a line (without the newline) as messages of up to MESSAGE_SIZE - 1
+// bytes, as fgets into a MESSAGE_SIZE buffer would split it
+static int sendLine(Publisher *publisher, char const *line, size_t line_len)
+{
+  while (line_len >= MESSAGE_SIZE - 1)
+  {
+    if (sendMessage(publisher, line, MESSAGE_SIZE - 1) == -1)
+      return -1;
+    line += MESSAGE_SIZE - 1;
+    line_len -= MESSAGE_SIZE - 1;
+  }
+
+  return sendMessage(publisher, line, line_len);
+}
+
+// send every message in stdin, reading it in large chunks
+static int sendInput(Publisher *publisher, char const *client_pipe_name, int linger_ms)
+{
+  char input[INPUT_SIZE];
+  size_t input_len = 0;
+
+  while (1)
+  {
+    // give stdin linger_ms to add to the pending messages before sending them
+    struct pollfd stdin_poll = {.fd = STDIN_FILENO, .events = POLLIN};
+    if (publisher->batch_len > 0 && poll(&stdin_poll, 1, linger_ms) == 0 && flushBatch(publisher) == -1)
+      return -1;
+
+    ssize_t bytes_read = read(STDIN_FILENO, input + input_len, sizeof(input) - input_len);
+    if (bytes_read == -1 && errno == EINTR)
+      continue;
+    if (bytes_read <= 0)
+      break;
+    input_len += (size_t)bytes_read;
+
+    // check if fifo is open
+    if (access(client_pipe_name, F_OK) != 0)
+      return -1;
+
+    // the message is the line, without the newline
+    size_t start = 0;
+    char *newline;
+    while ((newline = memchr(input + start, '\n', input_len - start)) != NULL)
+    {
+      if (sendLine(publisher, input + start, (size_t)(newline - (input + start))) == -1)
+        return -1;
+      start = (size_t)(newline - input) + 1;
+    }
+
+    // a line too long to be a single message
+    while (input_len - start >= MESSAGE_SIZE - 1)
+    {
+      if (sendMessage(publisher, input + start, MESSAGE_SIZE - 1) == -1)
+        return -1;
+      start += MESSAGE_SIZE - 1;
+    }
+
+    memmove(input, input + start, input_len - start);
+    input_len -= start;
+  }
+
+  // the last line, with no newline
+  if (input_len > 0 && sendMessage(publisher, input, input_len) == -1)
+    return -1;
+
+  return flushBatch(publisher);
+}
 
 int main(int argc, char **argv)
 {
-  if (argc != 4)
+  if (argc < 4)
   {
     WARN("number of arguments invalid");
+    print_usage();
     return -1;
   }
 
@@ -14,10 +167,56 @@ int main(int argc, char **argv)
   char *client_pipe_name = argv[2];
   char *box_name = argv[3];
 
+  // options: --shm, --linger <ms>
+  bool use_shm = false;
+  int linger_ms = DEFAULT_LINGER_MS;
+  for (int i = 4; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--shm") == 0)
+      use_shm = true;
+    else if (strcmp(argv[i], "--linger") == 0 && i + 1 < argc)
+    {
+      // a whole, non-negative number of milliseconds
+      char *end;
+      errno = 0;
+      long ms = strtol(argv[++i], &end, 10);
+      if (end == argv[i] || *end != '\0' || errno != 0 || ms < 0 || ms > INT_MAX)
+      {
+        WARN("invalid linger time %s", argv[i]);
+        print_usage();
+        return -1;
+      }
+      linger_ms = (int)ms;
+    }
+    else
+    {
+      WARN("number of arguments invalid");
+      print_usage();
+      return -1;
+    }
+  }
+
+  // with --shm, send messages through a shared memory ring instead of the
+  // client pipe (falling back to the pipe if the ring cannot be created)
+  ShmRing *ring = NULL;
+  char shm_name[NAME_MAX + 1];
+  if (use_shm)
+  {
+    if (shmRingName(shm_name, sizeof(shm_name), client_pipe_name) == 0)
+      ring = shmRingCreate(shm_name);
+    if (ring == NULL)
+      WARN("Error creating shared memory ring, using the client pipe");
+  }
+
   // connect to server
-  if (connect(REGISTER_PUBLISHER, register_pipe_name, client_pipe_name, box_name) == -1)
+  if (connect(REGISTER_PUBLISHER, ring != NULL ? WIRE_FLAG_SHM : 0, register_pipe_name, client_pipe_name, box_name) == -1)
   {
     WARN("error connecting to server");
+    if (ring != NULL)
+    {
+      shmRingClose(ring);
+      shm_unlink(shm_name);
+    }
     return -1;
   }
 
@@ -30,36 +229,22 @@ int main(int argc, char **argv)
   }
 
   // open the client fifo
-  int client_fifo = open(client_pipe_name, O_WRONLY);
+  Publisher publisher = {.ring = ring, .batch_len = 0};
+  publisher.client_fifo = open(client_pipe_name, O_WRONLY);
 
-  char buffer[MESSAGE_SIZE];
-  char wire_message[PROTOCOL_MESSAGE_SIZE];
-  while (fgets(buffer, MESSAGE_SIZE, stdin) != NULL)
+  // send wire messages to server using client pipe (or the ring)
+  if (sendInput(&publisher, client_pipe_name, linger_ms) == -1)
   {
-    // create wire message
-    snprintf(wire_message, PROTOCOL_MESSAGE_SIZE, "%d|%s", SEND_MESSAGE, buffer);
-
-    // check if fifo is open
-    if (access(client_pipe_name, F_OK) != 0)
-    {
-      WARN("Error sending message\n");
-      return -1;
-    }
-
-    // send wire message to server using client pipe
-    if (write(client_fifo, wire_message, strlen(wire_message) + 1) == -1)
-    {
-      // close client fifo
-      if (close(client_fifo) == -1)
-        WARN("Error closing fifo %s\n", client_pipe_name);
+    // close client fifo
+    if (close(publisher.client_fifo) == -1)
+      WARN("Error closing fifo %s\n", client_pipe_name);
 
-      WARN("Error sending message\n");
-      return -1;
-    };
+    WARN("Error sending message\n");
+    return -1;
   }
 
   // close fifo
-  if (close(client_fifo) == -1)
+  if (close(publisher.client_fifo) == -1)
   {
     WARN("Error closing fifo %s\n", client_pipe_name);
     return -1;
@@ -67,5 +252,13 @@ int main(int argc, char **argv)
 
   // unlink fifo
   unlink(client_pipe_name);
+
+  // the broker drains the ring once it sees the pipe closed, then unmaps it
+  // (the name is already gone, unless the broker never opened it)
+  if (ring != NULL)
+  {
+    shmRingClose(ring);
+    shm_unlink(shm_name);
+  }
   return 0;
 }
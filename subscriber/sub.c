@@ -3,9 +3,80 @@
 #include "wire_protocol.h"
 #include "signal.h"
 #include "errno.h"
+#include "poll.h"
+#include "time.h"
+#include "limits.h"
+
+// bytes read from the client pipe at once
+#define INPUT_SIZE 65536
+
+// bytes of output buffered before writing them to stdout
+#define OUTPUT_SIZE 65536
 
 volatile sig_atomic_t disconnect_flag = 0;
 
+// when buffered output is written to stdout
+typedef enum
+{
+  FLUSH_MESSAGE,  // after every message
+  FLUSH_BATCH,    // once every message received so far is printed
+  FLUSH_INTERVAL, // flush_ms after the first message buffered
+} FlushPolicy;
+
+typedef struct
+{
+  char buffer[OUTPUT_SIZE];
+  size_t len;
+  struct timespec first; // when the first buffered message was added
+} Output;
+
+static void print_usage()
+{
+  fprintf(stderr, "usage: sub <register_pipe_name> <pipe_name> <box_name> [--flush message|batch|<ms>]\n");
+}
+
+static long elapsedMs(struct timespec const *since)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// write the buffered output to stdout
+static int flushOutput(Output *output)
+{
+  size_t done = 0;
+  while (done < output->len)
+  {
+    ssize_t bytes_written = write(STDOUT_FILENO, output->buffer + done, output->len - done);
+    if (bytes_written == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    done += (size_t)bytes_written;
+  }
+
+  output->len = 0;
+  return 0;
+}
+
+// buffer a message for stdout, one per line
+static int printMessage(Output *output, char const *message, size_t message_len)
+{
+  if (output->len + message_len + 1 > sizeof(output->buffer) && flushOutput(output) == -1)
+    return -1;
+
+  if (output->len == 0)
+    clock_gettime(CLOCK_MONOTONIC, &output->first);
+
+  memcpy(output->buffer + output->len, message, message_len);
+  output->buffer[output->len + message_len] = '\n';
+  output->len += message_len + 1;
+  return 0;
+}
+
 static void handleSIGINT(int sig)
 {
   (void)sig;
@@ -14,9 +85,10 @@ static void handleSIGINT(int sig)
 
 int main(int argc, char **argv)
 {
-  if (argc != 4)
+  if (argc != 4 && !(argc == 6 && strcmp(argv[4], "--flush") == 0))
   {
     WARN("number of arguments invalid");
+    print_usage();
     return -1;
   }
 
@@ -24,8 +96,33 @@ int main(int argc, char **argv)
   char *client_pipe_name = argv[2];
   char *box_name = argv[3];
 
+  // --flush message|batch|<ms>
+  FlushPolicy flush = FLUSH_BATCH;
+  int flush_ms = 0;
+  if (argc == 6)
+  {
+    if (strcmp(argv[5], "message") == 0)
+      flush = FLUSH_MESSAGE;
+    else if (strcmp(argv[5], "batch") != 0)
+    {
+      // an interval: a whole, non-negative number of milliseconds
+      char *end;
+      errno = 0;
+      long ms = strtol(argv[5], &end, 10);
+      if (end == argv[5] || *end != '\0' || errno != 0 || ms < 0 || ms > INT_MAX)
+      {
+        WARN("invalid flush policy %s", argv[5]);
+        print_usage();
+        return -1;
+      }
+
+      flush = FLUSH_INTERVAL;
+      flush_ms = (int)ms;
+    }
+  }
+
   // connect to server
-  if (connect(REGISTER_SUBSCRIBER, register_pipe_name, client_pipe_name, box_name) == -1)
+  if (connect(REGISTER_SUBSCRIBER, 0, register_pipe_name, client_pipe_name, box_name) == -1)
   {
     WARN("error connecting to server");
     return -1;
@@ -48,30 +145,77 @@ int main(int argc, char **argv)
   // setup signal handler to handle client CTRL-C
   signal(SIGINT, handleSIGINT);
 
-  char buffer[PROTOCOL_MESSAGE_SIZE];
-  char message[MESSAGE_SIZE];
+  char input[INPUT_SIZE];
+  size_t input_len = 0;
+  Output output = {.len = 0};
   int message_count = 0;
 
-  while (1)
+  while (!disconnect_flag)
   {
-    ssize_t bytes_read = read(client_fifo, buffer, PROTOCOL_MESSAGE_SIZE);
-
+    // time-based flushing: wait for more messages only until the buffered
+    // output is due
+    if (flush == FLUSH_INTERVAL && output.len > 0)
+    {
+      long wait_ms = flush_ms - elapsedMs(&output.first);
+      struct pollfd fifo_poll = {.fd = client_fifo, .events = POLLIN};
+      int ready = wait_ms <= 0 ? 0 : poll(&fifo_poll, 1, (int)wait_ms);
+
+      // interrupted (by CTRL-C)
+      if (ready == -1)
+        continue;
+
+      if (ready == 0)
+      {
+        if (flushOutput(&output) == -1)
+          break;
+        continue;
+      }
+    }
+
+    // read as many wire messages as are available at once
+    ssize_t bytes_read = read(client_fifo, input + input_len, sizeof(input) - input_len);
+
+    // CTRL-C interrupts the read
     if (bytes_read <= 0)
       break;
+    input_len += (size_t)bytes_read;
 
-    if (disconnect_flag)
-      break;
+    size_t start = 0;
+    WireHeader header;
+    void const *payload;
+    ssize_t size;
+    while ((size = wireDecode(input + start, input_len - start, &header, &payload)) > 0)
+    {
+      start += (size_t)size;
+
+      if (header.op_code != SEND_SUBSCRIBER)
+        continue;
+
+      // wire messages carry the text without terminator
+      size_t message_len = strnlen(payload, header.payload_len < MESSAGE_SIZE - 1 ? header.payload_len : MESSAGE_SIZE - 1);
 
-    // parse message in form of "op_code|message" and ignore op_code
-    sscanf(buffer, "%*d|%[^\n]", message);
+      // print message
+      if (printMessage(&output, payload, message_len) == -1 || (flush == FLUSH_MESSAGE && flushOutput(&output) == -1))
+        disconnect_flag = 1;
 
-    // print message
-    fprintf(stdout, "%s\n", message);
+      // increment message count
+      message_count++;
+    }
 
-    // increment message count
-    message_count++;
+    if (size == -1)
+    {
+      WARN("Malformed message from server\n");
+      break;
+    }
+
+    memmove(input, input + start, input_len - start);
+    input_len -= start;
+
+    if (flush == FLUSH_BATCH && flushOutput(&output) == -1)
+      break;
   }
 
+  flushOutput(&output);
   fprintf(stdout, "%d\n", message_count);
 
   // close fifo
@@ -0,0 +1,139 @@
+#include "producer-consumer.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * Batched operations move several elements at once (a batch larger than the
+ * queue waits for room), the non-blocking and timed ones give up instead of
+ * sleeping, and concurrent batched producers and consumers dequeue every
+ * element exactly once.
+ */
+
+#define PRODUCERS (4)
+#define CONSUMERS (3)
+#define PER_PRODUCER (100000)
+#define BATCH (8)
+
+static pc_queue_t queue;
+static unsigned char seen[PRODUCERS * PER_PRODUCER];
+static void *const stop = (void *)UINTPTR_MAX;
+
+// elements are indices into seen, offset by one so that none is NULL
+static void *elem_of(size_t i) { return (void *)(i + 1); }
+static size_t index_of(void *elem) { return (size_t)elem - 1; }
+
+static struct timespec in_ms(long ms) {
+    struct timespec abstime;
+    clock_gettime(CLOCK_REALTIME, &abstime);
+    abstime.tv_nsec += ms * 1000000;
+    abstime.tv_sec += abstime.tv_nsec / 1000000000;
+    abstime.tv_nsec %= 1000000000;
+    return abstime;
+}
+
+static void *producer(void *arg) {
+    size_t id = (size_t)arg;
+    size_t first = id * PER_PRODUCER;
+
+    for (size_t i = 0; i < PER_PRODUCER;) {
+        if (i % 97 == 0 && PER_PRODUCER - i >= BATCH) {
+            void *batch[BATCH];
+            for (size_t j = 0; j < BATCH; j++) {
+                batch[j] = elem_of(first + i + j);
+            }
+            assert(pcq_enqueue_batch(&queue, batch, BATCH,
+                                     id % PCQ_PRIORITIES) == 0);
+            i += BATCH;
+        } else {
+            assert(pcq_enqueue_priority(&queue, elem_of(first + i),
+                                        (id + i) % PCQ_PRIORITIES) == 0);
+            i++;
+        }
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    (void)arg;
+    void *batch[BATCH];
+    for (bool stopped = false; !stopped;) {
+        size_t count = pcq_dequeue_batch(&queue, batch, BATCH);
+        assert(count > 0);
+        for (size_t i = 0; i < count; i++) {
+            if (batch[i] == stop) {
+                // one stop per consumer: hand any other one back
+                if (stopped) {
+                    assert(pcq_enqueue(&queue, stop) == 0);
+                }
+                stopped = true;
+                continue;
+            }
+            __atomic_add_fetch(&seen[index_of(batch[i])], 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+int main() {
+    void *batch[BATCH];
+
+    // a batch in, then out up to the asked count, in order
+    assert(pcq_create(&queue, 4) == 0);
+    for (size_t i = 0; i < 3; i++) {
+        batch[i] = elem_of(i);
+    }
+    assert(pcq_enqueue_batch(&queue, batch, 3, 1) == 0);
+    assert(pcq_dequeue_batch(&queue, batch, 2) == 2);
+    assert(batch[0] == elem_of(0) && batch[1] == elem_of(1));
+    assert(pcq_dequeue_batch(&queue, batch, BATCH) == 1);
+    assert(batch[0] == elem_of(2));
+
+    // nothing to wait for: give up
+    assert(pcq_try_dequeue(&queue) == NULL);
+    struct timespec deadline = in_ms(20);
+    assert(pcq_timed_dequeue(&queue, &deadline) == NULL);
+    for (size_t i = 0; i < 4; i++) {
+        assert(pcq_try_enqueue(&queue, elem_of(i), 0) == 0);
+    }
+    assert(pcq_try_enqueue(&queue, elem_of(4), 0) == -1);
+    deadline = in_ms(20);
+    assert(pcq_timed_enqueue(&queue, elem_of(4), 0, &deadline) == -1);
+    deadline = in_ms(20);
+    assert(pcq_timed_dequeue(&queue, &deadline) == elem_of(0));
+    assert(pcq_destroy(&queue) == 0);
+
+    // batches larger than the queue, so that producers and consumers keep
+    // sleeping
+    assert(pcq_create(&queue, 5) == 0);
+    pthread_t producers[PRODUCERS];
+    pthread_t consumers[CONSUMERS];
+    for (size_t i = 0; i < CONSUMERS; i++) {
+        assert(pthread_create(&consumers[i], NULL, consumer, NULL) == 0);
+    }
+    for (size_t i = 0; i < PRODUCERS; i++) {
+        assert(pthread_create(&producers[i], NULL, producer, (void *)i) == 0);
+    }
+    for (size_t i = 0; i < PRODUCERS; i++) {
+        assert(pthread_join(producers[i], NULL) == 0);
+    }
+    for (size_t i = 0; i < CONSUMERS; i++) {
+        assert(pcq_enqueue(&queue, stop) == 0);
+    }
+    for (size_t i = 0; i < CONSUMERS; i++) {
+        assert(pthread_join(consumers[i], NULL) == 0);
+    }
+
+    for (size_t i = 0; i < PRODUCERS * PER_PRODUCER; i++) {
+        assert(seen[i] == 1);
+    }
+    assert(pcq_try_dequeue(&queue) == NULL);
+    assert(pcq_destroy(&queue) == 0);
+
+    printf("Successful test.\n");
+    return 0;
+}
@@ -0,0 +1,57 @@
+#include "producer-consumer.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * The priority classes share the queue's capacity, are served highest first
+ * (in order within a class), and aging serves a lower class once every
+ * interval dequeues.
+ */
+
+static void *elem_of(size_t i) { return (void *)(i + 1); }
+
+int main() {
+    pc_queue_t queue;
+
+    // the classes together hold no more than the capacity
+    assert(pcq_create(&queue, 4) == 0);
+    pcq_set_aging(&queue, 0);
+    assert(pcq_try_enqueue(&queue, elem_of(0), 2) == 0);
+    assert(pcq_try_enqueue(&queue, elem_of(1), 2) == 0);
+    assert(pcq_try_enqueue(&queue, elem_of(2), 1) == 0);
+    assert(pcq_try_enqueue(&queue, elem_of(3), 0) == 0);
+    assert(pcq_try_enqueue(&queue, elem_of(4), 0) == -1);
+    assert(pcq_try_enqueue(&queue, elem_of(4), PCQ_PRIORITIES) == -1);
+
+    assert(pcq_try_dequeue(&queue) == elem_of(3));
+    assert(pcq_try_dequeue(&queue) == elem_of(2));
+    assert(pcq_try_dequeue(&queue) == elem_of(0));
+    assert(pcq_try_dequeue(&queue) == elem_of(1));
+    assert(pcq_try_dequeue(&queue) == NULL);
+
+    // pcq_enqueue uses the lowest class
+    assert(pcq_enqueue(&queue, elem_of(5)) == 0);
+    assert(pcq_enqueue_priority(&queue, elem_of(6), 0) == 0);
+    assert(pcq_try_dequeue(&queue) == elem_of(6));
+    assert(pcq_try_dequeue(&queue) == elem_of(5));
+    assert(pcq_destroy(&queue) == 0);
+
+    // every second dequeue looks at a lower class first (each in turn); an
+    // empty one falls back to the highest
+    assert(pcq_create(&queue, 8) == 0);
+    pcq_set_aging(&queue, 2);
+    for (size_t i = 0; i < 4; i++) {
+        assert(pcq_enqueue_priority(&queue, elem_of(i), 0) == 0);
+    }
+    assert(pcq_enqueue_priority(&queue, elem_of(9), 2) == 0);
+    assert(pcq_try_dequeue(&queue) == elem_of(0));
+    assert(pcq_try_dequeue(&queue) == elem_of(1)); // class 1 is empty
+    assert(pcq_try_dequeue(&queue) == elem_of(2));
+    assert(pcq_try_dequeue(&queue) == elem_of(9)); // class 2
+    assert(pcq_try_dequeue(&queue) == elem_of(3));
+    assert(pcq_destroy(&queue) == 0);
+
+    printf("Successful test.\n");
+    return 0;
+}
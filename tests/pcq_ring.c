@@ -0,0 +1,72 @@
+#include "producer-consumer.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Under concurrent producers and consumers, on a queue small enough that
+ * they keep sleeping on it, every element is dequeued exactly once.
+ */
+
+#define PRODUCERS (4)
+#define CONSUMERS (3)
+#define PER_PRODUCER (100000)
+
+static pc_queue_t queue;
+static unsigned char seen[PRODUCERS * PER_PRODUCER];
+static void *const stop = (void *)UINTPTR_MAX;
+
+// elements are indices into seen, offset by one so that none is NULL
+static void *elem_of(size_t i) { return (void *)(i + 1); }
+static size_t index_of(void *elem) { return (size_t)elem - 1; }
+
+static void *producer(void *arg) {
+    size_t first = (size_t)arg * PER_PRODUCER;
+    for (size_t i = 0; i < PER_PRODUCER; i++) {
+        assert(pcq_enqueue(&queue, elem_of(first + i)) == 0);
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    (void)arg;
+    void *elem;
+    while ((elem = pcq_dequeue(&queue)) != stop) {
+        assert(elem != NULL);
+        __atomic_add_fetch(&seen[index_of(elem)], 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+int main() {
+    assert(pcq_create(&queue, 5) == 0);
+
+    pthread_t producers[PRODUCERS];
+    pthread_t consumers[CONSUMERS];
+    for (size_t i = 0; i < CONSUMERS; i++) {
+        assert(pthread_create(&consumers[i], NULL, consumer, NULL) == 0);
+    }
+    for (size_t i = 0; i < PRODUCERS; i++) {
+        assert(pthread_create(&producers[i], NULL, producer, (void *)i) == 0);
+    }
+    for (size_t i = 0; i < PRODUCERS; i++) {
+        assert(pthread_join(producers[i], NULL) == 0);
+    }
+    // one stop per consumer
+    for (size_t i = 0; i < CONSUMERS; i++) {
+        assert(pcq_enqueue(&queue, stop) == 0);
+    }
+    for (size_t i = 0; i < CONSUMERS; i++) {
+        assert(pthread_join(consumers[i], NULL) == 0);
+    }
+
+    for (size_t i = 0; i < PRODUCERS * PER_PRODUCER; i++) {
+        assert(seen[i] == 1);
+    }
+    assert(pcq_destroy(&queue) == 0);
+
+    printf("Successful test.\n");
+    return 0;
+}
@@ -0,0 +1,130 @@
+#include "shm_ring.h"
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Messages cross the ring in order (wrapping around its end many times)
+ * between a producer and a consumer mapping it separately, the doorbell is
+ * only needed once the consumer sleeps, and a ring forged by the producer is
+ * reported as corrupted rather than read out of bounds.
+ */
+
+#define MESSAGES (500000)
+
+static ShmRing *producer_side;
+static ShmRing *consumer_side;
+
+static size_t message(char *buffer, size_t size, int i) {
+    // lengths vary, so that records end at every offset
+    int len = snprintf(buffer, size, "message %d %.*s", i, i % 61,
+                       "-------------------------------------------------------"
+                       "------");
+    assert(len > 0 && (size_t)len < size);
+    return (size_t)len;
+}
+
+static void *producer(void *arg) {
+    (void)arg;
+    char buffer[128];
+    for (int i = 0; i < MESSAGES; i++) {
+        size_t len = message(buffer, sizeof(buffer), i);
+        while (!shmRingPush(producer_side, buffer, len)) {
+            sched_yield(); // full
+        }
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    (void)arg;
+    char expected[128];
+    for (int i = 0; i < MESSAGES;) {
+        char const *text;
+        size_t len;
+        int ret = shmRingFront(consumer_side, &text, &len);
+        assert(ret != -1);
+        if (ret == 0) {
+            sched_yield(); // empty
+            continue;
+        }
+
+        size_t expected_len = message(expected, sizeof(expected), i);
+        assert(len == expected_len && memcmp(text, expected, len) == 0);
+        shmRingPop(consumer_side, len);
+        i++;
+    }
+    return NULL;
+}
+
+int main() {
+    char name[128];
+    char pipe_name[64];
+    snprintf(pipe_name, sizeof(pipe_name), "/tmp/shm_ring_test_%d", getpid());
+    assert(shmRingName(name, sizeof(name), pipe_name) == 0);
+    assert(strchr(name + 1, '/') == NULL);
+
+    producer_side = shmRingCreate(name);
+    assert(producer_side != NULL);
+    assert(shmRingCreate(name) == NULL); // already exists
+    consumer_side = shmRingOpen(name);
+    assert(consumer_side != NULL);
+
+    // the consumer starts asleep: the first push needs the doorbell, the
+    // next ones do not until it sleeps again
+    char const *text;
+    size_t len;
+    assert(shmRingPush(producer_side, "a", 1));
+    assert(shmRingWake(producer_side));
+    assert(shmRingPush(producer_side, "b", 1));
+    assert(!shmRingWake(producer_side));
+    assert(!shmRingSleep(consumer_side)); // not empty
+    for (char c = 'a'; c <= 'b'; c++) {
+        assert(shmRingFront(consumer_side, &text, &len) == 1);
+        assert(len == 1 && *text == c);
+        shmRingPop(consumer_side, len);
+    }
+    assert(shmRingFront(consumer_side, &text, &len) == 0);
+    assert(shmRingSleep(consumer_side));
+    assert(shmRingPush(producer_side, "c", 1));
+    assert(shmRingWake(producer_side));
+    assert(shmRingFront(consumer_side, &text, &len) == 1);
+    shmRingPop(consumer_side, len);
+
+    pthread_t producer_thread;
+    pthread_t consumer_thread;
+    assert(pthread_create(&consumer_thread, NULL, consumer, NULL) == 0);
+    assert(pthread_create(&producer_thread, NULL, producer, NULL) == 0);
+    assert(pthread_join(producer_thread, NULL) == 0);
+    assert(pthread_join(consumer_thread, NULL) == 0);
+    assert(shmRingFront(consumer_side, &text, &len) == 0);
+
+    // a producer claiming more than the ring holds
+    uint64_t tail = consumer_side->tail;
+    producer_side->head = tail + SHM_RING_SIZE + 8;
+    assert(shmRingFront(consumer_side, &text, &len) == -1);
+
+    // a record longer than what was written
+    uint32_t forged = 64;
+    memcpy(producer_side->data + tail % SHM_RING_SIZE, &forged,
+           sizeof(forged));
+    producer_side->head = tail + 8;
+    assert(shmRingFront(consumer_side, &text, &len) == -1);
+
+    // a wrap past what was written
+    forged = UINT32_MAX;
+    memcpy(producer_side->data + tail % SHM_RING_SIZE, &forged,
+           sizeof(forged));
+    if (SHM_RING_SIZE - tail % SHM_RING_SIZE > 8) {
+        assert(shmRingFront(consumer_side, &text, &len) == -1);
+    }
+
+    shmRingClose(consumer_side);
+    shmRingClose(producer_side);
+
+    printf("Successful test.\n");
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include "operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Files grow through their direct, single indirect and double indirect
+ * blocks up to the maximum file size, read back across each boundary, and
+ * give every block (indirect ones included) back when truncated.
+ */
+
+// small blocks, so that the double indirect blocks are reached quickly
+#define BLOCK (64)
+#define POINTERS (BLOCK / sizeof(int))
+#define DIRECT (10)
+
+#define DIRECT_END (DIRECT * BLOCK)
+#define INDIRECT_END (DIRECT_END + POINTERS * BLOCK)
+#define MAX_SIZE (INDIRECT_END + POINTERS * POINTERS * BLOCK)
+
+// data blocks of a file of the maximum size, and the indirect ones
+#define MAX_BLOCKS (DIRECT + POINTERS + POINTERS * POINTERS + 2 + POINTERS)
+
+static char contents[MAX_SIZE];
+static char buffer[MAX_SIZE];
+
+static size_t blocks_of(char const *name) {
+    tfs_stat_t st;
+    assert(tfs_stat(name, &st) == 0);
+    return st.st_blocks;
+}
+
+static void check_contents(int f, size_t offset, size_t len) {
+    assert(tfs_pread(f, buffer, len, offset) == (ssize_t)len);
+    assert(memcmp(buffer, contents + offset, len) == 0);
+}
+
+int main() {
+    for (size_t i = 0; i < MAX_SIZE; i++) {
+        contents[i] = (char)('a' + i % 23);
+    }
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK;
+    params.max_block_count = MAX_BLOCKS + 64;
+    assert(tfs_init(&params) != -1);
+
+    // writes straddling each boundary
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    size_t boundaries[] = {DIRECT_END, INDIRECT_END};
+    for (size_t i = 0; i < 2; i++) {
+        size_t at = boundaries[i] - BLOCK / 2;
+        assert(tfs_pwrite(f, contents + at, BLOCK, at) == BLOCK);
+        check_contents(f, at, BLOCK);
+    }
+    // data blocks, plus the single indirect one, the double indirect one and
+    // its first table
+    assert(blocks_of("/f") == 4 + 3);
+
+    // the whole file, in writes that do not line up with blocks
+    size_t chunk = 3 * BLOCK + 7;
+    for (size_t offset = 0; offset < MAX_SIZE; offset += chunk) {
+        size_t len = MAX_SIZE - offset < chunk ? MAX_SIZE - offset : chunk;
+        assert(tfs_pwrite(f, contents + offset, len, offset) == (ssize_t)len);
+    }
+    check_contents(f, 0, MAX_SIZE);
+    check_contents(f, DIRECT_END - 1, 2);
+    check_contents(f, INDIRECT_END - 1, 2);
+    check_contents(f, MAX_SIZE - 1, 1);
+    assert(blocks_of("/f") == MAX_BLOCKS);
+
+    // nothing fits past the maximum size
+    assert(tfs_pwrite(f, "x", 1, MAX_SIZE) == 0);
+    assert(tfs_pwrite(f, contents, 2, MAX_SIZE - 1) == 1);
+
+    // truncating to each boundary frees the indirect blocks left empty
+    assert(tfs_truncate(f, INDIRECT_END + 1) == 0);
+    assert(blocks_of("/f") == DIRECT + 1 + POINTERS + 1 + 1 + 1);
+    assert(tfs_truncate(f, INDIRECT_END) == 0);
+    assert(blocks_of("/f") == DIRECT + 1 + POINTERS);
+    assert(tfs_truncate(f, DIRECT_END + 1) == 0);
+    assert(blocks_of("/f") == DIRECT + 1 + 1);
+    assert(tfs_truncate(f, DIRECT_END) == 0);
+    assert(blocks_of("/f") == DIRECT);
+    check_contents(f, 0, DIRECT_END);
+    assert(tfs_close(f) != -1);
+
+    // a hole up to the last block only needs the blocks leading to it
+    f = tfs_open("/f", TFS_O_TRUNC);
+    assert(f != -1);
+    assert(blocks_of("/f") == 0);
+    assert(tfs_pwrite(f, "z", 1, MAX_SIZE - 1) == 1);
+    assert(blocks_of("/f") == 3);
+
+    // with the FS full, a truncated file gives back exactly the blocks a
+    // file of the maximum size needs again
+    assert(tfs_pwrite(f, contents, MAX_SIZE, 0) == MAX_SIZE);
+    int g = tfs_open("/g", TFS_O_CREAT);
+    assert(g != -1);
+    while (tfs_write(g, contents, BLOCK) == BLOCK) {
+    }
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open("/f", TFS_O_TRUNC);
+    assert(f != -1);
+    assert(blocks_of("/f") == 0);
+    assert(tfs_write(f, contents, MAX_SIZE) == MAX_SIZE);
+    assert(tfs_write(f, contents, 1) == 0);
+    assert(tfs_write(g, contents, 1) == -1);
+    check_contents(f, 0, MAX_SIZE);
+    assert(tfs_close(f) != -1);
+    assert(tfs_close(g) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include "cache.h"
+#include "operations.h"
+#include <assert.h>
+#include <stdio.h>
+
+/**
+ * The storage cache counts hits and misses, replaces units following CLOCK
+ * (a unit referenced since the last sweep gets a second chance), and, with
+ * a size of 0, treats every access as a miss (delayed, as without a cache).
+ */
+
+#define READS (100)
+
+static void assert_stats(uint64_t hits, uint64_t misses) {
+    uint64_t h;
+    uint64_t m;
+    cache_stats(&h, &m);
+    assert(h == hits && m == misses);
+}
+
+static void assert_hit(size_t block) {
+    assert(cache_access(CACHE_BLOCK, block));
+}
+
+static void assert_miss(size_t block) {
+    assert(!cache_access(CACHE_BLOCK, block));
+}
+
+/**
+ * Read a block-sized file over and over.
+ *
+ * Returns the storage cache counters.
+ */
+static tfs_cache_stats_t reread(size_t cache_size) {
+    tfs_params params = tfs_default_params();
+    params.cache_size = cache_size;
+    assert(tfs_init(&params) != -1);
+
+    char buffer[1024] = {0};
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    for (int i = 0; i < READS; i++) {
+        assert(tfs_pread(f, buffer, sizeof(buffer), 0) == sizeof(buffer));
+    }
+    assert(tfs_close(f) != -1);
+
+    tfs_cache_stats_t stats;
+    tfs_cache_stats(&stats);
+    assert(tfs_destroy() != -1);
+    return stats;
+}
+
+int main() {
+    // three slots, filled in order; the hand is back at the first
+    assert(cache_init(3, 4, 8) == 0);
+    assert_miss(0);
+    assert_miss(1);
+    assert_miss(2);
+    assert_hit(0);
+    assert_stats(1, 3);
+
+    // every unit was referenced: a whole sweep clears them, and the first
+    // one is replaced
+    assert_miss(3);
+    assert_stats(1, 4);
+
+    // 1 is referenced again, so 2 goes instead, though 1 is older
+    assert_hit(1);
+    assert_miss(4);
+    assert_hit(1);
+    assert_hit(3);
+    assert_hit(4);
+    assert_miss(2);
+    assert_miss(0);
+
+    // inodes and blocks with the same number are different units
+    assert(!cache_access(CACHE_INODE, 2));
+    assert(cache_access(CACHE_INODE, 2));
+    cache_destroy();
+
+    // no cache: every access is a miss
+    assert(cache_init(0, 4, 8) == 0);
+    assert_miss(0);
+    assert_miss(0);
+    assert_stats(0, 2);
+    cache_destroy();
+
+    // through the FS: a small cache keeps what is reread, so that only the
+    // first accesses are delayed; without one, every access is
+    tfs_cache_stats_t cached = reread(8);
+    tfs_cache_stats_t uncached = reread(0);
+    assert(uncached.hits == 0);
+    assert(cached.hits + cached.misses == uncached.misses);
+    assert(cached.hits >= 2 * READS);
+    assert(cached.misses < 16);
+
+    printf("Successful test.\n");
+    return 0;
+}
@@ -0,0 +1,130 @@
+#include "operations.h"
+#include <assert.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * The root directory grows past a block of entries, and its index keeps
+ * resolving every name after deletions in the middle of a probe chain (and
+ * after being rebuilt from a restored image).
+ */
+
+#define FILES (400)
+#define CHAIN (8)
+
+// names sharing the low bits of their hash collide at every index capacity
+// up to HASH_MASK + 1
+#define HASH_MASK (1023u)
+
+static char names[FILES + CHAIN][MAX_FILE_NAME];
+static bool deleted[FILES + CHAIN];
+
+// the index's hash (FNV-1a) of a name, without the leading '/'
+static uint32_t name_hash(char const *name) {
+    uint32_t hash = 2166136261u;
+    for (; *name != '\0'; name++) {
+        hash ^= (uint8_t)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void check_names(void) {
+    for (size_t i = 0; i < FILES + CHAIN; i++) {
+        assert(tfs_exists(names[i]) == !deleted[i]);
+        int f = tfs_open(names[i], 0);
+        assert((f != -1) == !deleted[i]);
+        if (f != -1) {
+            char buffer[MAX_FILE_NAME];
+            ssize_t len = (ssize_t)strlen(names[i]);
+            assert(tfs_read(f, buffer, sizeof(buffer)) == len);
+            assert(memcmp(buffer, names[i], (size_t)len) == 0);
+            assert(tfs_close(f) != -1);
+        }
+    }
+}
+
+static void create(size_t i) {
+    int f = tfs_open(names[i], TFS_O_CREAT);
+    assert(f != -1);
+    // each file holds its own name, to tell entries apart
+    ssize_t len = (ssize_t)strlen(names[i]);
+    assert(tfs_write(f, names[i], (size_t)len) == len);
+    assert(tfs_close(f) != -1);
+    deleted[i] = false;
+}
+
+int main() {
+    // a chain of names with the same home slot, then plenty of others
+    uint32_t home = name_hash("c0") & HASH_MASK;
+    size_t n = 0;
+    for (int i = 0; n < CHAIN; i++) {
+        char name[MAX_FILE_NAME - 1]; // '/' is added
+        snprintf(name, sizeof(name), "c%d", i);
+        if ((name_hash(name) & HASH_MASK) == home) {
+            snprintf(names[n++], MAX_FILE_NAME, "/%s", name);
+        }
+    }
+    for (int i = 0; n < FILES + CHAIN; i++) {
+        snprintf(names[n++], MAX_FILE_NAME, "/file%d", i);
+    }
+
+    char dir[] = "/tmp/tfs_dir_index_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char image_path[PATH_MAX];
+    char wal_path[PATH_MAX];
+    snprintf(image_path, sizeof(image_path), "%s/image", dir);
+    snprintf(wal_path, sizeof(wal_path), "%s/image.wal", dir);
+
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = 512;
+    params.image_path = image_path;
+    assert(tfs_init(&params) != -1);
+
+    // far more entries than a directory block holds, with the chain spread
+    // among the rest
+    for (size_t i = 0; i < FILES; i++) {
+        if (i % (FILES / CHAIN) == 0) {
+            create(i / (FILES / CHAIN));
+        }
+        create(CHAIN + i);
+    }
+    check_names();
+
+    // the middle of the chain, and every third other name
+    for (size_t i = 0; i < FILES + CHAIN; i++) {
+        bool in_chain_middle = i > 0 && i < CHAIN - 1 && i % 2 == 1;
+        if (in_chain_middle || (i >= CHAIN && i % 3 == 0)) {
+            assert(tfs_unlink(names[i]) == 0);
+            deleted[i] = true;
+        }
+    }
+    check_names();
+    assert(tfs_unlink(names[1]) == -1);
+
+    // the index is rebuilt from the directory entries on restart
+    assert(tfs_destroy() != -1);
+    assert(tfs_init(&params) != -1);
+    check_names();
+
+    // freed entries are reused
+    for (size_t i = 0; i < FILES + CHAIN; i++) {
+        if (deleted[i]) {
+            create(i);
+        }
+    }
+    check_names();
+    assert(tfs_destroy() != -1);
+
+    unlink(wal_path);
+    unlink(image_path);
+    rmdir(dir);
+
+    printf("Successful test.\n");
+    return 0;
+}
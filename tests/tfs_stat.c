@@ -0,0 +1,147 @@
+#include "operations.h"
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * tfs_stat reports the size, block count and version of a file as writes
+ * and truncates change it, and reports the same after a restart, both from a
+ * checkpointed image and from a replayed log; tfs_exists tells which names
+ * exist.
+ */
+
+#define BLOCK (1024)
+
+static char contents[3 * BLOCK];
+
+static tfs_stat_t stat_of(char const *name) {
+    tfs_stat_t st;
+    assert(tfs_stat(name, &st) == 0);
+    return st;
+}
+
+static void assert_same(tfs_stat_t a, tfs_stat_t b) {
+    assert(a.st_type == b.st_type && a.st_size == b.st_size &&
+           a.st_blocks == b.st_blocks && a.st_nlink == b.st_nlink &&
+           a.st_version == b.st_version);
+}
+
+/**
+ * Change a file, checking its metadata along the way.
+ *
+ * Returns the metadata it is left with.
+ */
+static tfs_stat_t change_file(char const *name) {
+    int f = tfs_open(name, TFS_O_CREAT);
+    assert(f != -1);
+    tfs_stat_t st = stat_of(name);
+    assert(st.st_type == TFS_T_FILE && st.st_size == 0 && st.st_blocks == 0 &&
+           st.st_nlink == 1);
+    uint64_t version = st.st_version;
+
+    assert(tfs_write(f, contents, BLOCK + 1) == BLOCK + 1);
+    st = stat_of(name);
+    assert(st.st_size == BLOCK + 1 && st.st_blocks == 2);
+    assert(st.st_version == version + 1);
+
+    // rewriting changes the version, not the size
+    assert(tfs_pwrite(f, "x", 1, 0) == 1);
+    st = stat_of(name);
+    assert(st.st_size == BLOCK + 1 && st.st_version == version + 2);
+
+    // reading changes nothing
+    char buffer[8];
+    assert(tfs_pread(f, buffer, sizeof(buffer), 0) == sizeof(buffer));
+    assert_same(st, stat_of(name));
+
+    assert(tfs_append(f, contents, 2 * BLOCK, NULL) == 2 * BLOCK);
+    st = stat_of(name);
+    assert(st.st_size == 3 * BLOCK + 1 && st.st_blocks == 4);
+    assert(st.st_version == version + 3);
+
+    assert(tfs_truncate(f, BLOCK / 2) == 0);
+    st = stat_of(name);
+    assert(st.st_size == BLOCK / 2 && st.st_blocks == 1);
+    assert(st.st_version == version + 4);
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open(name, TFS_O_TRUNC);
+    assert(f != -1);
+    st = stat_of(name);
+    assert(st.st_size == 0 && st.st_blocks == 0);
+    assert(st.st_version == version + 5);
+
+    assert(tfs_write(f, contents, 10) == 10);
+    assert(tfs_close(f) != -1);
+    return stat_of(name);
+}
+
+int main() {
+    memset(contents, 'c', sizeof(contents));
+
+    char dir[] = "/tmp/tfs_stat_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char image_path[PATH_MAX];
+    char wal_path[PATH_MAX];
+    snprintf(image_path, sizeof(image_path), "%s/image", dir);
+    snprintf(wal_path, sizeof(wal_path), "%s/image.wal", dir);
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK;
+    params.image_path = image_path;
+
+    assert(tfs_init(&params) != -1);
+    tfs_stat_t st;
+    assert(!tfs_exists("/f"));
+    assert(tfs_stat("/f", &st) == -1);
+    assert(!tfs_exists("f"));
+    assert(!tfs_exists(""));
+
+    tfs_stat_t kept = change_file("/f");
+    assert(tfs_exists("/f"));
+    assert(tfs_stat("/", &st) == -1);
+
+    // from the image written by tfs_destroy
+    assert(tfs_destroy() != -1);
+    assert(tfs_init(&params) != -1);
+    assert(tfs_exists("/f"));
+    assert_same(kept, stat_of("/f"));
+    assert(tfs_destroy() != -1);
+
+    // from the log of a process that died
+    int channel[2];
+    assert(pipe(channel) == 0);
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        assert(tfs_init(&params) != -1);
+        tfs_stat_t logged = change_file("/g");
+        assert(tfs_unlink("/f") == 0);
+        assert(tfs_sync() != -1);
+        assert(write(channel[1], &logged, sizeof(logged)) == sizeof(logged));
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    tfs_stat_t logged;
+    assert(read(channel[0], &logged, sizeof(logged)) == sizeof(logged));
+    close(channel[0]);
+    close(channel[1]);
+
+    assert(tfs_init(&params) != -1);
+    assert(!tfs_exists("/f"));
+    assert(tfs_exists("/g"));
+    assert_same(logged, stat_of("/g"));
+    assert(tfs_destroy() != -1);
+
+    unlink(wal_path);
+    unlink(image_path);
+    rmdir(dir);
+
+    printf("Successful test.\n");
+    return 0;
+}
@@ -0,0 +1,104 @@
+#include "operations.h"
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * Truncating an open file keeps the bytes before the new length (in place,
+ * freeing the blocks past it), and is replayed from the log as a single
+ * change after a crash.
+ */
+
+#define SIZE (3000)
+#define KEPT (1500)
+
+static char contents[SIZE];
+
+static void check_prefix(char const *name, size_t len) {
+    char buffer[SIZE];
+    int f = tfs_open(name, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)len);
+    assert(memcmp(buffer, contents, len) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+static void write_and_truncate(char const *name) {
+    int f = tfs_open(name, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, SIZE) == SIZE);
+    assert(tfs_truncate(f, KEPT) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    for (size_t i = 0; i < SIZE; i++) {
+        contents[i] = (char)('a' + i % 26);
+    }
+
+    assert(tfs_init(NULL) != -1);
+    write_and_truncate("/f");
+    check_prefix("/f", KEPT);
+
+    tfs_stat_t st;
+    size_t block_size = tfs_default_params().block_size;
+    assert(tfs_stat("/f", &st) == 0);
+    assert(st.st_size == KEPT);
+    assert(st.st_blocks == (KEPT + block_size - 1) / block_size);
+
+    int f = tfs_open("/f", 0);
+    assert(f != -1);
+    assert(tfs_truncate(f, KEPT + 1) == -1); // only shrinks
+
+    // the dropped bytes do not come back when the file grows again
+    assert(tfs_pwrite(f, "x", 1, SIZE - 1) == 1);
+    char buffer[SIZE];
+    assert(tfs_pread(f, buffer, SIZE, 0) == SIZE);
+    assert(memcmp(buffer, contents, KEPT) == 0);
+    for (size_t i = KEPT; i < SIZE - 1; i++) {
+        assert(buffer[i] == '\0');
+    }
+
+    assert(tfs_truncate(f, 0) == 0);
+    assert(tfs_stat("/f", &st) == 0);
+    assert(st.st_size == 0 && st.st_blocks == 0);
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    // a crash right after the truncate keeps the rest of the file
+    char dir[] = "/tmp/tfs_truncate_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char image_path[PATH_MAX];
+    char wal_path[PATH_MAX];
+    snprintf(image_path, sizeof(image_path), "%s/image", dir);
+    snprintf(wal_path, sizeof(wal_path), "%s/image.wal", dir);
+    tfs_params params = tfs_default_params();
+    params.image_path = image_path;
+
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        assert(tfs_init(&params) != -1);
+        write_and_truncate("/g");
+        assert(tfs_sync() != -1);
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    assert(tfs_init(&params) != -1);
+    check_prefix("/g", KEPT);
+    assert(tfs_destroy() != -1);
+
+    unlink(wal_path);
+    unlink(image_path);
+    rmdir(dir);
+
+    printf("Successful test.\n");
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include "operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * Positional I/O leaves the file handle's offset alone, appends report
+ * where they wrote, vectored I/O fills and drains buffers split across
+ * block boundaries, and a write to a full FS is short.
+ */
+
+#define BLOCK (1024)
+
+static char contents[4 * BLOCK];
+
+int main() {
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (char)('a' + i % 26);
+    }
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK;
+    params.max_block_count = 16;
+    assert(tfs_init(&params) != -1);
+
+    // pread and pwrite do not move the offset
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "abc", 3) == 3);
+    assert(tfs_pwrite(f, "XY", 2, 1) == 2);
+    assert(tfs_write(f, "d", 1) == 1);
+    char buffer[sizeof(contents)];
+    assert(tfs_pread(f, buffer, sizeof(buffer), 0) == 4);
+    assert(memcmp(buffer, "aXYd", 4) == 0);
+    assert(tfs_pread(f, buffer, 2, 2) == 2);
+    assert(memcmp(buffer, "Yd", 2) == 0);
+    assert(tfs_pread(f, buffer, 2, 4) == 0); // at the end of the file
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open("/f", 0);
+    assert(f != -1);
+    assert(tfs_pread(f, buffer, 1, 3) == 1);
+    assert(tfs_read(f, buffer, 2) == 2);
+    assert(memcmp(buffer, "aX", 2) == 0);
+
+    // appends go to the end, whatever the offset, and report where
+    size_t offset = 0;
+    assert(tfs_append(f, "ef", 2, &offset) == 2);
+    assert(offset == 4);
+    struct iovec parts[] = {{.iov_base = "gh", .iov_len = 2},
+                            {.iov_base = "", .iov_len = 0},
+                            {.iov_base = "ijk", .iov_len = 3}};
+    assert(tfs_appendv(f, parts, 3, &offset) == 5);
+    assert(offset == 6);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 9);
+    assert(memcmp(buffer, "Ydefghijk", 9) == 0);
+    assert(tfs_close(f) != -1);
+
+    // a write and a read split differently across blocks, starting in the
+    // middle of one
+    f = tfs_open("/g", TFS_O_CREAT);
+    assert(f != -1);
+    size_t start = BLOCK / 2;
+    assert(tfs_write(f, contents, start) == (ssize_t)start);
+    struct iovec out[] = {
+        {.iov_base = contents + start, .iov_len = 700},
+        {.iov_base = contents + start + 700, .iov_len = BLOCK},
+        {.iov_base = contents + start + 700 + BLOCK, .iov_len = 1},
+        {.iov_base = contents + start + 701 + BLOCK, .iov_len = BLOCK + 500}};
+    ssize_t total = 700 + BLOCK + 1 + BLOCK + 500;
+    assert(tfs_writev(f, out, 4) == total);
+    assert(tfs_close(f) != -1);
+
+    memset(buffer, 0, sizeof(buffer));
+    struct iovec in[] = {{.iov_base = buffer, .iov_len = 1},
+                         {.iov_base = buffer + 1, .iov_len = BLOCK + 300},
+                         {.iov_base = buffer + BLOCK + 301,
+                          .iov_len = sizeof(buffer) - BLOCK - 301}};
+    f = tfs_open("/g", 0);
+    assert(f != -1);
+    assert(tfs_readv(f, in, 3) == (ssize_t)start + total);
+    assert(memcmp(buffer, contents, (size_t)start + (size_t)total) == 0);
+    assert(tfs_close(f) != -1);
+
+    // writes that do not fit are short, until nothing fits anymore
+    f = tfs_open("/h", TFS_O_CREAT);
+    assert(f != -1);
+    ssize_t written = 0;
+    ssize_t w;
+    while ((w = tfs_write(f, contents, sizeof(contents))) ==
+           (ssize_t)sizeof(contents)) {
+        written += w;
+    }
+    assert(w > 0 && w < (ssize_t)sizeof(contents));
+    written += w;
+    assert(tfs_write(f, contents, 1) == -1);
+    assert(tfs_append(f, contents, 1, &offset) == -1);
+
+    tfs_stat_t st;
+    assert(tfs_stat("/h", &st) == 0);
+    assert(st.st_size == (size_t)written);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+    return 0;
+}
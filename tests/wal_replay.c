@@ -0,0 +1,129 @@
+#include "operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * Replays the log after a crash: the changes made durable are kept, a record
+ * torn by the crash is dropped, and a log older than the image (left behind
+ * by a crash during a checkpoint) is ignored.
+ */
+
+static char image_path[PATH_MAX];
+static char wal_path[PATH_MAX];
+
+static tfs_params image_params(void) {
+    tfs_params params = tfs_default_params();
+    params.image_path = image_path;
+    return params;
+}
+
+/**
+ * Run changes in a child that then dies without destroying the FS (its
+ * changes are only in the log).
+ */
+static void crash_after(void (*changes)(void)) {
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        tfs_params params = image_params();
+        assert(tfs_init(&params) != -1);
+        changes();
+        assert(tfs_sync() != -1);
+        _exit(0);
+    }
+
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static void write_file(char const *name, char const *text, size_t offset) {
+    int f = tfs_open(name, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_pwrite(f, text, strlen(text), offset) == (ssize_t)strlen(text));
+    assert(tfs_close(f) != -1);
+}
+
+static void check_file(char const *name, char const *text) {
+    char buffer[64];
+    int f = tfs_open(name, 0);
+    assert(f != -1);
+    ssize_t r = tfs_read(f, buffer, sizeof(buffer));
+    assert(r == (ssize_t)strlen(text));
+    assert(memcmp(buffer, text, (size_t)r) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+static void copy_file(char const *from, char const *to) {
+    FILE *in = fopen(from, "rb");
+    FILE *out = fopen(to, "wb");
+    assert(in != NULL && out != NULL);
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        assert(fwrite(buffer, 1, n, out) == n);
+    }
+    assert(fclose(in) == 0 && fclose(out) == 0);
+}
+
+static void log_two_writes(void) {
+    write_file("/f", "first", 0);
+    write_file("/f", "second", 5);
+}
+
+static void log_old_write(void) { write_file("/g", "old", 0); }
+
+int main() {
+    char dir[] = "/tmp/tfs_wal_replay_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    snprintf(image_path, sizeof(image_path), "%s/image", dir);
+    snprintf(wal_path, sizeof(wal_path), "%s/image.wal", dir);
+    tfs_params params = image_params();
+
+    // durable changes survive the crash
+    crash_after(log_two_writes);
+    assert(tfs_init(&params) != -1);
+    check_file("/f", "firstsecond");
+    assert(tfs_destroy() != -1);
+
+    // a crash in the middle of writing the last record loses only that one
+    unlink(image_path);
+    crash_after(log_two_writes);
+    struct stat st;
+    assert(stat(wal_path, &st) == 0);
+    assert(truncate(wal_path, st.st_size - 3) == 0);
+
+    assert(tfs_init(&params) != -1);
+    check_file("/f", "first");
+    assert(tfs_destroy() != -1);
+
+    // a log older than the image is not replayed over it
+    char stale_path[PATH_MAX];
+    snprintf(stale_path, sizeof(stale_path), "%s/stale.wal", dir);
+    crash_after(log_old_write);
+    copy_file(wal_path, stale_path);
+    assert(tfs_init(&params) != -1);
+    check_file("/g", "old");
+    write_file("/g", "new", 0);
+    assert(tfs_destroy() != -1);
+    copy_file(stale_path, wal_path);
+
+    assert(tfs_init(&params) != -1);
+    check_file("/g", "new");
+    assert(tfs_destroy() != -1);
+
+    unlink(stale_path);
+    unlink(wal_path);
+    unlink(image_path);
+    rmdir(dir);
+
+    printf("Successful test.\n");
+    return 0;
+}
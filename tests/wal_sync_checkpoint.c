@@ -0,0 +1,99 @@
+#include "config.h"
+#include "operations.h"
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Syncs the log while other threads keep checkpointing it: every sync must
+ * return (a checkpoint empties the log under a sync waiting for it), and
+ * every change must survive.
+ */
+
+#define WRITERS (4)
+#define BLOCK (1024)
+// enough writes, together, for several checkpoints
+#define WRITES (2 * WAL_CHECKPOINT_SIZE / BLOCK)
+#define SYNC_EVERY (16)
+
+static char image_path[PATH_MAX];
+static char wal_path[PATH_MAX];
+static char const *names[WRITERS] = {"/f0", "/f1", "/f2", "/f3"};
+static int writers_done = 0;
+
+static void *writer(void *arg) {
+    size_t id = (size_t)arg;
+    int f = tfs_open(names[id], TFS_O_CREAT);
+    assert(f != -1);
+
+    char buffer[BLOCK];
+    for (int i = 0; i < WRITES; i++) {
+        memset(buffer, 'a' + i % 26, sizeof(buffer));
+        assert(tfs_pwrite(f, buffer, sizeof(buffer), 0) == sizeof(buffer));
+        if (i % SYNC_EVERY == 0) {
+            assert(tfs_sync() != -1);
+        }
+    }
+
+    assert(tfs_close(f) != -1);
+    __atomic_add_fetch(&writers_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void *syncer(void *arg) {
+    (void)arg;
+    while (__atomic_load_n(&writers_done, __ATOMIC_ACQUIRE) < WRITERS) {
+        assert(tfs_sync() != -1);
+    }
+    return NULL;
+}
+
+int main() {
+    char dir[] = "/tmp/tfs_wal_sync_XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    snprintf(image_path, sizeof(image_path), "%s/image", dir);
+    snprintf(wal_path, sizeof(wal_path), "%s/image.wal", dir);
+    tfs_params params = tfs_default_params();
+    params.image_path = image_path;
+
+    // a sync that never returns fails the test instead of hanging it
+    alarm(120);
+
+    assert(tfs_init(&params) != -1);
+    pthread_t writers[WRITERS];
+    pthread_t sync_thread;
+    for (size_t i = 0; i < WRITERS; i++) {
+        assert(pthread_create(&writers[i], NULL, writer, (void *)i) == 0);
+    }
+    assert(pthread_create(&sync_thread, NULL, syncer, NULL) == 0);
+    for (size_t i = 0; i < WRITERS; i++) {
+        assert(pthread_join(writers[i], NULL) == 0);
+    }
+    assert(pthread_join(sync_thread, NULL) == 0);
+    assert(tfs_destroy() != -1);
+
+    // the last write of every writer is in the image
+    char expected[BLOCK];
+    char buffer[BLOCK];
+    memset(expected, 'a' + (WRITES - 1) % 26, sizeof(expected));
+    assert(tfs_init(&params) != -1);
+    for (size_t i = 0; i < WRITERS; i++) {
+        int f = tfs_open(names[i], 0);
+        assert(f != -1);
+        assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+        assert(memcmp(buffer, expected, sizeof(buffer)) == 0);
+        assert(tfs_close(f) != -1);
+    }
+    assert(tfs_destroy() != -1);
+
+    unlink(wal_path);
+    unlink(image_path);
+    rmdir(dir);
+
+    printf("Successful test.\n");
+    return 0;
+}
@@ -1,8 +1,7 @@
 #include "wire_protocol.h"
 #include "logging.h"
-// TODO: we could change the way the protocol works by still using strings, but having aux functions to parse the wire messages and return response structures with the data making it easy and more readble to work with trough the code
 
-int connect(OP_CODE_SIZE op_code, char *register_pipe_name, char *client_pipe_name, char *box_name)
+int connect(OP_CODE_SIZE op_code, uint8_t flags, char *register_pipe_name, char *client_pipe_name, char *box_name)
 {
   // create the client pipe
   if (mkfifo(client_pipe_name, 0666) == -1)
@@ -12,14 +11,16 @@ int connect(OP_CODE_SIZE op_code, char *register_pipe_name, char *client_pipe_na
   }
 
   // create wire message
-  char wire_message[PROTOCOL_MESSAGE_SIZE];
-  snprintf(wire_message, PROTOCOL_MESSAGE_SIZE, "%d|%s|%s", op_code, client_pipe_name, box_name);
+  WireRegistration registration;
+  memset(&registration, 0, sizeof(registration));
+  strncpy(registration.client_pipe_name, client_pipe_name, PIPE_NAME_SIZE - 1);
+  strncpy(registration.box_name, box_name, BOX_NAME_SIZE - 1);
 
   // open register fifo
   int register_fifo = open(register_pipe_name, O_WRONLY);
 
   // send wire message to register client
-  if (write(register_fifo, wire_message, strlen(wire_message) + 1) == -1)
+  if (wireWrite(register_fifo, op_code, flags, &registration, sizeof(registration)) == -1)
   {
     close(register_fifo);
     WARN("Error registering publisher");
@@ -3,6 +3,6 @@
 
 #include "wire_protocol.h"
 
-int connect(OP_CODE_SIZE op_code, char *register_pipe_name, char *client_pipe_name, char *box_name);
+int connect(OP_CODE_SIZE op_code, uint8_t flags, char *register_pipe_name, char *client_pipe_name, char *box_name);
 
 #endif
\ No newline at end of file
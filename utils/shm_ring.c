@@ -0,0 +1,192 @@
+#include "shm_ring.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// a record that only marks the end of the buffer: the next one is at the start
+#define SHM_RECORD_WRAP UINT32_MAX
+
+#define SHM_RECORD_ALIGN 8
+
+static size_t recordSize(size_t len)
+{
+  size_t size = sizeof(uint32_t) + len;
+  return (size + SHM_RECORD_ALIGN - 1) & ~(size_t)(SHM_RECORD_ALIGN - 1);
+}
+
+int shmRingName(char *name, size_t size, char const *client_pipe_name)
+{
+  // a single path component
+  int len = snprintf(name, size, "/mbroker.%s", client_pipe_name);
+  if (len < 0 || (size_t)len >= size)
+    return -1;
+
+  for (char *c = name + 1; *c != '\0'; c++)
+  {
+    if (*c == '/')
+      *c = '.';
+  }
+
+  return 0;
+}
+
+static ShmRing *mapRing(int fd)
+{
+  void *ring = mmap(NULL, sizeof(ShmRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  return ring == MAP_FAILED ? NULL : (ShmRing *)ring;
+}
+
+ShmRing *shmRingCreate(char const *name)
+{
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd == -1)
+    return NULL;
+
+  // a new object is zero-filled: an empty ring
+  if (ftruncate(fd, sizeof(ShmRing)) == -1)
+  {
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+
+  ShmRing *ring = mapRing(fd);
+  if (ring == NULL)
+  {
+    shm_unlink(name);
+    return NULL;
+  }
+
+  // the consumer only starts reading on the first doorbell
+  ring->consumer_waiting = 1;
+  return ring;
+}
+
+ShmRing *shmRingOpen(char const *name)
+{
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd == -1)
+    return NULL;
+
+  // nobody else needs the name, and the object goes away with the mappings
+  shm_unlink(name);
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(ShmRing))
+  {
+    close(fd);
+    return NULL;
+  }
+
+  return mapRing(fd);
+}
+
+void shmRingClose(ShmRing *ring)
+{
+  munmap(ring, sizeof(ShmRing));
+}
+
+bool shmRingPush(ShmRing *ring, char const *text, size_t len)
+{
+  size_t size = recordSize(len);
+  uint64_t head = ring->head; // only written here
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+  // records never wrap around the end of the buffer
+  size_t offset = (size_t)(head % SHM_RING_SIZE);
+  size_t contiguous = SHM_RING_SIZE - offset;
+  size_t needed = size > contiguous ? contiguous + size : size;
+
+  if (head + needed - tail > SHM_RING_SIZE)
+    return false;
+
+  if (size > contiguous)
+  {
+    uint32_t wrap = SHM_RECORD_WRAP;
+    memcpy(ring->data + offset, &wrap, sizeof(uint32_t));
+    head += contiguous;
+    offset = 0;
+  }
+
+  uint32_t record_len = (uint32_t)len;
+  memcpy(ring->data + offset, &record_len, sizeof(uint32_t));
+  memcpy(ring->data + offset + sizeof(uint32_t), text, len);
+
+  __atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+  return true;
+}
+
+bool shmRingWake(ShmRing *ring)
+{
+  // pairs with shmRingSleep: either the consumer sees the new head, or it is
+  // seen waiting here
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  return __atomic_load_n(&ring->consumer_waiting, __ATOMIC_RELAXED) != 0 &&
+         __atomic_exchange_n(&ring->consumer_waiting, 0, __ATOMIC_SEQ_CST) != 0;
+}
+
+int shmRingFront(ShmRing *ring, char const **text, size_t *len)
+{
+  uint64_t tail = ring->tail; // only written by the consumer
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+  // the producer is not trusted: it cannot have written more than the ring
+  // holds, and every record (or wrap) must be within what it wrote, so that
+  // the loop below wraps at most once
+  if (head - tail > SHM_RING_SIZE)
+    return -1;
+
+  while (tail != head)
+  {
+    size_t offset = (size_t)(tail % SHM_RING_SIZE);
+
+    uint32_t record_len;
+    memcpy(&record_len, ring->data + offset, sizeof(uint32_t));
+
+    if (record_len == SHM_RECORD_WRAP)
+    {
+      if (SHM_RING_SIZE - offset > head - tail)
+        return -1;
+
+      tail += SHM_RING_SIZE - offset;
+      __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+      continue;
+    }
+
+    if (recordSize(record_len) > SHM_RING_SIZE - offset || recordSize(record_len) > head - tail)
+      return -1;
+
+    *text = ring->data + offset + sizeof(uint32_t);
+    *len = record_len;
+    return 1;
+  }
+
+  return 0;
+}
+
+void shmRingPop(ShmRing *ring, size_t len)
+{
+  // the length checked by shmRingFront, not the one in the ring now
+  __atomic_store_n(&ring->tail, ring->tail + recordSize(len), __ATOMIC_RELEASE);
+}
+
+bool shmRingSleep(ShmRing *ring)
+{
+  __atomic_store_n(&ring->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail)
+  {
+    __atomic_store_n(&ring->consumer_waiting, 0, __ATOMIC_RELAXED);
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,74 @@
+#ifndef __UTILS_SHM_RING_H__
+#define __UTILS_SHM_RING_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// SHARED MEMORY RING
+// an alternative publisher transport: the publisher writes its messages to a
+// ring in shared memory, and only rings a doorbell (SHM_DOORBELL, on the
+// client pipe) when the broker went to sleep after emptying the ring
+
+// bytes of message records a ring holds (power of two)
+#define SHM_RING_SIZE (1 << 20)
+
+typedef struct
+{
+  // bytes ever written by the producer and consumed by the consumer, each on
+  // its own cache line
+  _Alignas(64) uint64_t head;
+  _Alignas(64) uint64_t tail;
+
+  // set by the consumer once the ring is empty and it waits for a doorbell
+  _Alignas(64) uint32_t consumer_waiting;
+
+  // records: a uint32_t length followed by the text, padded to 8 bytes
+  _Alignas(64) char data[SHM_RING_SIZE];
+} ShmRing;
+
+// shmRingName: name of the shared memory object of a client pipe
+//
+// Returns 0 if successful, -1 if the name does not fit in size bytes
+int shmRingName(char *name, size_t size, char const *client_pipe_name);
+
+// shmRingCreate: create, and map, the ring named name (producer side)
+//
+// Returns NULL on error
+ShmRing *shmRingCreate(char const *name);
+
+// shmRingOpen: map the ring named name, created by the producer, and remove
+// its name (consumer side)
+//
+// Returns NULL on error
+ShmRing *shmRingOpen(char const *name);
+
+// shmRingClose: unmap a ring
+void shmRingClose(ShmRing *ring);
+
+// shmRingPush: add a message to the ring
+//
+// Returns false, without adding it, if the ring is full
+bool shmRingPush(ShmRing *ring, char const *text, size_t len);
+
+// shmRingWake: whether the consumer waits for a doorbell after the messages
+// pushed so far (it then no longer does; the producer must ring it)
+bool shmRingWake(ShmRing *ring);
+
+// shmRingFront: the oldest message in the ring, left in place until
+// shmRingPop
+//
+// Returns 1 if there is one, 0 if the ring is empty, -1 if the ring is
+// corrupted
+int shmRingFront(ShmRing *ring, char const **text, size_t *len);
+
+// shmRingPop: remove the message returned by shmRingFront, given the length
+// it returned
+void shmRingPop(ShmRing *ring, size_t len);
+
+// shmRingSleep: wait for a doorbell, unless the ring is no longer empty
+//
+// Returns false, without waiting, if it is not
+bool shmRingSleep(ShmRing *ring);
+
+#endif // __UTILS_SHM_RING_H__
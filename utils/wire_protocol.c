@@ -0,0 +1,95 @@
+#include "wire_protocol.h"
+
+#include <errno.h>
+
+// read exactly len bytes, unless the writer closes the pipe first
+//
+// A signal interrupting the read before anything arrives is an error (so
+// clients can stop waiting on CTRL-C), but not in the middle of a message
+static ssize_t readFull(int fd, void *buffer, size_t len)
+{
+  size_t done = 0;
+
+  while (done < len)
+  {
+    ssize_t bytes_read = read(fd, (char *)buffer + done, len - done);
+
+    if (bytes_read == -1)
+    {
+      if (errno == EINTR && done > 0)
+        continue;
+      return -1;
+    }
+
+    if (bytes_read == 0)
+      break;
+
+    done += (size_t)bytes_read;
+  }
+
+  return (ssize_t)done;
+}
+
+ssize_t wireWrite(int fd, OP_CODE_SIZE op_code, uint8_t flags, void const *payload, size_t payload_len)
+{
+  if (payload_len > PROTOCOL_MESSAGE_SIZE - sizeof(WireHeader))
+  {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  char wire_message[PROTOCOL_MESSAGE_SIZE];
+
+  WireHeader header = {.op_code = op_code, .flags = flags, .payload_len = (uint16_t)payload_len};
+  memcpy(wire_message, &header, sizeof(WireHeader));
+  memcpy(wire_message + sizeof(WireHeader), payload, payload_len);
+
+  ssize_t bytes_written;
+  do
+    bytes_written = write(fd, wire_message, sizeof(WireHeader) + payload_len);
+  while (bytes_written == -1 && errno == EINTR);
+
+  return bytes_written;
+}
+
+ssize_t wireRead(int fd, WireHeader *header, void *payload, size_t payload_capacity)
+{
+  ssize_t bytes_read = readFull(fd, header, sizeof(WireHeader));
+  if (bytes_read <= 0)
+    return bytes_read;
+  if (bytes_read != sizeof(WireHeader))
+    return -1; // truncated
+
+  size_t stored = header->payload_len < payload_capacity ? header->payload_len : payload_capacity;
+  if (readFull(fd, payload, stored) != (ssize_t)stored)
+    return -1;
+
+  // discard what does not fit
+  char discard[MESSAGE_SIZE];
+  for (size_t left = header->payload_len - stored; left > 0;)
+  {
+    size_t chunk = left < sizeof(discard) ? left : sizeof(discard);
+    if (readFull(fd, discard, chunk) != (ssize_t)chunk)
+      return -1;
+    left -= chunk;
+  }
+
+  return (ssize_t)(sizeof(WireHeader) + header->payload_len);
+}
+
+ssize_t wireDecode(void const *buffer, size_t len, WireHeader *header, void const **payload)
+{
+  if (len < sizeof(WireHeader))
+    return 0;
+
+  memcpy(header, buffer, sizeof(WireHeader));
+
+  size_t size = sizeof(WireHeader) + header->payload_len;
+  if (size > PROTOCOL_MESSAGE_SIZE)
+    return -1;
+  if (len < size)
+    return 0;
+
+  *payload = (char const *)buffer + sizeof(WireHeader);
+  return (ssize_t)size;
+}
@@ -1,3 +1,6 @@
+#ifndef __UTILS_WIRE_PROTOCOL_H__
+#define __UTILS_WIRE_PROTOCOL_H__
+
 // read/write lib
 #include <unistd.h>
 
@@ -27,13 +30,82 @@
 #define RETURN_LIST_BOXES 8
 #define SEND_MESSAGE 9
 #define SEND_SUBSCRIBER 10
+#define SHM_DOORBELL 11
 
 // SIZES
-#define PROTOCOL_MESSAGE_SIZE 1064
-
 #define OP_CODE_SIZE uint8_t
-#define RETURN_CODE_SIZE uint32_t
+#define RETURN_CODE_SIZE int32_t
 #define PIPE_NAME_SIZE 256
 #define BOX_NAME_SIZE 32
 #define MESSAGE_SIZE 1024
-#define BOX_SIZE uint64_t
\ No newline at end of file
+#define BOX_SIZE uint64_t
+
+// WIRE MESSAGES
+// every wire message is a header followed by payload_len bytes of payload;
+// both are packed structs (or raw message text), in host byte order since
+// both ends run on the same machine
+
+typedef struct __attribute__((packed))
+{
+  OP_CODE_SIZE op_code;
+  uint8_t flags;
+  uint16_t payload_len;
+} WireHeader;
+
+// REGISTER_PUBLISHER, REGISTER_SUBSCRIBER, CREATE_BOX, DELETE_BOX, LIST_BOXES
+typedef struct __attribute__((packed))
+{
+  char client_pipe_name[PIPE_NAME_SIZE];
+  char box_name[BOX_NAME_SIZE];
+} WireRegistration;
+
+// RETURN_CREATE_BOX, RETURN_DELETE_BOX
+// only the used part of error_message is sent
+typedef struct __attribute__((packed))
+{
+  RETURN_CODE_SIZE return_code;
+  char error_message[MESSAGE_SIZE];
+} WireReturn;
+
+// RETURN_LIST_BOXES, one per box
+// the last one has WIRE_FLAG_LAST set (and an empty box name if there are no
+// boxes)
+typedef struct __attribute__((packed))
+{
+  char box_name[BOX_NAME_SIZE];
+  BOX_SIZE box_size;
+  uint64_t n_publishers;
+  uint64_t n_subscribers;
+} WireBoxInfo;
+
+#define WIRE_FLAG_LAST 0x1
+
+// REGISTER_PUBLISHER: the publisher sends its messages through a shared
+// memory ring (see shm_ring.h), the client pipe only carrying SHM_DOORBELL
+#define WIRE_FLAG_SHM 0x2
+
+// SEND_MESSAGE, SEND_SUBSCRIBER: the message text, without terminator
+// SHM_DOORBELL: no payload
+
+// largest wire message (smaller than PIPE_BUF, so written atomically)
+#define PROTOCOL_MESSAGE_SIZE (sizeof(WireHeader) + sizeof(WireReturn))
+
+// wireWrite: send a wire message with a single write, so that wire messages
+// from different writers never interleave
+//
+// Returns the number of bytes written, -1 on error
+ssize_t wireWrite(int fd, OP_CODE_SIZE op_code, uint8_t flags, void const *payload, size_t payload_len);
+
+// wireRead: receive a wire message (blocking), storing up to payload_capacity
+// bytes of its payload and discarding the rest
+//
+// Returns the size of the wire message read, 0 at end of file, -1 on error
+ssize_t wireRead(int fd, WireHeader *header, void *payload, size_t payload_capacity);
+
+// wireDecode: find the first wire message in a buffer of received bytes
+//
+// Returns the size of the wire message, 0 if the buffer does not hold all of
+// it yet, -1 if it is malformed (too large)
+ssize_t wireDecode(void const *buffer, size_t len, WireHeader *header, void const **payload);
+
+#endif // __UTILS_WIRE_PROTOCOL_H__
\ No newline at end of file